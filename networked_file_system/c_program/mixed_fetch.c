@@ -0,0 +1,108 @@
+// mixed_fetch.c
+// Reads a set of uncached files on a mount all at once, one thread per file,
+// and reports how long each file took from open() to its last byte along
+// with the aggregate throughput. Meant for a mix of one or two large files
+// and many small ones: with a single transfer queue the small files finish
+// behind the large ones, with chunked shortest-remaining-first scheduling
+// they should finish almost as fast as they would alone.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static volatile int go = 0;
+
+struct job {
+    pthread_t th;
+    const char *path;
+    long long bytes;
+    uint64_t ns;
+    int failed;
+};
+
+static void *run(void *arg) {
+    struct job *j = arg;
+    static __thread char buf[1 << 20];
+    while (!__atomic_load_n(&go, __ATOMIC_ACQUIRE))
+        ;
+    uint64_t t0 = now_ns();
+    int fd = open(j->path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "open('%s') failed: %s\n", j->path, strerror(errno));
+        j->failed = 1;
+        return NULL;
+    }
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof buf)) > 0) j->bytes += n;
+    if (n < 0) {
+        fprintf(stderr, "read('%s') failed: %s\n", j->path, strerror(errno));
+        j->failed = 1;
+    }
+    close(fd);
+    j->ns = now_ns() - t0;
+    return NULL;
+}
+
+static int by_time(const void *a, const void *b) {
+    const struct job *x = a, *y = b;
+    return x->ns < y->ns ? -1 : x->ns > y->ns;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <file> [file...]\n", argv[0]);
+        fprintf(stderr, "Example: %s /mnt/netfs/big.bin /mnt/netfs/small_*\n", argv[0]);
+        return 2;
+    }
+    int n = argc - 1;
+    struct job *jobs = calloc(n, sizeof *jobs);
+    if (!jobs) {
+        fprintf(stderr, "calloc failed\n");
+        return 1;
+    }
+    int started = 0;
+    for (int i = 0; i < n; i++) {
+        jobs[i].path = argv[i + 1];
+        if (pthread_create(&jobs[i].th, NULL, run, &jobs[i]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            break;
+        }
+        started++;
+    }
+    uint64_t t0 = now_ns();
+    __atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+    long long total = 0;
+    int failed = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(jobs[i].th, NULL);
+        total += jobs[i].bytes;
+        failed |= jobs[i].failed;
+    }
+    double wall = (double)(now_ns() - t0) / 1e9;
+    if (started < n || failed) {
+        free(jobs);
+        return 1;
+    }
+
+    qsort(jobs, n, sizeof *jobs, by_time);
+    for (int i = 0; i < n; i++)
+        printf("%10.1f ms %12lld bytes  %s\n", jobs[i].ns / 1e6, jobs[i].bytes, jobs[i].path);
+    printf("files=%d bytes=%lld wall=%.2fs throughput=%.1f MB/s\n", n, total, wall,
+           total / wall / 1e6);
+    printf("completion p50=%.1fms p90=%.1fms p99=%.1fms max=%.1fms\n", jobs[n / 2].ns / 1e6,
+           jobs[n * 9 / 10].ns / 1e6, jobs[n * 99 / 100].ns / 1e6, jobs[n - 1].ns / 1e6);
+    free(jobs);
+    return 0;
+}
@@ -0,0 +1,130 @@
+// mixed_trace.c
+// Replays a working set under a sweep: each step opens and reads through
+// either one of the files in <hot_dir>, picked with a Zipf(0.9) skew, or the
+// next file of <sweep_dir>, each of which is read only once, like a backup
+// walking the tree. Reports the open-to-last-byte time of hot and sweep
+// reads. Mount with --cache-mb=N and compare against --no-admission; the
+// hit ratio is in the "disk cache" line the client prints on SIGUSR1.
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int list_files(const char *dir, char ***out) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        fprintf(stderr, "opendir('%s') failed: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    int n = 0, cap = 64;
+    char **names = malloc(cap * sizeof *names);
+    struct dirent *e;
+    while (names && (e = readdir(d))) {
+        if (e->d_name[0] == '.') continue;
+        if (n == cap) names = realloc(names, (cap *= 2) * sizeof *names);
+        if (!names) break;
+        if (asprintf(&names[n], "%s/%s", dir, e->d_name) < 0) break;
+        n++;
+    }
+    closedir(d);
+    if (!names) {
+        fprintf(stderr, "out of memory\n");
+        return -1;
+    }
+    *out = names;
+    return n;
+}
+
+static int read_through(const char *path, uint64_t *ns) {
+    static char buf[1 << 20];
+    uint64_t t0 = now_ns();
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "open('%s') failed: %s\n", path, strerror(errno));
+        return -1;
+    }
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof buf)) > 0)
+        ;
+    close(fd);
+    if (n < 0) {
+        fprintf(stderr, "read('%s') failed: %s\n", path, strerror(errno));
+        return -1;
+    }
+    *ns = now_ns() - t0;
+    return 0;
+}
+
+static int by_value(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *what, uint64_t *ns, int n) {
+    if (n == 0) return;
+    qsort(ns, n, sizeof *ns, by_value);
+    printf("%-5s n=%d p50=%.2fms p90=%.2fms p99=%.2fms\n", what, n, ns[n / 2] / 1e6,
+           ns[n * 9 / 10] / 1e6, ns[n * 99 / 100] / 1e6);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <hot_dir> <sweep_dir> [steps] [sweep_pct]\n", argv[0]);
+        fprintf(stderr, "Example: %s /mnt/netfs/hot /mnt/netfs/backup 20000 20\n", argv[0]);
+        return 2;
+    }
+    int steps = argc > 3 ? atoi(argv[3]) : 20000;
+    int sweep_pct = argc > 4 ? atoi(argv[4]) : 20;
+    char **hot, **sweep;
+    int nhot = list_files(argv[1], &hot);
+    int nsweep = list_files(argv[2], &sweep);
+    if (nhot <= 0 || nsweep < 0 || steps < 1) {
+        fprintf(stderr, "Bad arguments\n");
+        return 2;
+    }
+
+    // Zipf CDF over the hot files
+    double *cdf = malloc(nhot * sizeof *cdf);
+    uint64_t *hot_ns = malloc(steps * sizeof *hot_ns);
+    uint64_t *sweep_ns = malloc(steps * sizeof *sweep_ns);
+    if (!cdf || !hot_ns || !sweep_ns) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    double total = 0;
+    for (int i = 0; i < nhot; i++) total += 1.0 / pow(i + 1, 0.9);
+    double acc = 0;
+    for (int i = 0; i < nhot; i++) cdf[i] = (acc += 1.0 / pow(i + 1, 0.9) / total);
+
+    srand(1);
+    int nh = 0, ns = 0, next_sweep = 0;
+    for (int s = 0; s < steps; s++) {
+        uint64_t t;
+        if (next_sweep < nsweep && rand() % 100 < sweep_pct) {
+            if (read_through(sweep[next_sweep++], &t) < 0) return 1;
+            sweep_ns[ns++] = t;
+        } else {
+            double u = (double)rand() / RAND_MAX;
+            int i = 0;
+            while (i < nhot - 1 && cdf[i] < u) i++;
+            if (read_through(hot[i], &t) < 0) return 1;
+            hot_ns[nh++] = t;
+        }
+    }
+    report("hot", hot_ns, nh);
+    report("sweep", sweep_ns, ns);
+    return 0;
+}
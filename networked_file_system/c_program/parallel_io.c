@@ -0,0 +1,167 @@
+// parallel_io.c
+// Measures how small reads and writes scale with the number of threads when
+// each thread works on a file of its own. Every thread opens its file once and
+// then does random 4 KiB pread/pwrite calls for a fixed time. With one lock
+// around all client state the total barely grows past one thread; with
+// per-file locking it should grow until the workers are saturated.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define IO_SIZE 4096
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static const char *dir;
+static long file_bytes;
+static double seconds;
+static int write_pct;
+static volatile int go = 0;
+
+struct worker {
+    pthread_t th;
+    int id;
+    int fd;
+    long long ops;
+    int failed;
+};
+
+static int prepare(int id) {
+    char path[4096];
+    snprintf(path, sizeof path, "%s/parallel_io_%d_%d", dir, id, getpid());
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "open('%s') failed: %s\n", path, strerror(errno));
+        return -1;
+    }
+    static char zeros[IO_SIZE];
+    for (long off = 0; off < file_bytes; off += IO_SIZE) {
+        if (pwrite(fd, zeros, IO_SIZE, off) != IO_SIZE) {
+            fprintf(stderr, "pwrite('%s') failed: %s\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+static void cleanup(int id, int fd) {
+    char path[4096];
+    if (fd >= 0) close(fd);
+    snprintf(path, sizeof path, "%s/parallel_io_%d_%d", dir, id, getpid());
+    unlink(path);
+}
+
+static void *run(void *arg) {
+    struct worker *w = arg;
+    char buf[IO_SIZE];
+    unsigned int seed = (unsigned int)w->id * 2654435761u;
+    long blocks = file_bytes / IO_SIZE;
+    memset(buf, 'a' + w->id % 26, sizeof buf);
+
+    while (!__atomic_load_n(&go, __ATOMIC_ACQUIRE))
+        ;
+    uint64_t end = now_ns() + (uint64_t)(seconds * 1e9);
+    while (now_ns() < end) {
+        off_t off = (off_t)(rand_r(&seed) % blocks) * IO_SIZE;
+        ssize_t n = (int)(rand_r(&seed) % 100) < write_pct
+                        ? pwrite(w->fd, buf, IO_SIZE, off)
+                        : pread(w->fd, buf, IO_SIZE, off);
+        if (n < 0) {
+            w->failed = 1;
+            break;
+        }
+        w->ops++;
+    }
+    return NULL;
+}
+
+/* Runs `threads` workers at once, returns total ops/s or -1 on error */
+static double round_of(struct worker *ws, int threads) {
+    __atomic_store_n(&go, 0, __ATOMIC_RELEASE);
+    for (int i = 0; i < threads; i++) {
+        ws[i].ops = 0;
+        ws[i].failed = 0;
+        if (pthread_create(&ws[i].th, NULL, run, &ws[i]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            return -1;
+        }
+    }
+    uint64_t t0 = now_ns();
+    __atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+    long long total = 0;
+    int failed = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ws[i].th, NULL);
+        total += ws[i].ops;
+        failed |= ws[i].failed;
+    }
+    if (failed) {
+        fprintf(stderr, "I/O failed during the run\n");
+        return -1;
+    }
+    return (double)total / ((double)(now_ns() - t0) / 1e9);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <dir> [max_threads] [seconds] [write_pct] [file_kb]\n", argv[0]);
+        fprintf(stderr, "Example: %s /mnt/netfs 16 3 50 1024\n", argv[0]);
+        return 2;
+    }
+    dir = argv[1];
+    int max_threads = argc > 2 ? atoi(argv[2]) : 16;
+    seconds = argc > 3 ? atof(argv[3]) : 3.0;
+    write_pct = argc > 4 ? atoi(argv[4]) : 50;
+    file_bytes = (argc > 5 ? atol(argv[5]) : 1024) * 1024;
+    if (max_threads < 1 || seconds <= 0 || write_pct < 0 || write_pct > 100 ||
+        file_bytes < IO_SIZE) {
+        fprintf(stderr, "Bad arguments\n");
+        return 2;
+    }
+
+    struct worker *ws = calloc(max_threads, sizeof *ws);
+    if (!ws) {
+        fprintf(stderr, "calloc failed\n");
+        return 1;
+    }
+    int rc = 0;
+    for (int i = 0; i < max_threads; i++) ws[i].fd = -1;
+    for (int i = 0; i < max_threads; i++) {
+        ws[i].id = i;
+        ws[i].fd = prepare(i);
+        if (ws[i].fd < 0) {
+            rc = 1;
+            goto out;
+        }
+    }
+
+    double single = 0;
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        double rate = round_of(ws, threads);
+        if (rate < 0) {
+            rc = 1;
+            goto out;
+        }
+        if (threads == 1) single = rate;
+        printf("threads=%-3d ops/s=%-10.0f per_thread=%-10.0f speedup=%.2fx\n", threads, rate,
+               rate / threads, rate / single);
+    }
+
+out:
+    for (int i = 0; i < max_threads; i++)
+        if (ws[i].fd >= 0) cleanup(i, ws[i].fd);
+    free(ws);
+    return rc;
+}
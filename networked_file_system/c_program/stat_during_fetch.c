@@ -0,0 +1,128 @@
+// stat_during_fetch.c
+// Measures stat() latency on a mount while another thread reads a large
+// uncached file (which makes the client fetch it). Names that don't exist
+// are probed so every stat reaches the file system instead of the kernel's
+// attribute cache. With a single dispatch thread the stats queue behind the
+// fetch; with a worker pool they should stay flat.
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline double ns_to_ms(uint64_t ns) { return (double)ns / 1e6; }
+static inline double ns_to_s(uint64_t ns)  { return (double)ns / 1e9; }
+
+static volatile int fetch_done = 0;
+static uint64_t fetch_ns = 0;
+static long long fetch_bytes = 0;
+
+static void *fetch_thread(void *arg) {
+    const char *path = arg;
+    uint64_t t0 = now_ns();
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "open('%s') failed: %s\n", path, strerror(errno));
+    } else {
+        static char buf[1 << 20];
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof buf)) > 0) fetch_bytes += n;
+        close(fd);
+    }
+    fetch_ns = now_ns() - t0;
+    __atomic_store_n(&fetch_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Stats probe names in dir until stop() says so, returns the sample count */
+static size_t probe(const char *dir, const char *tag, uint64_t *lat, size_t max,
+                    long interval_us, int (*stop)(size_t)) {
+    char name[4096];
+    struct stat st;
+    size_t n = 0;
+    while (n < max && !stop(n)) {
+        snprintf(name, sizeof name, "%s/.stat_probe_%s_%zu_%d", dir, tag, n, getpid());
+        uint64_t t0 = now_ns();
+        stat(name, &st); /* ENOENT expected */
+        lat[n++] = now_ns() - t0;
+        usleep(interval_us);
+    }
+    return n;
+}
+
+static void report(const char *label, uint64_t *lat, size_t n) {
+    if (n == 0) {
+        printf("%-8s no samples\n", label);
+        return;
+    }
+    qsort(lat, n, sizeof *lat, cmp_u64);
+    printf("%-8s samples=%zu p50=%.3f ms p99=%.3f ms max=%.3f ms\n", label, n,
+           ns_to_ms(lat[n / 2]), ns_to_ms(lat[(n * 99) / 100]), ns_to_ms(lat[n - 1]));
+}
+
+static size_t baseline_samples;
+static int baseline_stop(size_t n) { return n >= baseline_samples; }
+static int fetch_stop(size_t n) {
+    (void)n;
+    return __atomic_load_n(&fetch_done, __ATOMIC_ACQUIRE);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <big_file> <probe_dir> [interval_ms] [baseline_samples]\n", argv[0]);
+        fprintf(stderr, "Example: %s /mnt/netfs/bigfile /mnt/netfs 10 100\n", argv[0]);
+        return 2;
+    }
+    const char *big = argv[1];
+    const char *dir = argv[2];
+    long interval_ms = argc > 3 ? atol(argv[3]) : 10;
+    baseline_samples = argc > 4 ? (size_t)atol(argv[4]) : 100;
+    if (interval_ms < 0) {
+        fprintf(stderr, "interval_ms must be >= 0\n");
+        return 2;
+    }
+
+    enum { MAX_SAMPLES = 1 << 20 };
+    uint64_t *lat = malloc(MAX_SAMPLES * sizeof *lat);
+    if (!lat) {
+        fprintf(stderr, "malloc failed\n");
+        return 1;
+    }
+
+    /* ---- BASELINE ---- */
+    size_t n = probe(dir, "idle", lat, MAX_SAMPLES, interval_ms * 1000, baseline_stop);
+    report("idle", lat, n);
+
+    /* ---- DURING FETCH ---- */
+    pthread_t th;
+    if (pthread_create(&th, NULL, fetch_thread, (void *)big) != 0) {
+        fprintf(stderr, "pthread_create failed\n");
+        return 1;
+    }
+    usleep(1000); /* let the open reach the file system first */
+    n = probe(dir, "busy", lat, MAX_SAMPLES, interval_ms * 1000, fetch_stop);
+    pthread_join(th, NULL);
+    report("fetch", lat, n);
+
+    printf("Fetched %lld bytes in %.3f s\n", fetch_bytes, ns_to_s(fetch_ns));
+    free(lat);
+    return 0;
+}
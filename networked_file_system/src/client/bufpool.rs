@@ -0,0 +1,126 @@
+use std::{
+    cell::RefCell,
+    ops::{Deref, DerefMut},
+    sync::atomic::{AtomicU64, Ordering},
+};
+
+// Largest FUSE read or write the kernel sends us, see the mount options
+pub(crate) const MAX_IO: usize = 1 << 20;
+// Size classes are powers of two from MIN_CLASS up to MAX_IO, which also
+// covers the transfer copy buffers
+const MIN_CLASS: usize = 4096;
+const CLASSES: usize = (MAX_IO / MIN_CLASS).trailing_zeros() as usize + 1;
+// Free buffers each thread keeps per class, a worker or lane uses one at a
+// time
+const KEEP: usize = 2;
+
+static HITS: AtomicU64 = AtomicU64::new(0);
+static MISSES: AtomicU64 = AtomicU64::new(0);
+static HELD: AtomicU64 = AtomicU64::new(0); // Bytes the pool got from the allocator
+static HIGH_WATER: AtomicU64 = AtomicU64::new(0);
+
+/**
+ * One thread's free buffers by class. Only that thread touches them, so they
+ * need no lock.
+ */
+#[derive(Default)]
+struct FreeLists([Vec<Box<[u8]>>; CLASSES]);
+
+impl Drop for FreeLists {
+    fn drop(&mut self) {
+        // The thread is exiting, its buffers go back to the allocator
+        let bytes: usize = self.0.iter().flatten().map(|buf| buf.len()).sum();
+        HELD.fetch_sub(bytes as u64, Ordering::Relaxed);
+    }
+}
+
+thread_local! {
+    static FREE: RefCell<FreeLists> = RefCell::new(FreeLists::default());
+}
+
+fn class_of(size: usize) -> Option<usize> {
+    if size > MAX_IO {
+        return None;
+    }
+    let size = size.max(MIN_CLASS).next_power_of_two();
+    Some((size / MIN_CLASS).trailing_zeros() as usize)
+}
+
+/**
+ * A buffer of `len` bytes from the pool, given back to the calling thread's
+ * free list when dropped. Its contents are whatever the last user left.
+ */
+pub(crate) struct PooledBuf {
+    buf: Option<Box<[u8]>>,
+    len: usize,
+}
+
+pub(crate) fn get(len: usize) -> PooledBuf {
+    let class = class_of(len);
+    let reused = class.and_then(|c| FREE.with(|free| free.borrow_mut().0[c].pop()));
+    let buf = match reused {
+        Some(buf) => {
+            HITS.fetch_add(1, Ordering::Relaxed);
+            buf
+        }
+        None => {
+            MISSES.fetch_add(1, Ordering::Relaxed);
+            let cap = class.map_or(len, |c| MIN_CLASS << c);
+            let held = HELD.fetch_add(cap as u64, Ordering::Relaxed) + cap as u64;
+            HIGH_WATER.fetch_max(held, Ordering::Relaxed);
+            vec![0u8; cap].into_boxed_slice()
+        }
+    };
+    PooledBuf { buf: Some(buf), len }
+}
+
+impl Deref for PooledBuf {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        &self.buf.as_ref().unwrap()[..self.len]
+    }
+}
+
+impl DerefMut for PooledBuf {
+    fn deref_mut(&mut self) -> &mut [u8] {
+        &mut self.buf.as_mut().unwrap()[..self.len]
+    }
+}
+
+impl Drop for PooledBuf {
+    fn drop(&mut self) {
+        let buf = self.buf.take().unwrap();
+        let cap = buf.len();
+        if let Some(c) = class_of(cap).filter(|&c| MIN_CLASS << c == cap) {
+            // Fails if the thread is exiting, then the buffer just goes
+            let kept = FREE
+                .try_with(|free| {
+                    let lists = &mut free.borrow_mut().0;
+                    if lists[c].len() < KEEP {
+                        lists[c].push(buf);
+                        return true;
+                    }
+                    false
+                })
+                .unwrap_or(false);
+            if kept {
+                return;
+            }
+        }
+        HELD.fetch_sub(cap as u64, Ordering::Relaxed);
+    }
+}
+
+/**
+ * Buffers handed out from a free list and allocated anew, bytes the pool
+ * holds now and the most it ever held.
+ */
+pub(crate) fn counters() -> (u64, u64, u64, u64) {
+    (
+        HITS.load(Ordering::Relaxed),
+        MISSES.load(Ordering::Relaxed),
+        HELD.load(Ordering::Relaxed),
+        HIGH_WATER.load(Ordering::Relaxed),
+    )
+}
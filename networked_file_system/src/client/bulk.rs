@@ -0,0 +1,264 @@
+use crate::sftp_pool::PooledConn;
+use crate::{AttrSource, TULFS};
+
+use networked_file_system::protocol::RemoteAttr;
+
+use libc::{EINVAL, EIO, ENOSYS};
+
+use std::{
+    ffi::OsStr,
+    io::{Read, Write},
+    os::unix::ffi::OsStrExt,
+    path::{Path, PathBuf},
+};
+
+// Paths per bulk stat request. Keeps both the request and the reply well
+// inside the SSH channel window, so writing the request can't block on us not
+// reading the reply yet.
+pub(crate) const BULK_MAX: usize = 512;
+
+// Type, size, mode, uid, gid, atime, mtime, ctime of each path, NUL separated
+// so that any file name survives
+const FIND_FORMAT: &str = r"%p\0%y\0%s\0%m\0%U\0%G\0%A@\0%T@\0%C@\0";
+const FIND_FIELDS: usize = 9;
+
+fn shell_quote(s: &str) -> String {
+    format!("'{}'", s.replace('\'', r"'\''"))
+}
+
+/**
+ * Splits find's "seconds.fraction" timestamps into seconds and nanoseconds.
+ */
+fn parse_time(field: &[u8]) -> (i64, u32) {
+    let s = std::str::from_utf8(field).unwrap_or("0");
+    let (secs, frac) = s.split_once('.').unwrap_or((s, ""));
+    let mut nsec: String = frac.chars().take(9).collect();
+    while nsec.len() < 9 {
+        nsec.push('0');
+    }
+    (secs.parse().unwrap_or(0), nsec.parse().unwrap_or(0))
+}
+
+fn parse_num<T: std::str::FromStr + Default>(field: &[u8]) -> T {
+    std::str::from_utf8(field)
+        .ok()
+        .and_then(|s| s.parse().ok())
+        .unwrap_or_default()
+}
+
+/**
+ * Parses the helper's output into paths and attributes, in the order they
+ * came. A truncated last record is dropped. Also reads back what
+ * encode_entries wrote.
+ */
+pub(crate) fn parse_find_output(out: &[u8]) -> Vec<(PathBuf, RemoteAttr)> {
+    let fields: Vec<&[u8]> = out.split(|&b| b == 0).collect();
+    let mut entries = Vec::with_capacity(fields.len() / FIND_FIELDS);
+    for rec in fields.chunks_exact(FIND_FIELDS) {
+        let (atime, _) = parse_time(rec[6]);
+        let (mtime, mtime_nsec) = parse_time(rec[7]);
+        let (ctime, ctime_nsec) = parse_time(rec[8]);
+        entries.push((
+            PathBuf::from(OsStr::from_bytes(rec[0])),
+            RemoteAttr {
+                is_dir: rec[1] == b"d",
+                size: parse_num(rec[2]),
+                perm: std::str::from_utf8(rec[3])
+                    .ok()
+                    .and_then(|m| u32::from_str_radix(m, 8).ok())
+                    .unwrap_or(0),
+                uid: parse_num(rec[4]),
+                gid: parse_num(rec[5]),
+                atime,
+                mtime,
+                mtime_nsec,
+                ctime,
+                ctime_nsec,
+            },
+        ));
+    }
+    entries
+}
+
+/**
+ * Writes entries out in the helper's format.
+ */
+pub(crate) fn encode_entries(entries: &[(PathBuf, RemoteAttr)]) -> Vec<u8> {
+    let mut out = Vec::with_capacity(entries.len() * 64);
+    for (path, attr) in entries {
+        out.extend_from_slice(path.as_os_str().as_bytes());
+        out.push(0);
+        let fields = [
+            (if attr.is_dir { "d" } else { "f" }).to_string(),
+            attr.size.to_string(),
+            format!("{:o}", attr.perm),
+            attr.uid.to_string(),
+            attr.gid.to_string(),
+            format!("{}.0", attr.atime),
+            format!("{}.{:09}", attr.mtime, attr.mtime_nsec),
+            format!("{}.{:09}", attr.ctime, attr.ctime_nsec),
+        ];
+        for field in fields {
+            out.extend_from_slice(field.as_bytes());
+            out.push(0);
+        }
+    }
+    out
+}
+
+impl TULFS {
+    /**
+     * Runs `cmd` on the server over `conn`, feeding it `input`, and returns
+     * its standard output. One round trip however much comes back.
+     */
+    fn run_helper(
+        &self,
+        conn: &PooledConn,
+        cmd: &str,
+        input: &[u8],
+    ) -> Result<Vec<u8>, libc::c_int> {
+        let mut channel = conn.check(conn.session().channel_session()).map_err(|_| EIO)?;
+        conn.check(channel.exec(cmd)).map_err(|_| EIO)?;
+        if !input.is_empty() {
+            channel.write_all(input).map_err(|_| EIO)?;
+        }
+        channel.send_eof().map_err(|_| EIO)?;
+        let mut out = Vec::new();
+        channel.read_to_end(&mut out).map_err(|_| {
+            conn.mark_broken();
+            EIO
+        })?;
+        let _ = channel.wait_close();
+        // find exits with 1 when some paths are missing, which is fine; a
+        // shell that can't run the helper at all exits with 126/127
+        match channel.exit_status() {
+            Ok(126) | Ok(127) => Err(ENOSYS),
+            Ok(_) => Ok(out),
+            Err(_) => Err(EIO),
+        }
+    }
+
+    /**
+     * Turns the helper's absolute remote paths into paths relative to the
+     * backing root, dropping anything outside of it.
+     */
+    fn rel_entries(&self, entries: Vec<(PathBuf, RemoteAttr)>) -> Vec<(PathBuf, RemoteAttr)> {
+        entries
+            .into_iter()
+            .filter_map(|(path, attr)| {
+                let rel = path.strip_prefix(&self.backing_root).ok()?.to_path_buf();
+                Some((rel, attr))
+            })
+            .collect()
+    }
+
+    fn bulk_available(&self) -> bool {
+        !self.st.lock().unwrap().bulk_broken
+    }
+
+    fn bulk_failed(&self, e: libc::c_int) {
+        if e == ENOSYS {
+            eprintln!("Remote find with -printf not available, falling back to per file stat");
+            self.st.lock().unwrap().bulk_broken = true;
+        }
+    }
+
+    /**
+     * Stats `rel` and everything below it down to `depth` levels (the whole
+     * subtree if None) in one round trip. Returned paths are relative to the
+     * backing root, parents before their children.
+     */
+    pub(crate) fn bulk_stat_tree(
+        &self,
+        rel: &Path,
+        depth: Option<u32>,
+    ) -> Result<Vec<(PathBuf, RemoteAttr)>, libc::c_int> {
+        if !self.bulk_available() {
+            return Err(ENOSYS);
+        }
+        let root = self.get_remote_abs_path(rel);
+        let root = root.to_str().ok_or(EINVAL)?;
+        let mut cmd = format!("find -L {}", shell_quote(root));
+        if let Some(depth) = depth {
+            cmd.push_str(&format!(" -maxdepth {}", depth));
+        }
+        cmd.push_str(&format!(" -printf {}", shell_quote(FIND_FORMAT)));
+        let out = self
+            .run_helper(&self.sftp(), &cmd, &[])
+            .inspect_err(|&e| self.bulk_failed(e))?;
+        Ok(self.rel_entries(parse_find_output(&out)))
+    }
+
+    /**
+     * Stats up to BULK_MAX paths relative to the backing root in one round
+     * trip, along with what is below them down to `depth` levels. Paths that
+     * don't exist are left out of the result.
+     */
+    pub(crate) fn bulk_stat_paths(
+        &self,
+        rels: &[PathBuf],
+        depth: u32,
+    ) -> Result<Vec<(PathBuf, RemoteAttr)>, libc::c_int> {
+        if !self.bulk_available() {
+            return Err(ENOSYS);
+        }
+        let mut input = Vec::new();
+        for rel in rels.iter().take(BULK_MAX) {
+            input.extend_from_slice(self.get_remote_abs_path(rel).as_os_str().as_bytes());
+            input.push(0);
+        }
+        let cmd = format!(
+            "xargs -0 -r sh -c 'exec find -L \"$@\" -maxdepth {} -printf \"$0\"' {}",
+            depth,
+            shell_quote(FIND_FORMAT)
+        );
+        let out = self
+            .run_helper(&self.sftp(), &cmd, &input)
+            .inspect_err(|&e| self.bulk_failed(e))?;
+        Ok(self.rel_entries(parse_find_output(&out)))
+    }
+
+    /**
+     * Stats the whole tree under the backing root, or only what changed
+     * (ctime) at or after server time `newer_than`, in one streamed
+     * transfer. Also returns the server's clock from just before the walk,
+     * to ask for the next delta from.
+     */
+    pub(crate) fn bulk_snapshot(
+        &self,
+        newer_than: Option<i64>,
+    ) -> Result<(i64, Vec<(PathBuf, RemoteAttr)>), libc::c_int> {
+        if !self.bulk_available() {
+            return Err(ENOSYS);
+        }
+        let root = self.backing_root.to_str().ok_or(EINVAL)?;
+        let mut cmd = format!("date +%s && find -L {}", shell_quote(root));
+        if let Some(t) = newer_than {
+            cmd.push_str(&format!(" -newerct @{}", t));
+        }
+        cmd.push_str(&format!(" -printf {}", shell_quote(FIND_FORMAT)));
+        // A transfer in its own right, keep it off the metadata connections
+        let out = self
+            .run_helper(&self.bulk_sftp(), &cmd, &[])
+            .inspect_err(|&e| self.bulk_failed(e))?;
+        let Some(nl) = out.iter().position(|&b| b == b'\n') else {
+            return Err(EIO);
+        };
+        let now = parse_num(&out[..nl]);
+        Ok((now, self.rel_entries(parse_find_output(&out[nl + 1..]))))
+    }
+
+    /**
+     * Fills the inode table and attribute cache from a bulk stat.
+     */
+    pub(crate) fn cache_bulk(&self, entries: &[(PathBuf, RemoteAttr)]) {
+        for (rel, attr) in entries {
+            // The root's attributes are made up locally
+            if rel.as_os_str().is_empty() {
+                continue;
+            }
+            let ino = self.inode_for_path(rel);
+            self.cache_attr(ino, *attr, AttrSource::Sftp);
+        }
+    }
+}
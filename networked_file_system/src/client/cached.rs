@@ -0,0 +1,384 @@
+use crate::transfers::CHUNK;
+use crate::uring::{FixedFile, Target, Uring};
+
+use std::{
+    collections::BTreeSet,
+    fs::File,
+    ops::Range,
+    os::fd::{AsRawFd, RawFd},
+    ptr,
+    sync::{
+        atomic::{AtomicBool, AtomicU64, Ordering},
+        Arc, Condvar, Mutex, RwLock,
+    },
+};
+
+// Mappings are made at least this big, and grown to the next power of two,
+// so a file being appended to isn't remapped on every read
+const MIN_MAPPING: u64 = 1 << 20;
+
+/**
+ * A shared read-only mapping of a cache file. It may reach past the end of
+ * the file, only bytes the file holds are ever looked at: a page past the
+ * end raises SIGBUS. See CachedInode::with_mapped().
+ */
+pub(crate) struct Mapping {
+    ptr: *mut u8,
+    len: usize,
+}
+
+// Only ever read through, and the kernel keeps it coherent with pwrite
+unsafe impl Send for Mapping {}
+unsafe impl Sync for Mapping {}
+
+impl Mapping {
+    fn new(file: &File, len: usize) -> Option<Self> {
+        let ptr = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                len,
+                libc::PROT_READ,
+                libc::MAP_SHARED,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if ptr == libc::MAP_FAILED {
+            return None;
+        }
+        Some(Mapping {
+            ptr: ptr as *mut u8,
+            len,
+        })
+    }
+
+    pub(crate) fn slice(&self, offset: u64, len: usize) -> &[u8] {
+        assert!(offset as usize + len <= self.len);
+        unsafe { std::slice::from_raw_parts(self.ptr.add(offset as usize), len) }
+    }
+}
+
+impl Drop for Mapping {
+    fn drop(&mut self) {
+        unsafe { libc::munmap(self.ptr as *mut libc::c_void, self.len) };
+    }
+}
+
+/**
+ * Chunks punched out of a cache file, and those of them being fetched back.
+ */
+#[derive(Default)]
+struct Holes {
+    absent: BTreeSet<u64>,
+    inflight: BTreeSet<u64>,
+}
+
+/**
+ * Cache state of one inode, shared by all of its open handles: a single cache
+ * fd, the byte ranges written since the last upload and how far the cache file
+ * holds the file's data. Handles only add their access mode on top.
+ */
+pub(crate) struct CachedInode {
+    fixed: Option<FixedFile>, // The fd registered with io_uring, if in use
+    pub(crate) file: File,
+    fetched: AtomicU64,            // Bytes from the start present in the cache file
+    dirty: Mutex<Vec<Range<u64>>>, // Sorted and disjoint
+    map: RwLock<Option<Arc<Mapping>>>, // For reads, made on the first one; see with_mapped()
+    pub(crate) generation: u64,        // Of the cache file in the memory tier
+    // Chunks punched out of the cache file while it was closed, fetched
+    // again before anything reads or writes them. Nearly always empty, so
+    // `has_holes` spares readers the lock
+    holes: Mutex<Holes>,
+    has_holes: AtomicBool,
+    landed: Condvar, // Signalled with `holes` when fetched chunks are in
+
+    touched: Vec<AtomicU64>, // Bitmap of chunks read, for the disk cache
+}
+
+impl AsRawFd for CachedInode {
+    fn as_raw_fd(&self) -> RawFd {
+        self.file.as_raw_fd()
+    }
+}
+
+impl CachedInode {
+    /**
+     * Wraps a cache file whose data is all there.
+     */
+    pub(crate) fn new(file: File, uring: Option<&Arc<Uring>>, generation: u64) -> Self {
+        let len = file.metadata().map(|md| md.len()).unwrap_or(0);
+        CachedInode {
+            fixed: uring.and_then(|uring| uring.register_file(&file)),
+            file,
+            fetched: AtomicU64::new(len),
+            dirty: Mutex::new(Vec::new()),
+            map: RwLock::new(None),
+            generation,
+            holes: Mutex::new(Holes::default()),
+            has_holes: AtomicBool::new(false),
+            landed: Condvar::new(),
+            touched: (0..len.div_ceil(CHUNK).div_ceil(64)).map(|_| AtomicU64::new(0)).collect(),
+        }
+    }
+
+    /**
+     * Records chunks that were punched out of the cache file.
+     */
+    pub(crate) fn punched(&self, chunks: BTreeSet<u64>) {
+        if chunks.is_empty() {
+            return;
+        }
+        let mut holes = self.holes.lock().unwrap();
+        holes.absent.extend(chunks);
+        self.has_holes.store(true, Ordering::Release);
+    }
+
+    pub(crate) fn has_holes(&self) -> bool {
+        self.has_holes.load(Ordering::Acquire)
+    }
+
+    pub(crate) fn absent(&self) -> BTreeSet<u64> {
+        self.holes.lock().unwrap().absent.clone()
+    }
+
+    /**
+     * Makes sure the cache file holds `range`, having `fetch` copy in the
+     * chunks of it that were punched out and waiting for those already on
+     * their way. Once a fill of the whole file returned no fetch is left to
+     * land on top of later writes.
+     */
+    pub(crate) fn fill(
+        &self,
+        range: Range<u64>,
+        mut fetch: impl FnMut(&[u64]) -> Result<(), libc::c_int>,
+    ) -> Result<(), libc::c_int> {
+        if !self.has_holes.load(Ordering::Acquire) || range.is_empty() {
+            return Ok(());
+        }
+        let chunks = range.start / CHUNK..=(range.end - 1) / CHUNK;
+        let mut holes = self.holes.lock().unwrap();
+        loop {
+            let missing: Vec<u64> = holes.absent.range(chunks.clone()).copied().collect();
+            if missing.is_empty() {
+                return Ok(());
+            }
+            let mine: Vec<u64> = missing.into_iter().filter(|i| !holes.inflight.contains(i)).collect();
+            if mine.is_empty() {
+                holes = self.landed.wait(holes).unwrap();
+                continue;
+            }
+            holes.inflight.extend(&mine);
+            drop(holes);
+            let res = fetch(&mine);
+            self.landed(&mine, res.is_ok());
+            res?;
+            holes = self.holes.lock().unwrap();
+        }
+    }
+
+    /**
+     * Chunks of `range` that are punched out and not being fetched yet,
+     * marked as being fetched now. The caller reports them to landed().
+     */
+    pub(crate) fn start_fill(&self, range: Range<u64>) -> Vec<u64> {
+        if !self.has_holes.load(Ordering::Acquire) || range.is_empty() {
+            return Vec::new();
+        }
+        let mut holes = self.holes.lock().unwrap();
+        let chunks = range.start / CHUNK..=(range.end - 1) / CHUNK;
+        let mine: Vec<u64> = holes
+            .absent
+            .range(chunks)
+            .filter(|i| !holes.inflight.contains(i))
+            .copied()
+            .collect();
+        holes.inflight.extend(&mine);
+        mine
+    }
+
+    /**
+     * Records that a fetch of `chunks` finished, and whether they are in.
+     */
+    pub(crate) fn landed(&self, chunks: &[u64], ok: bool) {
+        let mut holes = self.holes.lock().unwrap();
+        for index in chunks {
+            holes.inflight.remove(index);
+            if ok {
+                holes.absent.remove(index);
+            }
+        }
+        self.has_holes.store(!holes.absent.is_empty(), Ordering::Release);
+        self.landed.notify_all();
+    }
+
+    /**
+     * Records a read of `len` bytes at `offset`.
+     */
+    pub(crate) fn touch(&self, offset: u64, len: usize) {
+        if len == 0 {
+            return;
+        }
+        for index in offset / CHUNK..=(offset + len as u64 - 1) / CHUNK {
+            let Some(word) = self.touched.get((index / 64) as usize) else {
+                return; // Grown since opened, writes keep it anyway
+            };
+            let bit = 1 << (index % 64);
+            if word.load(Ordering::Relaxed) & bit == 0 {
+                word.fetch_or(bit, Ordering::Relaxed);
+            }
+        }
+    }
+
+    /**
+     * Chunks read since the state was made.
+     */
+    pub(crate) fn touched(&self) -> Vec<u64> {
+        let mut chunks = Vec::new();
+        for (i, word) in self.touched.iter().enumerate() {
+            let bits = word.load(Ordering::Relaxed);
+            for b in 0..64 {
+                if bits & (1 << b) != 0 {
+                    chunks.push(i as u64 * 64 + b);
+                }
+            }
+        }
+        chunks
+    }
+
+    /**
+     * What io_uring requests on this file should name.
+     */
+    pub(crate) fn target(&self) -> Target {
+        match &self.fixed {
+            Some(fixed) => fixed.target(),
+            None => Target::Fd(self.file.as_raw_fd()),
+        }
+    }
+
+    pub(crate) fn fetched(&self) -> u64 {
+        self.fetched.load(Ordering::Acquire)
+    }
+
+    /**
+     * Makes sure the mapping covers the first `end` bytes, false if the file
+     * can't be mapped. Mappings are only ever replaced by longer ones.
+     */
+    pub(crate) fn map(&self, end: u64) -> bool {
+        if self.map.read().unwrap().as_ref().is_some_and(|map| map.len as u64 >= end) {
+            return true;
+        }
+        let mut map = self.map.write().unwrap();
+        if map.as_ref().is_some_and(|map| map.len as u64 >= end) {
+            return true;
+        }
+        let len = end.max(MIN_MAPPING).next_power_of_two();
+        match Mapping::new(&self.file, len as usize) {
+            Some(new) => {
+                *map = Some(Arc::new(new));
+                true
+            }
+            None => false,
+        }
+    }
+
+    /**
+     * Runs `f` on the mapped bytes of the cache file at `offset`, at most
+     * `len` of them and none past what the file holds, after map() covered
+     * them. The read lock on the mapping is held throughout, so resize()
+     * can't shrink the file under `f`.
+     */
+    pub(crate) fn with_mapped<T>(&self, offset: u64, len: usize, f: impl FnOnce(&[u8]) -> T) -> T {
+        let map = self.map.read().unwrap();
+        let map = map.as_ref().expect("read from a file that was never mapped");
+        // Again under the lock, the file may have shrunk since the caller looked
+        let end = self.fetched().min(offset + len as u64).max(offset);
+        f(map.slice(offset, (end - offset) as usize))
+    }
+
+    /**
+     * Records a write of `len` bytes at `offset`, merging it into the dirty
+     * ranges.
+     */
+    pub(crate) fn wrote(&self, offset: u64, len: usize) {
+        if len == 0 {
+            return;
+        }
+        let mut range = offset..offset + len as u64;
+        self.fetched.fetch_max(range.end, Ordering::AcqRel);
+        let mut dirty = self.dirty.lock().unwrap();
+        // Absorb every range that overlaps or touches the new one
+        let first = dirty.partition_point(|r| r.end < range.start);
+        let mut last = first;
+        while last < dirty.len() && dirty[last].start <= range.end {
+            range.start = range.start.min(dirty[last].start);
+            range.end = range.end.max(dirty[last].end);
+            last += 1;
+        }
+        dirty.splice(first..last, [range]);
+    }
+
+    /**
+     * Records that the cache file now holds `end` bytes matching the remote
+     * file, after both were extended the same way.
+     */
+    pub(crate) fn grew(&self, end: u64) {
+        self.fetched.fetch_max(end, Ordering::AcqRel);
+    }
+
+    /**
+     * Truncates or extends the cache file to `size` bytes, after the remote
+     * file was. Writes past the end are dropped, and so are punched out
+     * chunks there once the fetches of them already under way have landed.
+     * A shrink waits for the readers of the mapping, and lowers what they
+     * may read before the pages go.
+     */
+    pub(crate) fn resize(&self, size: u64) -> std::io::Result<()> {
+        let first = size / CHUNK;
+        let mut holes = self.holes.lock().unwrap();
+        while holes.inflight.range(first..).next().is_some() {
+            holes = self.landed.wait(holes).unwrap();
+        }
+        if size < self.fetched() {
+            let _readers = self.map.write().unwrap();
+            self.fetched.store(size, Ordering::Release);
+            self.file.set_len(size)?;
+        } else {
+            self.file.set_len(size)?;
+            self.fetched.store(size, Ordering::Release);
+        }
+        holes.absent.retain(|&index| index * CHUNK < size);
+        self.has_holes.store(!holes.absent.is_empty(), Ordering::Release);
+        drop(holes);
+        let mut dirty = self.dirty.lock().unwrap();
+        dirty.retain_mut(|r| {
+            r.end = r.end.min(size);
+            r.start < r.end
+        });
+        Ok(())
+    }
+
+    pub(crate) fn is_dirty(&self) -> bool {
+        !self.dirty.lock().unwrap().is_empty()
+    }
+
+    /**
+     * Marks the file clean and returns what was dirty, before an upload reads
+     * it. Writes racing with the upload make it dirty again.
+     */
+    pub(crate) fn take_dirty(&self) -> Vec<Range<u64>> {
+        std::mem::take(&mut *self.dirty.lock().unwrap())
+    }
+
+    /**
+     * Puts back ranges taken for an upload that failed.
+     */
+    pub(crate) fn restore_dirty(&self, ranges: Vec<Range<u64>>) {
+        for r in ranges {
+            self.wrote(r.start, (r.end - r.start) as usize);
+        }
+    }
+}
+
+pub(crate) fn dirty_bytes(ranges: &[Range<u64>]) -> u64 {
+    ranges.iter().map(|r| r.end - r.start).sum()
+}
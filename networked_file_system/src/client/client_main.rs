@@ -1,60 +1,495 @@
+mod bufpool;
+mod bulk;
+mod cached;
+mod copy;
+mod dirs;
+mod diskcache;
+mod fusedev;
+mod leases;
+mod memtier;
+mod notify;
+mod readahead;
+mod resize;
+mod server_conn;
+mod sftp_pool;
+mod snapshot;
+mod stats;
+mod tables;
+mod transfers;
+mod uring;
+mod workers;
+
 use fuser::{
-    FileAttr, FileType, Filesystem, MountOption, ReplyAttr, ReplyData, ReplyEntry,
-    ReplyOpen, ReplyWrite, Request, 
+    consts::FOPEN_KEEP_CACHE, FileAttr, FileType, Filesystem, MountOption, ReplyAttr, ReplyData,
+    ReplyDirectory, ReplyEntry, ReplyOpen, ReplyWrite, Request, Session as FuseSession,
 };
 
-use ssh2::{Session, Sftp};
+use ssh2::FileStat;
+
+use networked_file_system::protocol::{LeaseKind, Message, RemoteAttr};
+use notify::KernelNotifier;
+use readahead::ReadPattern;
+use server_conn::{ServerConn, ServerEvent};
+use sftp_pool::{PooledConn, SftpPool};
+use cached::CachedInode;
+use diskcache::{DiskCache, WHOLE};
+use memtier::MemTier;
+use stats::{CountingAlloc, OpClass, Stats};
+use tables::{FhTable, InodeTable};
+use transfers::{Transfers, CHUNK};
+use uring::Uring;
+use workers::WorkerPool;
+
+use signal_hook::{consts::SIGUSR1, iterator::Signals};
 
 use libc::{
-    EACCES, EEXIST, EINVAL, EIO, ENOENT, ENOTDIR, O_ACCMODE, O_RDONLY, O_RDWR, O_WRONLY, write,
+    EACCES, EEXIST, EINVAL, EIO, ENOENT, ENOTDIR, O_ACCMODE, O_RDONLY, O_RDWR, O_TRUNC, O_WRONLY,
+    write,
 };
 
 use core::str;
 use std::{
-    collections::HashMap,
-    ffi::OsStr,
+    collections::{BTreeMap, BTreeSet, HashMap, HashSet},
+    ffi::{OsStr, OsString},
     fs::{self, File, OpenOptions},
-    io::{Read, Seek, SeekFrom, Write},
+    os::{fd::AsRawFd, unix::fs::FileExt},
+    ops::Range,
     path::{Path, PathBuf},
-    sync::{Arc, Mutex},
-    time::{Duration, SystemTime},
+    sync::{mpsc, Arc, Condvar, Mutex},
+    time::{Duration, Instant, SystemTime},
 };
-const COPY_CHUNK: usize = 1 << 20; // 1 MiB
 
 const TTL: Duration = Duration::from_secs(1); // 1 second
+// Kernel timeout for entries covered by a callback; we invalidate them
+// explicitly when the callback breaks
+const CALLBACK_TTL: Duration = Duration::from_secs(3600);
 const ROOT_INODE: u64 = 1;
 const CACHE_PATH: &str = "/var/tmp/tulfs_cache";
 const PRIVATE_KEY: &str = "/users/tanay24/.ssh/network_fs";
+const DEFAULT_WORKERS: usize = 8;
+const DEFAULT_SESSIONS: usize = 2;
+const DEFAULT_BULK_SESSIONS: usize = 1;
+const DEFAULT_LANES: usize = 4;
+// From fuse_kernel.h, fuser 0.12 doesn't export them
+const FUSE_ATOMIC_O_TRUNC: u32 = 1 << 3;
+const FUSE_BIG_WRITES: u32 = 1 << 5;
+
+#[global_allocator]
+static ALLOC: CountingAlloc = CountingAlloc;
 
 struct OpenEntry {
-    file: File,
+    cached: Arc<CachedInode>, // Shared by every handle of the inode
     ino: u64,
     flags: u32,
-    dirty: bool,
+    pattern: Mutex<ReadPattern>, // Of this handle's reads, for readahead
+}
+
+#[derive(Clone)]
+struct MountConfig {
+    leases: bool,   // Bound staleness with leases instead of relying on callbacks
+    snapshot: bool, // Load the metadata of the whole backing tree at mount
+    uring: bool,    // Do cache file I/O through io_uring
+    mmap: bool,     // Serve reads from a mapping of the cache file
+    splice: bool,   // Splice read and write data between /dev/fuse and the cache file
+    passthrough: bool, // Have the kernel read and write complete cache files itself
+    admission: bool, // Keep closed files only if opened more often than what they'd evict
+    workers: usize,  // Threads running FUSE requests
+    sessions: usize,      // SSH connections for metadata opened at mount, more are opened under load
+    bulk_sessions: usize, // Same for file transfers
+    lanes: usize,         // Fetch and upload chunks in flight at once
+    mem_cache_mb: usize,  // Budget of the in-memory tier, none if 0
+    cache_mb: usize,      // Budget of cache files kept after close, unlimited if 0
+}
+
+impl MountConfig {
+    fn parse(opts: &[&str]) -> Result<MountConfig, String> {
+        let mut config = MountConfig {
+            leases: false,
+            snapshot: false,
+            uring: false,
+            mmap: true,
+            splice: false,
+            passthrough: true,
+            admission: true,
+            workers: DEFAULT_WORKERS,
+            sessions: DEFAULT_SESSIONS,
+            bulk_sessions: DEFAULT_BULK_SESSIONS,
+            lanes: DEFAULT_LANES,
+            mem_cache_mb: 0,
+            cache_mb: 0,
+        };
+        for opt in opts {
+            match *opt {
+                "--leases" => config.leases = true,
+                "--snapshot" => config.snapshot = true,
+                "--uring" => config.uring = true,
+                "--no-mmap" => config.mmap = false,
+                "--splice" => config.splice = true,
+                "--no-passthrough" => config.passthrough = false,
+                "--no-admission" => config.admission = false,
+                _ => {
+                    let (name, value) = opt.split_once('=').unwrap_or((opt, ""));
+                    let n = match value.parse::<usize>() {
+                        Ok(n) if n > 0 => n,
+                        _ => return Err(format!("Bad value in {}", opt)),
+                    };
+                    match name {
+                        "--workers" => config.workers = n,
+                        "--sessions" => config.sessions = n,
+                        "--bulk-sessions" => config.bulk_sessions = n,
+                        "--lanes" => config.lanes = n,
+                        "--mem-cache-mb" => config.mem_cache_mb = n,
+                        "--cache-mb" => config.cache_mb = n,
+                        _ => return Err(format!("Unknown option {}", opt)),
+                    }
+                }
+            }
+        }
+        Ok(config)
+    }
+}
+
+#[derive(Clone, Copy, PartialEq)]
+enum AttrSource {
+    Sftp,     // Plain stat, good for TTL
+    Lease,    // Good while we hold a lease on the inode
+    Callback, // Good until the server tells us otherwise
+}
+
+struct CachedAttr {
+    attr: FileAttr,
+    version: Option<RemoteAttr>, // As reported by the TULFS server
+    callback: bool,              // The server will tell us when this changes
+    fetched: Instant,
+}
+
+struct Lease {
+    kind: LeaseKind,
+    expires: Instant,
+    last_used: Instant,
 }
 
 #[derive(Default)]
 struct State {
-    inode_to_path: HashMap<u64, PathBuf>,
-    path_to_inode: HashMap<PathBuf, u64>,
+    // Shared with TULFS, which uses them without taking this lock
+    inodes: Arc<InodeTable>, // Inode <-> path mappings and open counts
+    files: Arc<FhTable>,     // Map of file handle to OpenEntry
+    tier: Option<Arc<MemTier>>, // Forgets the files whose cache file we delete
+
+    server_up: bool,                  // Callbacks from the TULFS server are being delivered
+    attrs: HashMap<u64, CachedAttr>,  // Attribute cache
+    valid_data: HashSet<u64>,         // Inodes whose local cache file is covered by a callback or lease
+
+    kernel: Arc<KernelNotifier>, // Invalidates the kernel's caches when ours change
+
+    lease_mode: bool,
+    leases: HashMap<u64, Lease>,
+    deferred: HashMap<u64, Instant>, // Closed files with dirty data held under a write lease, by release time
+
+    dirs: HashMap<u64, dirs::DirState>, // Stamps of cached directories for bulk revalidation
+    listed: BTreeMap<PathBuf, u64>,     // Listed directories by path when listed, see due_below
+    bulk_broken: bool,                  // The server can't run the bulk stat helper
+
+    busy: HashSet<u64>, // Inodes being fetched or uploaded, see begin_transfer
+
+    disk: DiskCache,                     // Which closed files keep their cache file
+    absent: HashMap<u64, BTreeSet<u64>>, // Chunks punched out of closed cache files
+}
+
+impl State {
+    fn is_open(&self, ino: u64) -> bool {
+        self.inodes.is_open(ino)
+    }
+
+    fn is_dirty(&self, ino: u64) -> bool {
+        if self.deferred.contains_key(&ino) {
+            return true;
+        }
+        self.inodes.cached(ino).is_some_and(|cached| cached.is_dirty())
+    }
+
+    fn lease_valid(&mut self, ino: u64) -> bool {
+        match self.leases.get_mut(&ino) {
+            Some(lease) if lease.expires > Instant::now() => {
+                lease.last_used = Instant::now();
+                true
+            }
+            _ => false,
+        }
+    }
+
+    fn holds_write_lease(&mut self, ino: u64) -> bool {
+        self.lease_valid(ino) && self.leases[&ino].kind == LeaseKind::Write
+    }
+
+    fn has_valid_attr(&mut self, ino: u64) -> bool {
+        self.valid_attr(ino).is_some()
+    }
+
+    fn valid_attr(&mut self, ino: u64) -> Option<FileAttr> {
+        let leased = self.lease_valid(ino);
+        let cached = self.attrs.get(&ino)?;
+        if cached.callback || leased || cached.fetched.elapsed() < TTL {
+            Some(cached.attr)
+        } else {
+            None
+        }
+    }
+
+    /**
+     * Whether the local cache file of `ino` can be used without fetching:
+     * either some handle has it open or a callback or lease vouches for it.
+     */
+    fn data_covered(&mut self, ino: u64) -> bool {
+        if self.is_open(ino) {
+            return true;
+        }
+        self.valid_data.contains(&ino) && (!self.lease_mode || self.lease_valid(ino))
+    }
+
+    /**
+     * Stops tracking `ino` in the memory tier once its cache file is gone.
+     */
+    fn forget_tier(&self, ino: u64) {
+        if let Some(tier) = &self.tier {
+            tier.forget(ino);
+        }
+    }
+
+    /**
+     * Drops the cached copy of `ino`, keeping the local file if a handle
+     * still uses it.
+     */
+    fn drop_cached(&mut self, ino: u64, cache_dir: &Path) {
+        self.kernel.inval_inode(ino, 0, 0);
+        self.attrs.remove(&ino);
+        if self.dirs.remove(&ino).is_some() {
+            if let Some(rel) = self.inodes.path(ino) {
+                self.listed.remove(&rel);
+            }
+        }
+        if self.valid_data.remove(&ino) && !self.is_open(ino) {
+            if let Some(rel) = self.inodes.path(ino) {
+                let _ = fs::remove_file(cache_dir.join(rel));
+            }
+            self.forget_tier(ino);
+        }
+        self.disk.forget(ino);
+        self.absent.remove(&ino);
+    }
+
+    /**
+     * Keeps the cache file of `ino`, whose last handle just closed with its
+     * data clean and vouched for and `touched` those chunks, deleting or
+     * punching out whatever the cache budget pushes out. That may be this
+     * very file, or the parts of it that weren't read.
+     */
+    fn keep_closed(&mut self, ino: u64, cache_dir: &Path, stats: &Stats, touched: &[u64]) {
+        if !self.disk.limited() {
+            return;
+        }
+        let Some(rel) = self.inodes.path(ino) else {
+            return;
+        };
+        let bytes = fs::metadata(cache_dir.join(rel)).map_or(0, |md| md.len());
+        let absent = self.absent.get(&ino).cloned().unwrap_or_default();
+        for (victim, chunk) in self.disk.closed(ino, bytes, touched, &absent) {
+            if !self.valid_data.contains(&victim) || self.is_open(victim) || self.busy.contains(&victim) || self.deferred.contains_key(&victim) {
+                continue;
+            }
+            let Some(path) = self.inodes.path(victim).map(|rel| cache_dir.join(rel)) else {
+                continue;
+            };
+            if chunk != WHOLE && punch_chunk(&path, chunk) {
+                stats.record_disk_punch();
+                self.absent.entry(victim).or_default().insert(chunk);
+                continue;
+            }
+            stats.record_disk_eviction(victim == ino);
+            if self.valid_data.remove(&victim) {
+                let _ = fs::remove_file(path);
+                self.forget_tier(victim);
+            }
+            self.disk.forget(victim);
+            self.absent.remove(&victim);
+        }
+    }
+}
 
-    next_fh: u64,                        // Next available file handle
-    open_files: HashMap<u64, OpenEntry>, // Map of file handle to OpenEntry
+/**
+ * Gives the disk blocks of chunk `index` of the cache file at `path` back to
+ * the file system, leaving a hole of the same size.
+ */
+fn punch_chunk(path: &Path, index: u64) -> bool {
+    let Ok(file) = OpenOptions::new().write(true).open(path) else {
+        return false;
+    };
+    let mode = libc::FALLOC_FL_PUNCH_HOLE | libc::FALLOC_FL_KEEP_SIZE;
+    unsafe { libc::fallocate(file.as_raw_fd(), mode, (index * CHUNK) as i64, CHUNK as i64) == 0 }
 }
 
+#[derive(Clone)]
 struct TULFS {
+    config: MountConfig,
     user: String,
     host: String,
-    sftp: Sftp,
+    meta_pool: Arc<SftpPool>, // SSH connections for metadata, see sftp()
+    bulk_pool: Arc<SftpPool>, // SSH connections for file transfers, see bulk_sftp()
     server_hash: String, // Hash of the server hostname so that multiple instances don't conflict
     backing_root: PathBuf, // Remote backing root directory
     st: Arc<Mutex<State>>, // Shared state locked with a mutex
+    server: Option<Arc<ServerConn>>, // TULFS server connection for callbacks or leases, if reachable
+    workers: Arc<WorkerPool>,        // Runs requests that may wait on the network
+    idle: Arc<Condvar>,              // Signalled with `st` when a transfer ends
+    stats: Arc<Stats>,
+    inodes: Arc<InodeTable>, // Same as in State
+    files: Arc<FhTable>,
+    uring: Option<Arc<Uring>>, // Cache file I/O engine with --uring
+    transfers: Arc<Transfers>, // Runs fetches and uploads on the bulk connections
+    tier: Option<Arc<MemTier>>, // Hot cache file blocks in memory with --mem-cache-mb
+}
+
+fn remote_attr_from_stat(stat: &FileStat) -> RemoteAttr {
+    let is_dir = stat.is_dir();
+    RemoteAttr {
+        is_dir,
+        size: stat.size.unwrap_or(0),
+        perm: stat.perm.map(|p| p & 0o7777).unwrap_or(if is_dir { 0o755 } else { 0o644 }),
+        uid: stat.uid.unwrap_or_else(|| unsafe { libc::getuid() }),
+        gid: stat.gid.unwrap_or_else(|| unsafe { libc::getgid() }),
+        atime: stat.atime.unwrap_or(0) as i64,
+        mtime: stat.mtime.unwrap_or(0) as i64,
+        mtime_nsec: 0,
+        ctime: 0,
+        ctime_nsec: 0,
+    }
+}
+
+fn file_attr(ra: &RemoteAttr, ino: u64) -> FileAttr {
+    let atime = SystemTime::UNIX_EPOCH + Duration::from_secs(ra.atime.max(0) as u64);
+    let mtime = SystemTime::UNIX_EPOCH
+        + Duration::new(ra.mtime.max(0) as u64, ra.mtime_nsec);
+    FileAttr {
+        ino,
+        size: if ra.is_dir { 0 } else { ra.size },
+        blocks: 0,
+        atime,
+        mtime,
+        ctime: mtime,
+        crtime: mtime,
+        kind: if ra.is_dir {
+            FileType::Directory
+        } else {
+            FileType::RegularFile
+        },
+        perm: ra.perm as u16,
+        nlink: if ra.is_dir { 2 } else { 1 },
+        uid: ra.uid,
+        gid: ra.gid,
+        rdev: 0,
+        blksize: 512,
+        flags: 0,
+    }
+}
+
+/**
+ * Applies a callback from the TULFS server to the client state.
+ *
+ * An invalidation drops the cached attributes of the path and, if the file
+ * is not open, its local cache file. Invalidations carrying the version we
+ * already cache, or hitting a file we are writing ourselves, are the echo of
+ * our own upload and are ignored.
+ */
+fn on_server_event(
+    st: &Mutex<State>,
+    backing_root: &Path,
+    cache_dir: &Path,
+    recalls: &mpsc::Sender<u64>,
+    ev: ServerEvent,
+) {
+    let mut st = st.lock().unwrap();
+    let ino_of = |st: &State, path: &Path| -> Option<u64> {
+        let rel = path.strip_prefix(backing_root).ok()?;
+        if rel.as_os_str().is_empty() {
+            Some(ROOT_INODE)
+        } else {
+            st.inodes.ino(rel)
+        }
+    };
+    match ev {
+        ServerEvent::Push(Message::Invalidate { path, attr }) => {
+            let Some(ino) = ino_of(&st, &path) else {
+                return;
+            };
+            if st.is_dirty(ino) {
+                return;
+            }
+            if let (Some(new), Some(cached)) = (attr, st.attrs.get(&ino)) {
+                if cached.callback && cached.version.is_some_and(|old| old.same_version(&new)) {
+                    return;
+                }
+            }
+            // println!("Callback broken for {:?}", path);
+            st.drop_cached(ino, cache_dir);
+            if attr.is_none() {
+                // Gone on the server, make the kernel forget the name too
+                let rel = path.strip_prefix(backing_root).unwrap_or(&path);
+                let parent = rel.parent().and_then(|p| {
+                    if p.as_os_str().is_empty() {
+                        Some(ROOT_INODE)
+                    } else {
+                        st.inodes.ino(p)
+                    }
+                });
+                if let (Some(parent), Some(name)) = (parent, rel.file_name()) {
+                    st.kernel.inval_entry(parent, name);
+                }
+            }
+        }
+        ServerEvent::Push(Message::Recall { path }) => {
+            // Giving up the lease may need an upload, which the lease thread does
+            if let Some(ino) = ino_of(&st, &path) {
+                let _ = recalls.send(ino);
+            }
+        }
+        ServerEvent::Push(_) => {}
+        ServerEvent::Disconnected => {
+            eprintln!("Lost connection to TULFS server, falling back to TTL revalidation");
+            st.server_up = false;
+            // The server forgot our callbacks and leases along with us
+            let covered: Vec<u64> = st
+                .valid_data
+                .iter()
+                .chain(st.attrs.keys())
+                .chain(st.leases.keys())
+                .copied()
+                .collect();
+            // Except for writes not uploaded yet: their cache file is the
+            // only copy, and the version they started from lets the lease
+            // thread check the file over SFTP before uploading them
+            let dirty: HashSet<u64> = covered.iter().copied().filter(|&ino| st.is_dirty(ino)).collect();
+            for &ino in &covered {
+                if !dirty.contains(&ino) {
+                    st.drop_cached(ino, cache_dir);
+                }
+            }
+            st.attrs.retain(|ino, cached| {
+                if dirty.contains(ino) {
+                    cached.callback = false;
+                    return true;
+                }
+                !cached.callback && cached.version.is_none()
+            });
+            st.leases.clear();
+        }
+    }
 }
 
 impl TULFS {
-    fn new(hostname: String, backing_root: PathBuf) -> Self {
+    fn new(hostname: String, backing_root: PathBuf, config: MountConfig) -> Self {
         let st = Arc::new(Mutex::new(State::default()));
-        st.lock().unwrap().next_fh = 1; // Start file handles at 1
+        st.lock().unwrap().lease_mode = config.leases;
+        st.lock().unwrap().disk = DiskCache::new((config.cache_mb as u64) << 20, config.admission);
         let hostname_parts: Vec<String> = hostname.splitn(2, '@').map(|s| s.to_string()).collect();
         if hostname_parts.len() != 2 {
             eprintln!("[ERROR] Hostname must be in the format user@host");
@@ -62,22 +497,32 @@ impl TULFS {
         }
         let user = hostname_parts[0].clone();
         let host = hostname_parts[1].clone();
-        // connect to the server here using sftp
-        let tcp =
-            std::net::TcpStream::connect((host.clone(), 22)).expect("Could not connect to server");
-        // create ssh session
-        let mut session = Session::new().expect("Could not create SSH session");
-        session.set_tcp_stream(tcp);
-        session
-            .handshake()
-            .expect("Could not complete SSH handshake");
-        session
-            .userauth_pubkey_file(&user, None, &Path::new(PRIVATE_KEY), None)
-            .expect("Could not authenticate");
+        // connect to the server here using sftp. Metadata requests get
+        // connections of their own so they never queue behind a transfer
+        // hogging the link. Each worker may need one of each, plus the lease
+        // thread.
+        let connect = |compress: bool, initial: usize| {
+            match SftpPool::new(
+                &user,
+                &host,
+                Path::new(PRIVATE_KEY),
+                compress,
+                initial,
+                config.workers + 1,
+            ) {
+                Ok(pool) => Arc::new(pool),
+                Err(e) => {
+                    eprintln!("[ERROR] {}", e);
+                    std::process::exit(1);
+                }
+            }
+        };
+        let meta_pool = connect(false, config.sessions);
+        // The snapshot is one big stream of very repetitive text
+        let bulk_pool = connect(config.snapshot, config.bulk_sessions);
 
         // check if the backing directory is actually a directory on the server using sftp
-        let sftp = session.sftp().expect("Could not create SFTP session");
-        let backing_metadata = sftp.stat(Path::new(backing_root.to_str().unwrap()));
+        let backing_metadata = meta_pool.get().stat(Path::new(backing_root.to_str().unwrap()));
         if backing_metadata.is_err() || !backing_metadata.unwrap().is_dir() {
             eprintln!("[ERROR] Backing directory is not a valid directory on the server");
             std::process::exit(1);
@@ -90,19 +535,104 @@ impl TULFS {
             fs::create_dir_all(&cache_dir).expect("Could not create cache directory");
         }
 
-        TULFS {
+        let workers = Arc::new(WorkerPool::new(config.workers));
+
+        // Register with the TULFS server for invalidation callbacks or leases.
+        // Without it we fall back to revalidating everything after TTL.
+        let event_st = st.clone();
+        let event_root = backing_root.clone();
+        let (recall_tx, recall_rx) = mpsc::channel();
+        let server = match ServerConn::connect(&meta_pool, workers.handle(), move |ev| {
+            on_server_event(&event_st, &event_root, &cache_dir, &recall_tx, ev)
+        }) {
+            Ok(conn) => {
+                if config.leases {
+                    println!("Connected to TULFS server, caching under leases");
+                } else {
+                    println!("Connected to TULFS server, caching until invalidated");
+                }
+                st.lock().unwrap().server_up = true;
+                Some(conn)
+            }
+            Err(e) => {
+                println!("TULFS server not reachable ({e}), using {:?} TTL", TTL);
+                None
+            }
+        };
+
+        let (inodes, files) = {
+            let st = st.lock().unwrap();
+            (st.inodes.clone(), st.files.clone())
+        };
+        let stats = Arc::new(Stats::default());
+        let uring = if config.uring {
+            match Uring::new(stats.clone()) {
+                Ok(uring) => Some(uring),
+                Err(e) => {
+                    eprintln!("io_uring not available ({e}), using blocking cache I/O");
+                    None
+                }
+            }
+        } else {
+            None
+        };
+        let transfers = Transfers::start(config.lanes, bulk_pool.clone(), stats.clone(), uring.clone());
+        let tier = (config.mem_cache_mb > 0)
+            .then(|| Arc::new(MemTier::new((config.mem_cache_mb as u64) << 20, stats.clone())));
+        st.lock().unwrap().tier = tier.clone();
+        let fs = TULFS {
+            config,
             user,
             host,
-            sftp,
+            meta_pool,
+            bulk_pool,
+            stats,
+            inodes,
+            files,
+            uring,
+            transfers,
+            tier,
             server_hash,
             backing_root,
             st,
+            server,
+            workers,
+            idle: Arc::new(Condvar::new()),
+        };
+        if fs.config.leases && fs.server.is_some() {
+            let worker = fs.clone();
+            std::thread::spawn(move || worker.lease_loop(recall_rx));
+        }
+        if fs.config.snapshot {
+            fs.load_snapshot();
+        }
+
+        // kill -USR1 dumps the stats
+        match Signals::new([SIGUSR1]) {
+            Ok(mut signals) => {
+                let stats = fs.stats.clone();
+                let path = fs.stats_path();
+                std::thread::spawn(move || {
+                    for _ in signals.forever() {
+                        stats.dump(&path);
+                    }
+                });
+            }
+            Err(e) => eprintln!("Could not install SIGUSR1 handler: {}", e),
         }
+        fs
     }
 
-    fn is_remote_dir(&self, path: &Path) -> bool {
-        let metadata = self.sftp.stat(path);
-        metadata.map(|m| m.is_dir()).unwrap_or(false)
+    /**
+     * Returns the server connection while callbacks are being delivered.
+     */
+    fn callback_server(&self) -> Option<&ServerConn> {
+        let server = self.server.as_deref()?;
+        if !self.config.leases && self.st.lock().unwrap().server_up {
+            Some(server)
+        } else {
+            None
+        }
     }
 
     /**
@@ -136,11 +666,27 @@ impl TULFS {
         remote_path
     }
 
+    /**
+     * Checks out an SSH connection for the duration of one metadata request.
+     */
+    fn sftp(&self) -> PooledConn<'_> {
+        self.meta_pool.get()
+    }
+
+    /**
+     * Checks out an SSH connection for moving file data.
+     */
+    fn bulk_sftp(&self) -> PooledConn<'_> {
+        self.bulk_pool.get()
+    }
+
+    fn stats_path(&self) -> PathBuf {
+        PathBuf::from(format!("{}/{}.stats.json", CACHE_PATH, self.server_hash))
+    }
+
     fn ensure_root(&self) {
-        let mut st = self.st.lock().unwrap();
-        if !st.inode_to_path.contains_key(&ROOT_INODE) {
-            st.inode_to_path.insert(ROOT_INODE, PathBuf::from("/"));
-            st.path_to_inode.insert(PathBuf::from("/"), ROOT_INODE);
+        if !self.inodes.contains(ROOT_INODE) {
+            self.inodes.insert(ROOT_INODE, Path::new("/"));
         }
     }
 
@@ -180,7 +726,7 @@ impl TULFS {
         if resolved_path == canonical_root {
             return ROOT_INODE;
         }
-        if let Some(&ino) = self.st.lock().unwrap().path_to_inode.get(&rel_path) {
+        if let Some(ino) = self.inodes.ino(&rel_path) {
             // println!("Found inode: {:?} for path: {:?}", ino, rel_path);
             return ino;
         }
@@ -188,10 +734,8 @@ impl TULFS {
         // Generate a new inode number based on the hash of the path
         let d = md5::compute(resolved_path.unwrap().as_bytes()); // I don't want to bother with inode number collisions 
         let ino = u64::from_be_bytes([d[0], d[1], d[2], d[3], d[4], d[5], d[6], d[7]]);
-        let mut st = self.st.lock().unwrap();
         // println!("Inserting mapping: ino = {:?} rel_path: {:?}", ino, rel_path);
-        st.path_to_inode.insert(PathBuf::from(&rel_path), ino);
-        st.inode_to_path.insert(ino, PathBuf::from(&rel_path));
+        self.inodes.insert(ino, &rel_path);
         ino
     }
 
@@ -199,16 +743,12 @@ impl TULFS {
         if ino == ROOT_INODE {
             return Some(PathBuf::from("/"));
         }
-        let st = self.st.lock().unwrap();
-        // println!("Does inode_to_path contain key {}? {}", ino, st.inode_to_path.contains_key(&ino));
-        if !st.inode_to_path.contains_key(&ino) {
-            return None;
-        }
-        st.inode_to_path.get(&ino).cloned()
+        self.inodes.path(ino)
     }
 
     /**
-     * Get file attributes from the remote server using `sftp.stat`
+     * Get file attributes, from the attribute cache if still valid, otherwise
+     * from the TULFS server (which also sets up a callback) or `sftp.stat`
      *
      * Parameters:
      * - rel: PathBuf - relative path from the backing root
@@ -217,72 +757,128 @@ impl TULFS {
      * - Result<FileAttr, libc::c_int> - Ok(FileAttr) if successful
      */
     fn attr_from_remote(&self, rel: PathBuf, ino: u64) -> Result<FileAttr, libc::c_int> {
+        if let Some(attr) = self.st.lock().unwrap().valid_attr(ino) {
+            return Ok(attr);
+        }
+
         // println!("attr_from_remote: rel = {:?}", rel);
         let full_path = self.get_remote_abs_path(&rel);
         // println!("attr_from_remote: full_path = {:?}", full_path);
-        let stat = self.sftp.stat(&full_path).map_err(|_| ENOENT)?;
-        let now = SystemTime::now();
-        let uid = stat
-            .uid
-            .map(|u| u as u32)
-            .unwrap_or_else(|| unsafe { libc::getuid() as u32 });
-        let gid = stat
-            .gid
-            .map(|g| g as u32)
-            .unwrap_or_else(|| unsafe { libc::getgid() as u32 });
-
-        let is_dir = self.is_remote_dir(&full_path);
-        let kind = if is_dir {
-            FileType::Directory
-        } else {
-            FileType::RegularFile
-        };
-        let perm = stat.perm.unwrap_or(if is_dir { 0o755 } else { 0o644 }) as u16;
-        let size = if is_dir { 0 } else { stat.size.unwrap_or(0) };
-
-        let atime = stat
-            .atime
-            .map(|s| SystemTime::UNIX_EPOCH + Duration::from_secs(s as u64))
-            .unwrap_or(now);
-        let mtime = stat
-            .mtime
-            .map(|s| SystemTime::UNIX_EPOCH + Duration::from_secs(s as u64))
-            .unwrap_or(now);
-
-        Ok(FileAttr {
+        if let Some(server) = self.callback_server() {
+            match server.call(Message::Register { path: full_path.clone() }) {
+                Ok(Message::Attr(ra)) => return Ok(self.cache_attr(ino, ra, AttrSource::Callback)),
+                Err(e) if e != EIO => return Err(e),
+                _ => {} // Server trouble, fall back to sftp
+            }
+        }
+        if let Some(server) = self.lease_server() {
+            match self.acquire_lease(server, ino, &full_path, LeaseKind::Read, leases::LEASE_RETRIES) {
+                Ok(ra) => return Ok(self.cache_attr(ino, ra, AttrSource::Lease)),
+                Err(e) if e != EIO => return Err(e),
+                _ => {}
+            }
+        }
+
+        let sftp = self.sftp();
+        let stat = sftp.check(sftp.stat(&full_path)).map_err(|_| ENOENT)?;
+        Ok(self.cache_attr(ino, remote_attr_from_stat(&stat), AttrSource::Sftp))
+    }
+
+    fn cache_attr(&self, ino: u64, ra: RemoteAttr, source: AttrSource) -> FileAttr {
+        let attr = file_attr(&ra, ino);
+        let mut st = self.st.lock().unwrap();
+        // Revalidation found a different file, drop what the kernel has of it
+        if st
+            .attrs
+            .get(&ino)
+            .is_some_and(|old| old.attr.size != attr.size || old.attr.mtime != attr.mtime)
+        {
+            st.kernel.inval_inode(ino, 0, 0);
+        }
+        st.attrs.insert(
             ino,
-            size,
-            blocks: 0,
-            atime,
-            mtime,
-            ctime: mtime,
-            crtime: mtime,
-            kind,
-            perm,
-            nlink: if is_dir { 2 } else { 1 },
-            uid,
-            gid,
-            rdev: 0,
-            blksize: 512,
-            flags: 0,
-        })
+            CachedAttr {
+                attr,
+                version: if source == AttrSource::Sftp { None } else { Some(ra) },
+                callback: source == AttrSource::Callback,
+                fetched: Instant::now(),
+            },
+        );
+        attr
+    }
+
+    /**
+     * How long the kernel may cache the entry and attributes of `ino`. Only
+     * worth going beyond TTL when we can take it back with a notification.
+     */
+    fn kernel_ttl(&self, ino: u64) -> Duration {
+        let st = self.st.lock().unwrap();
+        if !st.kernel.is_attached() {
+            return TTL;
+        }
+        if st.attrs.get(&ino).is_some_and(|cached| cached.callback) {
+            return CALLBACK_TTL;
+        }
+        match st.leases.get(&ino) {
+            Some(lease) => lease
+                .expires
+                .saturating_duration_since(Instant::now())
+                .max(TTL),
+            None => TTL,
+        }
+    }
+
+    fn kernel(&self) -> Arc<KernelNotifier> {
+        self.st.lock().unwrap().kernel.clone()
+    }
+
+    fn has_valid_data(&self, ino: u64) -> bool {
+        self.st.lock().unwrap().data_covered(ino)
+    }
+
+    /**
+     * Called after uploading `ino`. Tells the server so other clients drop
+     * their copies, and records the uploaded version as our cached one.
+     */
+    fn after_upload(&self, ino: u64, remote_path: &Path) {
+        if let Some(server) = self.callback_server() {
+            if let Ok(Message::Attr(ra)) = server.call(Message::Changed {
+                path: remote_path.to_path_buf(),
+            }) {
+                self.cache_attr(ino, ra, AttrSource::Callback);
+                self.st.lock().unwrap().valid_data.insert(ino);
+                return;
+            }
+        }
+        if let Some(server) = self.lease_server() {
+            if self.relock_after_upload(server, ino, remote_path) {
+                return;
+            }
+        }
+        self.st.lock().unwrap().attrs.remove(&ino);
     }
 
-const COPY_CHUNK: usize = 1 << 20; // 1 MiB
+
+/**
+ * Fetches back the chunks of `range` that were punched out of the cache file
+ * of `ino` while it was closed.
+ */
+fn fill_holes(&self, ino: u64, cached: &CachedInode, range: Range<u64>) -> Result<(), libc::c_int> {
+    cached.fill(range, |chunks| {
+        let path = self.path_for_inode(ino).ok_or(ENOENT)?;
+        let path = path.strip_prefix("/").unwrap_or(&path);
+        let remote_path = self.get_remote_abs_path(path);
+        self.stats.record_demand_fetch(chunks.len());
+        self.transfers.fetch_chunks(&remote_path, &cached.file, chunks)?;
+        Ok(())
+    })
+}
 
 fn fetch_file_from_remote(&self, path: &Path) -> Result<std::fs::File, libc::c_int> {
     let local_path = self.get_local_abs_path(path);
     let tmp_path = local_path.with_extension("part");
     let remote_path = self.get_remote_abs_path(path);
 
-    // Open remote for reading
-    let mut remote_file = self.sftp
-        .open(&remote_path)
-        .map_err(|_| {
-            eprintln!("Remote missing: {:?}", remote_path);
-            libc::ENOENT
-        })?;
-
     // Make sure parent exists
     if let Some(p) = local_path.parent() {
         if let Err(e) = std::fs::create_dir_all(p) {
@@ -292,7 +888,7 @@ fn fetch_file_from_remote(&self, path: &Path) -> Result<std::fs::File, libc::c_i
     }
 
     // Write to a temp file first
-    let mut local_tmp = OpenOptions::new()
+    let local_tmp = OpenOptions::new()
         .create(true).write(true).truncate(true)
         .open(&tmp_path)
         .map_err(|_| {
@@ -300,12 +896,10 @@ fn fetch_file_from_remote(&self, path: &Path) -> Result<std::fs::File, libc::c_i
             libc::EIO
         })?;
 
-    // Stream copy with a big buffer
-    let mut buf = vec![0u8; COPY_CHUNK];
-    loop {
-        let n = remote_file.read(&mut buf).map_err(|_| libc::EIO)?;
-        if n == 0 { break; }
-        local_tmp.write_all(&buf[..n]).map_err(|_| libc::EIO)?;
+    // Copy in chunks spread over the transfer lanes
+    if let Err(e) = self.transfers.fetch(&remote_path, &local_tmp) {
+        let _ = std::fs::remove_file(&tmp_path);
+        return Err(e);
     }
 
     // Ensure data hits disk before publish
@@ -314,99 +908,58 @@ fn fetch_file_from_remote(&self, path: &Path) -> Result<std::fs::File, libc::c_i
     // Atomically replace (avoid torn readers)
     std::fs::rename(&tmp_path, &local_path).map_err(|_| libc::EIO)?;
 
-    // Reopen for normal use (start at offset 0)
-    let mut final_f = OpenOptions::new().read(true).write(true).open(&local_path).map_err(|_| libc::EIO)?;
-    final_f.seek(SeekFrom::Start(0)).ok();
+    // Reopen for normal use
+    let final_f = OpenOptions::new().read(true).write(true).open(&local_path).map_err(|_| libc::EIO)?;
     Ok(final_f)
 }
 
 
     fn copy_from_local_to_remote(
         &self,
-        mut local_file: File,
+        local_file: File,
         remote_path: &Path,
     ) -> Result<(), libc::c_int> {
-        // Rewind local file to start
-        if let Err(_) = local_file.seek(SeekFrom::Start(0)) {
-            eprintln!("Failed to seek local file to start");
-            return Err(EIO);
-        }
-
-        // Open remote file for writing
-        let mut remote_file = match self.sftp.open_mode(
-            &remote_path,
-            ssh2::OpenFlags::WRITE | ssh2::OpenFlags::CREATE | ssh2::OpenFlags::TRUNCATE,
-            0o644,
-            ssh2::OpenType::File,
-        ) {
-            Ok(f) => f,
-            Err(_) => {
-                eprintln!("Failed to open remote file: {:?}", remote_path);
-                return Err(EIO);
-            }
-        };
-
-        // Copy data from local file to remote file
-        let mut buffer = Vec::new();
-        if let Err(_) = local_file.read_to_end(&mut buffer) {
-            eprintln!("Failed to read local file");
-            return Err(EIO);
-        }
-
-        // println!("Buffer Contents: {:?}", buffer);
-
-        if let Err(_) = remote_file.write_all(&buffer) {
-            eprintln!("Failed to write to remote file: {:?}", remote_path);
-            return Err(EIO);
-        }
-
+        self.transfers.upload(&local_file, remote_path)?;
         Ok(())
     }
 
+    /**
+     * Uploads every open file with writes not uploaded yet, for an unmount
+     * that comes while handles are still open.
+     */
     fn flush_dirty_files(&self) {
-        let mut st = self.st.lock().unwrap();
-        for (fh, entry) in st.open_files.iter_mut() {
-            if entry.dirty {
-                // flush to remote server
-                let _ino = entry.ino;
-                let path = match self.path_for_inode(_ino) {
-                    Some(p) => p,
-                    None => {
-                        eprintln!("Could not find path for inode {}", _ino);
-                        continue;
-                    }
-                };
-                let remote_path = self.get_remote_abs_path(&path);
-                let local_path = self.get_local_abs_path(&path);
-                // println!("Flushing dirty file to remote server: {:?}", remote_path);
-                let local_file = match OpenOptions::new().read(true).open(&local_path) {
-                    Ok(f) => f,
-                    Err(_) => {
-                        eprintln!("Failed to open local file: {:?}", local_path);
-                        continue;
-                    }
-                };
-                if let Err(e) = self.copy_from_local_to_remote(local_file, &remote_path) {
-                    eprintln!("Failed to copy file to remote server: {:?}", remote_path);
-                    continue;
-                }
+        for _ino in self.inodes.dirty() {
+            let (Some(path), Some(cached)) = (self.path_for_inode(_ino), self.inodes.cached(_ino))
+            else {
+                eprintln!("Could not find path for inode {}", _ino);
+                continue;
+            };
+            let path = path.strip_prefix("/").unwrap_or(&path).to_path_buf();
+            if let Err(e) = self.upload_dirty(_ino, &cached, &path) {
+                eprintln!("Failed to upload inode {} at unmount: {}", _ino, e);
             }
         }
     }
 }
 
-impl Filesystem for TULFS {
-    fn init(
-        &mut self,
-        _req: &Request<'_>,
-        _config: &mut fuser::KernelConfig,
-    ) -> Result<(), libc::c_int> {
-        print!("init\n");
-        self.ensure_root();
-        Ok(())
+/**
+ * FUSE request handlers. They run on the worker pool and answer through the
+ * Reply they are given, see the Filesystem impl for which ones.
+ */
+impl TULFS {
+    /**
+     * Runs `job` on a worker, recording its latency under `class`.
+     */
+    fn dispatch(&self, class: OpClass, job: impl FnOnce(&TULFS) + Send + 'static) {
+        let fs = self.clone();
+        let start = Instant::now();
+        self.workers.spawn(move || {
+            job(&fs);
+            fs.stats.record(class, start.elapsed());
+        });
     }
 
-    fn getattr(&mut self, _req: &Request<'_>, ino: u64, reply: ReplyAttr) {
+    fn do_getattr(&self, ino: u64, reply: ReplyAttr) {
         // println!("getattr");
         // println!("ino: {}", ino);
         if ino == ROOT_INODE {
@@ -421,13 +974,13 @@ impl Filesystem for TULFS {
             // println!("Path for inode {}: {:?}", ino, path);
             let rel = path.strip_prefix("/").unwrap_or(&path);
             match self.attr_from_remote(rel.to_path_buf(), ino) {
-                Ok(attr) => reply.attr(&TTL, &attr),
+                Ok(attr) => reply.attr(&self.kernel_ttl(ino), &attr),
                 Err(e) => reply.error(e),
             }
         }
     }
 
-    fn lookup(&mut self, _req: &Request<'_>, parent: u64, name: &OsStr, reply: ReplyEntry) {
+    fn do_lookup(&self, parent: u64, name: &OsStr, reply: ReplyEntry) {
         // print!("lookup\n");
         // println!("parent: {}, name: {:?}", parent, name);
 
@@ -450,6 +1003,22 @@ impl Filesystem for TULFS {
         let child_path = parent_path.join(name);
         let ino = self.inode_for_path(&child_path);
 
+        // An expired entry may still be confirmed by its unchanged parent
+        if !self.st.lock().unwrap().has_valid_attr(ino) {
+            let parent_rel = parent_path.strip_prefix("/").unwrap_or(&parent_path);
+            match self.lookup_by_parent(parent, parent_rel, name, ino) {
+                Some(Ok(attr)) => {
+                    reply.entry(&self.kernel_ttl(ino), &attr, 0);
+                    return;
+                }
+                Some(Err(e)) => {
+                    reply.error(e);
+                    return;
+                }
+                None => {}
+            }
+        }
+
         // println!("Child path: {:?}", child_path);
         if let Some(attr) = self
             .attr_from_remote(
@@ -461,14 +1030,52 @@ impl Filesystem for TULFS {
             )
             .ok()
         {
-            reply.entry(&TTL, &attr, 0); // We are not reusing inode numbers keep generation to 0 for now
+            reply.entry(&self.kernel_ttl(ino), &attr, 0); // We are not reusing inode numbers keep generation to 0 for now
         } else {
             // println!("File not found on remote server");
             reply.error(ENOENT);
         }
     }
 
-    fn open(&mut self, _req: &Request<'_>, _ino: u64, _flags: i32, reply: ReplyOpen) {
+    fn do_readdir(
+        &self,
+        ino: u64,
+        _fh: u64,
+        offset: i64,
+        mut reply: ReplyDirectory,
+    ) {
+        let Some(path) = self.path_for_inode(ino) else {
+            reply.error(ENOENT);
+            return;
+        };
+        let rel = path.strip_prefix("/").unwrap_or(&path).to_path_buf();
+        let children = match self.dir_entries(ino, &rel, offset == 0) {
+            Ok(children) => children,
+            Err(e) => {
+                reply.error(e);
+                return;
+            }
+        };
+
+        let parent = match rel.parent() {
+            Some(p) if !p.as_os_str().is_empty() => self.inode_for_path(p),
+            _ => ROOT_INODE,
+        };
+        let mut entries = vec![
+            (ino, FileType::Directory, OsString::from(".")),
+            (parent, FileType::Directory, OsString::from("..")),
+        ];
+        entries.extend(children);
+        for (i, (child, kind, name)) in entries.iter().enumerate().skip(offset as usize) {
+            // The offset handed back is where the next call picks up
+            if reply.add(*child, (i + 1) as i64, *kind, name) {
+                break;
+            }
+        }
+        reply.ok();
+    }
+
+    fn do_open(&self, _ino: u64, _flags: i32, reply: ReplyOpen) {
         // print!("open\n");
         // println!("ino: {}, flags: {}", _ino, _flags);
 
@@ -487,12 +1094,36 @@ impl Filesystem for TULFS {
         // if the first character of the path is '/', remove it
         let path = path.strip_prefix("/").unwrap_or(&path).to_path_buf();
 
-        // fetch file from remote server if it doesn't exist in local cache
+        // The truncate of an O_TRUNC open comes with it, done first there is
+        // nothing left to fetch
+        let accmode = _flags & O_ACCMODE;
+        if _flags & O_TRUNC != 0 && (accmode == O_WRONLY || accmode == O_RDWR) {
+            if let Err(e) = self.truncate(_ino, &path, 0) {
+                reply.error(e);
+                return;
+            }
+        }
+
+        // fetch file from remote server if it doesn't exist in local cache
         let local_path = self.get_local_abs_path(&path);
         // println!("Local path: {:?}", local_path);
         let mut _fh = 0;
         let mut local_flags = _flags as u32;
-        if !local_path.exists() {
+        // Let the kernel keep its page cache unless we just refetched the file
+        let mut open_flags = FOPEN_KEEP_CACHE;
+        let mut _transfer = None;
+        if !local_path.exists() || !self.has_valid_data(_ino) {
+            // Another worker may be fetching it already, wait and look again
+            _transfer = Some(self.begin_transfer(_ino));
+        }
+        if _transfer.is_some() && (!local_path.exists() || !self.has_valid_data(_ino)) {
+            open_flags = 0;
+            // Set up the callback before fetching so a change racing with the
+            // fetch still invalidates what we are about to cache
+            if let Err(e) = self.attr_from_remote(path.clone(), _ino) {
+                reply.error(e);
+                return;
+            }
             std::fs::create_dir_all(local_path.parent().unwrap()).unwrap();
             println!("File not found in local cache, fetching from remote server");
             let res = self.fetch_file_from_remote(&path);
@@ -506,29 +1137,32 @@ impl Filesystem for TULFS {
 
             // add file to open_files
             let mut st = self.st.lock().unwrap();
+            st.disk.opened(_ino);
+            st.absent.remove(&_ino);
+            self.stats.record_disk_open(false);
+            let covered = st.attrs.get(&_ino).is_some_and(|cached| cached.callback)
+                || (st.lease_mode && st.lease_valid(_ino));
+            if covered {
+                st.valid_data.insert(_ino);
+            }
+            // Still under the lock, so a release can't delete the file first.
+            // Handles opened before the refetch keep the old cache state
+            let generation = self.tier.as_ref().map_or(0, |tier| tier.generation(_ino, true));
+            let cached = Arc::new(CachedInode::new(_local_file, self.uring.as_ref(), generation));
+            let cached = self.inodes.opened(_ino, &path, cached, true);
             let open_entry: OpenEntry = OpenEntry {
-                file: _local_file,
+                cached,
                 flags: local_flags,
-                dirty: false,
                 ino: _ino,
+                pattern: Mutex::new(ReadPattern::default()),
             };
-            _fh = st.next_fh;
-            st.open_files.insert(_fh, open_entry);
-            st.next_fh += 1;
+            _fh = self.files.insert(open_entry);
             drop(st);
 
             println!("Opened file {:?} with fh {} as new", local_path, _fh);
         } else {
             let accmode = _flags & O_ACCMODE;
-            let mut write_access = accmode == O_WRONLY || accmode == O_RDWR;
-            // check if _ino is already opened with incompatible flags
-            let st = self.st.lock().unwrap();
-            if let Some(existing_entry) = st.open_files.get(&_ino) {
-                if existing_entry.dirty {
-                    write_access = false;
-                }
-            }
-            drop(st);
+            let write_access = accmode == O_WRONLY || accmode == O_RDWR;
             // if write access is false, remove write flags from local_flags
             if !write_access {
                 local_flags &= !(O_WRONLY as u32);
@@ -536,38 +1170,47 @@ impl Filesystem for TULFS {
                 local_flags |= O_RDONLY as u32;
             }
 
-            let local_file = OpenOptions::new()
-                .read(true)
-                .write(write_access)
-                .open(&local_path);
-
-            if local_file.is_err() {
-                reply.error(EIO);
-                return;
-            }
-            let local_file = local_file.unwrap();
+            // All handles of an inode share its cache state and one
+            // read-write fd, access is checked against each handle's flags
+            let cached = match self.inodes.cached(_ino) {
+                Some(cached) => cached,
+                None => match OpenOptions::new().read(true).write(true).open(&local_path) {
+                    Ok(file) => {
+                        let generation = self.tier.as_ref().map_or(0, |tier| tier.generation(_ino, false));
+                        Arc::new(CachedInode::new(file, self.uring.as_ref(), generation))
+                    }
+                    Err(_) => {
+                        reply.error(EIO);
+                        return;
+                    }
+                },
+            };
 
             // add file to open_files
             let mut st = self.st.lock().unwrap();
+            st.disk.opened(_ino);
+            self.stats.record_disk_open(true);
+            let cached = self.inodes.opened(_ino, &path, cached, false);
+            // Chunks evicted while it was closed are fetched as they're needed
+            if let Some(absent) = st.absent.remove(&_ino) {
+                cached.punched(absent);
+            }
             let open_entry: OpenEntry = OpenEntry {
-                file: local_file,
+                cached,
                 flags: local_flags,
                 ino: _ino,
-                dirty: false,
+                pattern: Mutex::new(ReadPattern::default()),
             };
-            _fh = st.next_fh;
-            st.open_files.insert(_fh, open_entry);
-            st.next_fh += 1;
+            _fh = self.files.insert(open_entry);
             drop(st);
             println!("Opened file {:?} with fh {} as read only", local_path, _fh);
         }
         println!("Successfully opened file with fh {}", _fh);
-        reply.opened(_fh, local_flags);
+        reply.opened(_fh, open_flags);
     }
 
-    fn write(
-        &mut self,
-        _req: &Request<'_>,
+    fn do_write(
+        &self,
         ino: u64,
         fh: u64,
         offset: i64,
@@ -589,35 +1232,34 @@ impl Filesystem for TULFS {
             // lock_owner
         // );
 
-        let mut st = self.st.lock().unwrap();
-        let open_entry = match st.open_files.get_mut(&fh) {
-            Some(entry) => entry,
-            None => {
-                reply.error(EINVAL);
+        let cached = match self.write_prepare(ino, fh) {
+            Ok(cached) => cached,
+            Err(e) => {
+                reply.error(e);
                 return;
             }
         };
 
-        // Check if the file was opened with write permissions
-        let accmode = open_entry.flags & O_ACCMODE as u32;
-        if accmode != O_WRONLY as u32 && accmode != O_RDWR as u32 {
-            reply.error(EACCES);
-            return;
-        }
-
-        // Seek to the specified offset
-        if let Err(_) = open_entry.file.seek(SeekFrom::Start(offset as u64)) {
-            reply.error(EIO);
-            return;
-        }
-
-        // println!("Writing {} bytes at offset {}", data.len(), offset);
-        // println!("Data Contents: {:?}", data);
-
-        // Write the data
-        match open_entry.file.write(data) {
+        // Write the data, one pwrite on the shared fd or one io_uring request
+        let start = Instant::now();
+        let res = match &self.uring {
+            Some(uring) if data.len() <= uring::BUF_SIZE => {
+                let mut buf = uring.buf();
+                buf.as_mut_slice()[..data.len()].copy_from_slice(data);
+                uring.write(cached.target(), &buf, data.len(), offset as u64)
+            }
+            _ => cached.file.write_at(data, offset as u64),
+        };
+        match res {
             Ok(bytes_written) => {
-                open_entry.dirty = true; // Mark file as dirty
+                // Mark the range dirty for every handle of the file
+                cached.wrote(offset as u64, bytes_written);
+                // and in any blocks the memory tier holds of it
+                if let Some(tier) = &self.tier {
+                    tier.write(ino, cached.generation, offset as u64, &data[..bytes_written]);
+                }
+                let syscalls = if self.uring.is_some() { 0 } else { 1 };
+                self.stats.record_cache_io(true, syscalls, bytes_written, start.elapsed());
                 reply.written(bytes_written as u32);
             }
             Err(_) => {
@@ -626,53 +1268,40 @@ impl Filesystem for TULFS {
         }
     }
 
-    fn read(
-        &mut self,
-        _req: &Request<'_>,
-        ino: u64,
-        fh: u64,
-        offset: i64,
-        size: u32,
-        flags: i32,
-        lock_owner: Option<u64>,
-        reply: ReplyData,
-    ) {
-        // println!("read");
-        // println!(
-            // "ino: {}, fh: {}, offset: {}, size: {}, flags: {}, lock_owner: {:?}",
-            // ino, fh, offset, size, flags, lock_owner
-        // );
-     let mut file = {
-            let st = self.st.lock().unwrap();
-            match st.open_files.get(&fh) {
-                Some(entry) => entry.file.try_clone().unwrap(),
-                None => {
-                    reply.error(EINVAL);
-                    return;
-                }
+    /**
+     * Everything a write to handle `fh` needs before its data goes into the
+     * cache file, which is returned.
+     */
+    fn write_prepare(&self, ino: u64, fh: u64) -> Result<Arc<CachedInode>, libc::c_int> {
+        // The first write to a clean file tries for a write lease so that
+        // uploads can be batched until the lease is recalled
+        if self.config.leases {
+            let want = self
+                .files
+                .get(fh)
+                .is_some_and(|entry| !entry.cached.is_dirty())
+                && !self.st.lock().unwrap().holds_write_lease(ino);
+            if want {
+                self.try_write_lease(ino);
             }
-        };
-
-        // Seek to the specified offset
-        if let Err(_) = file.seek(SeekFrom::Start(offset as u64)) {
-            reply.error(EIO);
-            return;
         }
 
-        let mut buffer = vec![0; size as usize];
-        match file.read(&mut buffer) {
-            Ok(bytes_read) => {
-                reply.data(&buffer[..bytes_read]);
-            }
-            Err(_) => {
-                reply.error(EIO);
-            }
+        let open_entry = self.files.get(fh).ok_or(EINVAL)?;
+
+        // Check if the file was opened with write permissions
+        let accmode = open_entry.flags & O_ACCMODE as u32;
+        if accmode != O_WRONLY as u32 && accmode != O_RDWR as u32 {
+            return Err(EACCES);
         }
+
+        // A file with chunks punched out is made whole before its first
+        // write, an upload sends all of it
+        self.fill_holes(ino, &open_entry.cached, 0..u64::MAX)?;
+        Ok(open_entry.cached.clone())
     }
 
-    fn flush(
-        &mut self,
-        _req: &Request<'_>,
+    fn do_flush(
+        &self,
         ino: u64,
         fh: u64,
         lock_owner: u64,
@@ -681,19 +1310,23 @@ impl Filesystem for TULFS {
         print!("flush\n");
         // println!("ino: {}, fh: {}, lock_owner: {}", ino, fh, lock_owner);
 
-        // Snapshot needed info under the lock without holding a mutable borrow across IO
-        let (is_dirty, entry_ino) = {
-            let st = self.st.lock().unwrap();
-            match st.open_files.get(&fh) {
-                Some(entry) => (entry.dirty, entry.ino),
-                None => {
-                    reply.error(EINVAL);
-                    return;
-                }
+        // Dirty state is per inode, so this sees writes through every handle
+        let entry = match self.files.get(fh) {
+            Some(entry) => entry,
+            None => {
+                reply.error(EINVAL);
+                return;
             }
         };
+        let entry_ino = entry.ino;
+
+        if !entry.cached.is_dirty() {
+            reply.ok();
+            return;
+        }
 
-        if !is_dirty {
+        // Under a write lease nobody else can look at the file, keep batching
+        if self.st.lock().unwrap().holds_write_lease(entry_ino) {
             reply.ok();
             return;
         }
@@ -708,38 +1341,46 @@ impl Filesystem for TULFS {
         // reaching
         // println!("Path from inode {:?}", path);
         let path = path.strip_prefix("/").unwrap_or(&path).to_path_buf();
-        let remote_path = self.get_remote_abs_path(&path);
-        let local_path = self.get_local_abs_path(&path);
+        match self.upload_dirty(entry_ino, &entry.cached, &path) {
+            Ok(()) => reply.ok(),
+            Err(e) => reply.error(e),
+        }
+    }
+
+    /**
+     * Uploads the cache file of `ino` if any handle wrote to it. The file is
+     * marked clean before it is read, so writes racing with the upload make
+     * it dirty again, and dirty again if the upload fails.
+     */
+    fn upload_dirty(&self, ino: u64, cached: &CachedInode, path: &Path) -> Result<(), libc::c_int> {
+        let _transfer = self.begin_transfer(ino);
+        let dirty = cached.take_dirty();
+        if dirty.is_empty() {
+            return Ok(()); // Uploaded by another handle while we waited
+        }
+        let remote_path = self.get_remote_abs_path(path);
+        let local_path = self.get_local_abs_path(path);
         // println!("Flushing dirty file to remote server: {:?}", remote_path);
         let local_file = match OpenOptions::new().read(true).open(&local_path) {
             Ok(f) => f,
             Err(_) => {
                 eprintln!("Failed to open local file: {:?}", local_path);
-                reply.error(EIO);
-                return;
+                cached.restore_dirty(dirty);
+                return Err(EIO);
             }
         };
-        let res = self.copy_from_local_to_remote(local_file, remote_path.as_path());
-        if let Err(e) = res {
+        self.stats.record_upload_dirty(cached::dirty_bytes(&dirty));
+        if let Err(e) = self.copy_from_local_to_remote(local_file, remote_path.as_path()) {
             eprintln!("Failed to copy file to remote server: {:?}", remote_path);
-            reply.error(e);
-            return;
-        }
-
-        // Mark file as clean after successful flush
-        {
-            let mut st = self.st.lock().unwrap();
-            if let Some(entry) = st.open_files.get_mut(&fh) {
-                entry.dirty = false;
-            }
+            cached.restore_dirty(dirty);
+            return Err(e);
         }
-
-        reply.ok();
+        self.after_upload(ino, &remote_path);
+        Ok(())
     }
 
-    fn release(
-        &mut self,
-        _req: &Request<'_>,
+    fn do_release(
+        &self,
         _ino: u64,
         _fh: u64,
         _flags: i32,
@@ -750,16 +1391,14 @@ impl Filesystem for TULFS {
         // print!("release\n");
         // println!("ino: {}, fh: {}", _ino, _fh);
 
-        let (is_dirty, entry_ino) = {
-            let st = self.st.lock().unwrap();
-            match st.open_files.get(&_fh) {
-                Some(entry) => (entry.dirty, entry.ino),
-                None => {
-                    reply.error(EINVAL);
-                    return;
-                }
+        let entry = match self.files.get(_fh) {
+            Some(entry) => entry,
+            None => {
+                reply.error(EINVAL);
+                return;
             }
         };
+        let (is_dirty, entry_ino) = (entry.cached.is_dirty(), entry.ino);
         // println!("is_dirty: {}, entry_ino: {}", is_dirty, entry_ino);
         let path = match self.path_for_inode(entry_ino) {
             Some(p) => p,
@@ -771,44 +1410,51 @@ impl Filesystem for TULFS {
 
         // println!("Path from inode {:?}", path);
         let path  = path.strip_prefix("/").unwrap_or(&path).to_path_buf();
-        if is_dirty {
-            let path = path.strip_prefix("/").unwrap_or(&path).to_path_buf();
-            let remote_path = self.get_remote_abs_path(&path);
-            let local_path = self.get_local_abs_path(&path);
-            // println!("Flushing dirty file to remote server: {:?}", remote_path);
-            let local_file = match OpenOptions::new().read(true).open(&local_path) {
-                Ok(f) => f,
-                Err(_) => {
-                    eprintln!("Failed to open local file: {:?}", local_path);
-                    reply.error(EIO);
-                    return;
-                }
-            };
-            let res = self.copy_from_local_to_remote(local_file, remote_path.as_path());
-            if let Err(e) = res {
-                eprintln!("Failed to copy file to remote server: {:?}", remote_path);
+
+        // Under a write lease the upload is left to the lease thread, which
+        // batches it with later writes to the same file
+        let deferred = is_dirty && {
+            let mut st = self.st.lock().unwrap();
+            if st.holds_write_lease(entry_ino) {
+                st.deferred.insert(entry_ino, Instant::now());
+                st.valid_data.insert(entry_ino);
+                true
+            } else {
+                false
+            }
+        };
+        if is_dirty && !deferred {
+            if let Err(e) = self.upload_dirty(entry_ino, &entry.cached, &path) {
                 reply.error(e);
                 return;
             }
         }
 
         let mut st = self.st.lock().unwrap();
-        st.open_files.remove(&_fh);
-
-        // remove mappings and cached file if no other open files with same inode
-        let still_open = st.open_files.values().any(|entry| entry.ino == entry_ino);
-        if still_open {
+        self.files.remove(_fh);
+
+        // remove mappings and cached file if no other open files with same inode,
+        // unless a callback tells us the cached copy is still current
+        let still_open = self.inodes.closed(entry_ino) > 0;
+        if still_open || st.valid_data.contains(&entry_ino) || st.busy.contains(&entry_ino) {
+            if !still_open {
+                let absent = entry.cached.absent();
+                if !absent.is_empty() {
+                    st.absent.insert(entry_ino, absent);
+                }
+                if !deferred && !st.busy.contains(&entry_ino) {
+                    st.keep_closed(entry_ino, &self.cache_dir(), &self.stats, &entry.cached.touched());
+                }
+            }
             drop(st);
             reply.ok();
             return;
         }
-        // println!("Removing inode to path mapping for inode {}", entry_ino);
-        st.inode_to_path.remove(&_ino);
-        // println!("Removing path to inode mapping for path {:?}", path);
-        st.path_to_inode.remove(&path);
-        drop(st);
+        // println!("Removing mappings for inode {}", entry_ino);
+        self.inodes.remove(entry_ino);
 
-        // delete the local cached file
+        // delete the local cached file, still under the lock so that an open
+        // on another worker can't pick it up in between
         let local_path = self.get_local_abs_path(&path);
         if local_path.exists() {
             if let Err(e) = fs::remove_file(&local_path) {
@@ -816,11 +1462,357 @@ impl Filesystem for TULFS {
                 // Not a critical error, so we don't return here
             }
         }
+        st.forget_tier(entry_ino);
+        drop(st);
         // println!("Deleted local cached file: {:?}", local_path);
 
         reply.ok();
     }
 
+    fn do_read(
+        &self,
+        ino: u64,
+        fh: u64,
+        offset: i64,
+        size: u32,
+        flags: i32,
+        lock_owner: Option<u64>,
+        reply: ReplyData,
+    ) {
+        // println!("read");
+        // println!(
+            // "ino: {}, fh: {}, offset: {}, size: {}, flags: {}, lock_owner: {:?}",
+            // ino, fh, offset, size, flags, lock_owner
+        // );
+        let (cached, len) = match self.read_prepare(ino, fh, offset as u64, size) {
+            Ok(source) => source,
+            Err(e) => {
+                reply.error(e);
+                return;
+            }
+        };
+        if len == 0 {
+            reply.data(&[]);
+            return;
+        }
+        let start = Instant::now();
+        if let Some(tier) = &self.tier {
+            if let Some(blocks) = self.tier_blocks(tier, ino, &cached, offset as u64, len) {
+                let skip = (offset as u64 % memtier::BLOCK) as usize;
+                if blocks.len() == 1 {
+                    reply.data(&blocks[0][skip..skip + len]);
+                } else {
+                    let mut buffer = bufpool::get(len);
+                    memtier::gather(&blocks, skip, &mut buffer);
+                    reply.data(&buffer);
+                }
+                self.stats.record_cache_io(false, 0, len, start.elapsed());
+                return;
+            }
+        }
+        if self.config.mmap {
+            // Reply straight from the page cache, no buffer or copy of ours
+            if cached.map(offset as u64 + len as u64) {
+                let len = cached.with_mapped(offset as u64, len, |data| {
+                    reply.data(data);
+                    data.len()
+                });
+                self.stats.record_cache_io(false, 0, len, start.elapsed());
+                return;
+            }
+        }
+        if let Some(uring) = self.uring.as_ref().filter(|_| len <= uring::BUF_SIZE) {
+            // Reply straight from the registered buffer
+            let mut buf = uring.buf();
+            match uring.read(cached.target(), &mut buf, len, offset as u64) {
+                Ok(bytes_read) => {
+                    self.stats.record_cache_io(false, 0, bytes_read, start.elapsed());
+                    reply.data(&buf.as_slice()[..bytes_read]);
+                }
+                Err(_) => reply.error(EIO),
+            }
+            return;
+        }
+        let mut buffer = bufpool::get(len);
+        match cached.file.read_at(&mut buffer, offset as u64) {
+            Ok(bytes_read) => {
+                self.stats.record_cache_io(false, 1, bytes_read, start.elapsed());
+                reply.data(&buffer[..bytes_read]);
+            }
+            Err(_) => {
+                reply.error(EIO);
+            }
+        }
+    }
+
+    /**
+     * Everything a read of `size` bytes at `offset` of handle `fh` needs
+     * before its data comes out of the cache file. Returns the cache file and
+     * how many of the bytes it holds.
+     */
+    fn read_prepare(&self, ino: u64, fh: u64, offset: u64, size: u32) -> Result<(Arc<CachedInode>, usize), libc::c_int> {
+        // Reads of one file take no lock and run in parallel
+        let entry = self.files.get(fh).ok_or(EINVAL)?;
+        let cached = entry.cached.clone();
+
+        // Nothing past what the cache file holds yet
+        let available = cached.fetched().saturating_sub(offset);
+        let len = available.min(size as u64) as usize;
+        if len == 0 {
+            return Ok((cached, 0));
+        }
+        cached.touch(offset, len);
+        // Keep punched chunks ahead of a sequential reader on their way
+        // before waiting for the ones this read needs
+        if let Some(ahead) = entry.pattern.lock().unwrap().advance(offset, len) {
+            self.read_ahead(ino, &cached, ahead);
+        }
+        self.fill_holes(ino, &cached, offset..offset + len as u64)?;
+        Ok((cached, len))
+    }
+}
+
+// READ and WRITE as served by the /dev/fuse loop of --splice, and handles
+// it passes through
+impl fusedev::DataPath for TULFS {
+    type File = Arc<CachedInode>;
+
+    fn read_from(&self, ino: u64, fh: u64, offset: u64, size: u32) -> Result<(Self::File, usize), libc::c_int> {
+        self.read_prepare(ino, fh, offset, size)
+    }
+
+    fn write_to(&self, ino: u64, fh: u64, _offset: u64, _len: usize) -> Result<Self::File, libc::c_int> {
+        self.write_prepare(ino, fh)
+    }
+
+    fn sent(&self, _ino: u64, len: usize, elapsed: Duration) {
+        // Into the pipe and out of it
+        self.stats.record_cache_io(false, 2, len, elapsed);
+        self.stats.record(OpClass::Data, elapsed);
+    }
+
+    fn written(&self, ino: u64, fh: u64, offset: u64, len: usize, elapsed: Duration) {
+        if let Some(entry) = self.files.get(fh) {
+            entry.cached.wrote(offset, len);
+        }
+        // The data never was in our memory to patch the tier's blocks with
+        if let Some(tier) = &self.tier {
+            tier.discard(ino, offset, len as u64);
+        }
+        self.stats.record_cache_io(true, 1, len, elapsed);
+        self.stats.record(OpClass::Data, elapsed);
+    }
+
+    fn passthrough(&self, _ino: u64, fh: u64) -> Option<Self::File> {
+        // Punched out chunks are fetched as reads need them, so the kernel
+        // can only have files with all their data
+        let entry = self.files.get(fh)?;
+        (!entry.cached.has_holes()).then(|| entry.cached.clone())
+    }
+
+    fn changed(&self, ino: u64, fh: u64, size: u64, was: u64) {
+        // Which bytes changed is lost, upload all of them
+        if let Some(entry) = self.files.get(fh) {
+            entry.cached.wrote(0, size as usize);
+        }
+        if let Some(tier) = &self.tier {
+            tier.discard(ino, 0, size.max(was));
+        }
+    }
+}
+
+impl Filesystem for TULFS {
+    fn init(
+        &mut self,
+        _req: &Request<'_>,
+        _config: &mut fuser::KernelConfig,
+    ) -> Result<(), libc::c_int> {
+        print!("init\n");
+        // Have O_TRUNC come with the open, not as a setattr after it, so the
+        // open doesn't fetch data it is about to throw away
+        let _ = _config.add_capabilities(FUSE_ATOMIC_O_TRUNC);
+        // Writes as big as the kernel makes them rather than a page each,
+        // fuser's protocol version predates them being the default
+        let _ = _config.add_capabilities(FUSE_BIG_WRITES);
+        self.ensure_root();
+        Ok(())
+    }
+
+    fn destroy(&mut self) {
+        // Don't lose writes of files still open or held back under a write
+        // lease
+        self.flush_dirty_files();
+        self.upload_deferred(true);
+        self.stats.dump(&self.stats_path());
+    }
+
+    fn getattr(&mut self, _req: &Request<'_>, ino: u64, reply: ReplyAttr) {
+        self.dispatch(OpClass::Metadata, move |fs| fs.do_getattr(ino, reply));
+    }
+
+    fn lookup(&mut self, _req: &Request<'_>, parent: u64, name: &OsStr, reply: ReplyEntry) {
+        let name = name.to_os_string();
+        self.dispatch(OpClass::Metadata, move |fs| fs.do_lookup(parent, &name, reply));
+    }
+
+    fn readdir(
+        &mut self,
+        _req: &Request<'_>,
+        ino: u64,
+        fh: u64,
+        offset: i64,
+        reply: ReplyDirectory,
+    ) {
+        self.dispatch(OpClass::Metadata, move |fs| fs.do_readdir(ino, fh, offset, reply));
+    }
+
+    fn open(&mut self, _req: &Request<'_>, ino: u64, flags: i32, reply: ReplyOpen) {
+        self.dispatch(OpClass::Data, move |fs| fs.do_open(ino, flags, reply));
+    }
+
+    fn write(
+        &mut self,
+        _req: &Request<'_>,
+        ino: u64,
+        fh: u64,
+        offset: i64,
+        data: &[u8],
+        write_flags: u32,
+        flags: i32,
+        lock_owner: Option<u64>,
+        reply: ReplyWrite,
+    ) {
+        // Writes only touch the local cache file, except for asking the
+        // server for a write lease or fetching back punched out chunks
+        let holes = self.files.get(fh).is_some_and(|entry| entry.cached.has_holes());
+        if !self.config.leases && !holes {
+            let start = Instant::now();
+            self.do_write(ino, fh, offset, data, write_flags, flags, lock_owner, reply);
+            self.stats.record(OpClass::Data, start.elapsed());
+            return;
+        }
+        let data = data.to_vec();
+        self.dispatch(OpClass::Data, move |fs| {
+            fs.do_write(ino, fh, offset, &data, write_flags, flags, lock_owner, reply)
+        });
+    }
+
+    fn read(
+        &mut self,
+        _req: &Request<'_>,
+        ino: u64,
+        fh: u64,
+        offset: i64,
+        size: u32,
+        flags: i32,
+        lock_owner: Option<u64>,
+        reply: ReplyData,
+    ) {
+        // Reads come from the local cache file, no need to leave this thread
+        // unless chunks punched out of it may have to be fetched back
+        if self.files.get(fh).is_some_and(|entry| entry.cached.has_holes()) {
+            self.dispatch(OpClass::Data, move |fs| {
+                fs.do_read(ino, fh, offset, size, flags, lock_owner, reply)
+            });
+            return;
+        }
+        let start = Instant::now();
+        self.do_read(ino, fh, offset, size, flags, lock_owner, reply);
+        self.stats.record(OpClass::Data, start.elapsed());
+    }
+
+    fn setattr(
+        &mut self,
+        _req: &Request<'_>,
+        ino: u64,
+        mode: Option<u32>,
+        uid: Option<u32>,
+        gid: Option<u32>,
+        size: Option<u64>,
+        atime: Option<fuser::TimeOrNow>,
+        mtime: Option<fuser::TimeOrNow>,
+        _ctime: Option<SystemTime>,
+        _fh: Option<u64>,
+        _crtime: Option<SystemTime>,
+        _chgtime: Option<SystemTime>,
+        _bkuptime: Option<SystemTime>,
+        _flags: Option<u32>,
+        reply: ReplyAttr,
+    ) {
+        let class = if size.is_some() { OpClass::Data } else { OpClass::Metadata };
+        self.dispatch(class, move |fs| {
+            fs.do_setattr(ino, mode, uid, gid, size, atime, mtime, reply)
+        });
+    }
+
+    fn fallocate(
+        &mut self,
+        _req: &Request<'_>,
+        ino: u64,
+        fh: u64,
+        offset: i64,
+        length: i64,
+        mode: i32,
+        reply: fuser::ReplyEmpty,
+    ) {
+        self.dispatch(OpClass::Data, move |fs| {
+            fs.do_fallocate(ino, fh, offset as u64, length as u64, mode, reply)
+        });
+    }
+
+    fn copy_file_range(
+        &mut self,
+        _req: &Request<'_>,
+        ino_in: u64,
+        fh_in: u64,
+        offset_in: i64,
+        ino_out: u64,
+        fh_out: u64,
+        offset_out: i64,
+        len: u64,
+        _flags: u32,
+        reply: ReplyWrite,
+    ) {
+        self.dispatch(OpClass::Data, move |fs| {
+            fs.do_copy_file_range(
+                ino_in,
+                fh_in,
+                offset_in as u64,
+                ino_out,
+                fh_out,
+                offset_out as u64,
+                len,
+                reply,
+            )
+        });
+    }
+
+    fn flush(
+        &mut self,
+        _req: &Request<'_>,
+        ino: u64,
+        fh: u64,
+        lock_owner: u64,
+        reply: fuser::ReplyEmpty,
+    ) {
+        self.dispatch(OpClass::Data, move |fs| fs.do_flush(ino, fh, lock_owner, reply));
+    }
+
+    fn release(
+        &mut self,
+        _req: &Request<'_>,
+        ino: u64,
+        fh: u64,
+        flags: i32,
+        lock_owner: Option<u64>,
+        flush: bool,
+        reply: fuser::ReplyEmpty,
+    ) {
+        self.dispatch(OpClass::Data, move |fs| {
+            fs.do_release(ino, fh, flags, lock_owner, flush, reply)
+        });
+    }
+
     fn lseek(
             &mut self,
             _req: &Request<'_>,
@@ -832,33 +1824,39 @@ impl Filesystem for TULFS {
         ) {
         print!("lseek\n");
 
-        let mut st = self.st.lock().unwrap();
-        let open_entry = match st.open_files.get_mut(&fh) {
+        let open_entry = match self.files.get(fh) {
             Some(entry) => entry,
             None => {
                 reply.error(EINVAL);
                 return;
             }
         };
+        let file = &open_entry.cached.file;
+        // The kernel keeps file positions itself and only asks us for
+        // SEEK_DATA and SEEK_HOLE. Cache I/O is positional, so the shared
+        // fd's own offset can be moved freely
         let new_offset = match whence {
             libc::SEEK_SET => offset,
-            libc::SEEK_CUR => {
-                match open_entry.file.seek(SeekFrom::Current(0)) {
-                    Ok(pos) => pos as i64 + offset,
-                    Err(_) => {
-                        reply.error(EIO);
-                        return;
-                    }
+            libc::SEEK_END => match file.metadata() {
+                Ok(md) => md.len() as i64 + offset,
+                Err(_) => {
+                    reply.error(EIO);
+                    return;
                 }
-            }
-            libc::SEEK_END => {
-                match open_entry.file.seek(SeekFrom::End(0)) {
-                    Ok(pos) => pos as i64 + offset,
-                    Err(_) => {
-                        reply.error(EIO);
-                        return;
-                    }
+            },
+            libc::SEEK_DATA | libc::SEEK_HOLE => {
+                // Chunks evicted from the cache file are holes there but data
+                // in the file, bring them back before the cache file answers
+                if let Err(e) = self.fill_holes(ino, &open_entry.cached, offset.max(0) as u64..u64::MAX) {
+                    reply.error(e);
+                    return;
                 }
+                let pos = unsafe { libc::lseek(file.as_raw_fd(), offset, whence) };
+                if pos < 0 {
+                    reply.error(std::io::Error::last_os_error().raw_os_error().unwrap_or(EIO));
+                    return;
+                }
+                pos
             }
             _ => {
                 reply.error(EINVAL);
@@ -869,10 +1867,7 @@ impl Filesystem for TULFS {
             reply.error(EINVAL);
             return;
         }
-        match open_entry.file.seek(SeekFrom::Start(new_offset as u64)) {
-            Ok(pos) => reply.offset(pos as i64),
-            Err(_) => reply.error(EIO),
-        }
+        reply.offset(new_offset);
     }
 }
 
@@ -892,8 +1887,8 @@ fn extract_hostname_and_path(backing: &str) -> Option<(&str, &str)> {
 fn main() {
     let args: Vec<_> = std::env::args_os().skip(1).collect();
     // println!("Args {:?}", args);
-    if (args.len() != 2) {
-        eprintln!("Usage: client <mountpoint> <user@host:backing_directory>");
+    if (args.len() < 2) {
+        eprintln!("Usage: client <mountpoint> <user@host:backing_directory> [--leases] [--snapshot] [--uring] [--no-mmap] [--splice] [--no-passthrough] [--no-admission] [--workers=N] [--sessions=N] [--bulk-sessions=N] [--lanes=N] [--mem-cache-mb=N] [--cache-mb=N]");
         std::process::exit(1);
     }
     let arg = args.as_slice();
@@ -921,23 +1916,49 @@ fn main() {
 
     let backing_root = PathBuf::from(directory_path);
 
+    let opts: Vec<&str> = arg[2..].iter().filter_map(|s| s.to_str()).collect();
+    let config = match MountConfig::parse(&opts) {
+        Ok(c) => c,
+        Err(e) => {
+            eprintln!("{}", e);
+            std::process::exit(1);
+        }
+    };
+
     let mut opts = vec![
         MountOption::FSName("TULFS".into()),
         MountOption::AutoUnmount,
         MountOption::DefaultPermissions,
         MountOption::CUSTOM("writeback_cache".into()),
         MountOption::CUSTOM("async_read".into()),
-        MountOption::CUSTOM("max_read=1048576".into()), // 1 MB
-        MountOption::CUSTOM("max_write=1048576".into()), // 1 MB
+        MountOption::CUSTOM(format!("max_read={}", bufpool::MAX_IO)),
+        MountOption::CUSTOM(format!("max_write={}", bufpool::MAX_IO)),
         MountOption::CUSTOM("max_readahead=1048576".into()), //
         MountOption::CUSTOM("max_background=64".into()),
         MountOption::CUSTOM("congestion_threshold=32".into()),
         
     ];
 
-    let tulfs = TULFS::new(hostname.to_string(), backing_root);
+    let (splice, passthrough) = (config.splice, config.passthrough);
+    let workers = config.workers;
+    let tulfs = TULFS::new(hostname.to_string(), backing_root, config);
+    let kernel = tulfs.kernel();
+    let data_path = (splice || passthrough).then(|| tulfs.clone());
 
-    if let Err(err) = fuser::mount2(tulfs, mountpoint, &opts) {
+    let mut session = match FuseSession::new(tulfs, Path::new(mountpoint), &opts) {
+        Ok(s) => s,
+        Err(err) => {
+            eprintln!("Failed to mount filesystem: {}", err);
+            std::process::exit(1);
+        }
+    };
+    if let Some(fs) = data_path {
+        if let Err(err) = fusedev::DeviceLoop::start(fs, workers, splice, passthrough) {
+            eprintln!("Could not take over /dev/fuse, no splice or passthrough: {}", err);
+        }
+    }
+    kernel.attach();
+    if let Err(err) = session.run() {
         eprintln!("Failed to mount filesystem: {}", err);
         std::process::exit(1);
     }
@@ -0,0 +1,135 @@
+use crate::TULFS;
+
+use networked_file_system::protocol::{LeaseKind, Message};
+
+use fuser::ReplyWrite;
+use libc::{EACCES, EBADF, EIO, ENOENT, EOPNOTSUPP, O_ACCMODE, O_RDONLY};
+
+use std::os::fd::AsRawFd;
+
+// Most one copy_file_range reply can report, as a u32
+const MAX_COPY: u64 = 1 << 30;
+
+impl TULFS {
+    /**
+     * copy_file_range between two files of the mount. The server copies the
+     * range between the backing files, sharing extents where its file system
+     * can, and we apply the same copy between our cache files, so none of
+     * the data crosses the network either way. Answers EOPNOTSUPP when the
+     * server can't do it for us, the caller then falls back to reading and
+     * writing.
+     */
+    pub(crate) fn do_copy_file_range(
+        &self,
+        ino_in: u64,
+        fh_in: u64,
+        offset_in: u64,
+        ino_out: u64,
+        fh_out: u64,
+        offset_out: u64,
+        len: u64,
+        reply: ReplyWrite,
+    ) {
+        let (Some(src), Some(dst)) = (self.files.get(fh_in), self.files.get(fh_out)) else {
+            reply.error(EBADF);
+            return;
+        };
+        if dst.flags & O_ACCMODE as u32 == O_RDONLY as u32 {
+            reply.error(EACCES);
+            return;
+        }
+        let Some(server) = self.callback_server().or(self.lease_server()) else {
+            reply.error(EOPNOTSUPP);
+            return;
+        };
+        // With leases, readers of the destination let go before the server
+        // writes it, and no one may write the source meanwhile
+        let leased = self
+            .lease_for_change(ino_out, LeaseKind::Write)
+            .and_then(|_| self.lease_for_change(ino_in, LeaseKind::Read));
+        if leased.is_err() {
+            reply.error(EOPNOTSUPP);
+            return;
+        }
+        // Both cache files have to be what the server has, or the two copies
+        // would differ
+        let in_sync = |ino: u64, dirty: bool| {
+            let mut st = self.st.lock().unwrap();
+            !dirty && !st.deferred.contains_key(&ino) && st.data_covered(ino)
+        };
+        if !in_sync(ino_in, src.cached.is_dirty()) || !in_sync(ino_out, dst.cached.is_dirty()) {
+            reply.error(EOPNOTSUPP);
+            return;
+        }
+
+        let len = len.min(src.cached.fetched().saturating_sub(offset_in)).min(MAX_COPY);
+        if len == 0 {
+            reply.written(0);
+            return;
+        }
+        let fill = self
+            .fill_holes(ino_in, &src.cached, offset_in..offset_in + len)
+            .and_then(|_| self.fill_holes(ino_out, &dst.cached, 0..u64::MAX));
+        if let Err(e) = fill {
+            reply.error(e);
+            return;
+        }
+
+        let (Some(src_path), Some(dst_path)) = (self.path_for_inode(ino_in), self.path_for_inode(ino_out)) else {
+            reply.error(ENOENT);
+            return;
+        };
+        let remote_src = self.get_remote_abs_path(src_path.strip_prefix("/").unwrap_or(&src_path));
+        let remote_dst = self.get_remote_abs_path(dst_path.strip_prefix("/").unwrap_or(&dst_path));
+        let copied = match server.call(Message::CopyRange {
+            src: remote_src,
+            src_offset: offset_in,
+            dst: remote_dst.clone(),
+            dst_offset: offset_out,
+            len,
+        }) {
+            Ok(Message::Copied { bytes }) => bytes,
+            Ok(Message::Error { errno }) => {
+                eprintln!("Server copy to {:?} failed: {}", remote_dst, errno);
+                reply.error(EOPNOTSUPP);
+                return;
+            }
+            _ => {
+                reply.error(EOPNOTSUPP);
+                return;
+            }
+        };
+
+        // Same copy on our side, within the local disk
+        let mut done = 0u64;
+        while done < copied {
+            let mut off_in = (offset_in + done) as i64;
+            let mut off_out = (offset_out + done) as i64;
+            let n = unsafe {
+                libc::copy_file_range(
+                    src.cached.file.as_raw_fd(),
+                    &mut off_in,
+                    dst.cached.file.as_raw_fd(),
+                    &mut off_out,
+                    (copied - done) as usize,
+                    0,
+                )
+            };
+            if n <= 0 {
+                // The server has the copy and we don't, fetch the file again next open
+                eprintln!("Local copy into inode {} failed: {}", ino_out, std::io::Error::last_os_error());
+                self.st.lock().unwrap().valid_data.remove(&ino_out);
+                reply.error(EIO);
+                return;
+            }
+            done += n as u64;
+        }
+        dst.cached.grew(offset_out + copied);
+        if let Some(tier) = &self.tier {
+            tier.discard(ino_out, offset_out, copied);
+        }
+        self.after_upload(ino_out, &remote_dst);
+        self.stats.record_server_copy(copied);
+        reply.written(copied as u32);
+    }
+}
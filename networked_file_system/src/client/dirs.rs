@@ -0,0 +1,422 @@
+use crate::bulk::BULK_MAX;
+use crate::{remote_attr_from_stat, AttrSource, State, TULFS, TTL};
+
+use networked_file_system::protocol::RemoteAttr;
+
+use fuser::{FileAttr, FileType};
+use libc::ENOENT;
+
+use std::{
+    collections::{HashMap, HashSet},
+    ops::Bound,
+    ffi::{OsStr, OsString},
+    path::{Path, PathBuf},
+    time::{Duration, Instant, SystemTime},
+};
+
+// SFTP only gives whole-second mtimes, so a directory modified again within
+// the same second as our stat looks unchanged. A stamp is only trusted if the
+// directory had been left alone for this long when we took it.
+const STAMP_SETTLE: Duration = Duration::from_secs(2);
+
+// Lookups of names we know nothing about in the same directory before we read
+// the whole directory to answer the rest (and the misses) locally
+const LISTING_AFTER_MISSES: u32 = 2;
+
+// Running the helper takes a couple of round trips to set up the channel, so
+// it only pays for itself past this many paths
+const BULK_MIN: usize = 4;
+
+// Listed directories below a parent looked at per revalidation, so a check
+// near the root doesn't walk the whole tree under the state lock
+const DUE_SCAN: usize = 4 * BULK_MAX;
+
+/**
+ * What we know about a remote directory for revalidating its children in
+ * bulk. Any entry created, removed or renamed in a directory changes its
+ * mtime (and ctime), so while the stamp stays the same every name we saw in
+ * it is still there, and nothing new has appeared.
+ */
+pub(crate) struct DirState {
+    stamp: RemoteAttr,
+    trusted: bool,    // See STAMP_SETTLE
+    since: Instant,   // When we first saw this stamp, older child entries predate it
+    checked: Instant, // Last time we compared the stamp against the server
+    children: Option<HashSet<OsString>>, // All names in the directory, once we've listed it
+    misses: u32,
+}
+
+// Stamps from a bulk stat carry nanoseconds and ctime, plain SFTP stats
+// don't, so only compare what both sides have
+fn same_stamp(a: &RemoteAttr, b: &RemoteAttr) -> bool {
+    let precise = a.ctime != 0 && b.ctime != 0;
+    a.mtime == b.mtime
+        && a.size == b.size
+        && (!precise
+            || (a.mtime_nsec == b.mtime_nsec
+                && a.ctime == b.ctime
+                && a.ctime_nsec == b.ctime_nsec))
+}
+
+impl State {
+    /**
+     * Records directories whose full contents came back from a bulk stat of
+     * `depth` levels under `root`, so later lookups in them can be answered
+     * from their stamps.
+     */
+    pub(crate) fn record_listings(
+        &mut self,
+        root: &Path,
+        depth: Option<u32>,
+        entries: &[(PathBuf, RemoteAttr)],
+        checked: Instant,
+    ) {
+        let root_depth = root.components().count();
+        let mut listed: HashMap<&Path, (RemoteAttr, HashSet<OsString>)> = HashMap::new();
+        for (rel, attr) in entries {
+            let below = rel.components().count() - root_depth;
+            if attr.is_dir && depth.is_none_or(|d| (below as u32) < d) {
+                listed.insert(rel, (*attr, HashSet::new()));
+            }
+            if rel.as_os_str().is_empty() {
+                continue;
+            }
+            if let (Some(parent), Some(name)) = (rel.parent(), rel.file_name()) {
+                if let Some((_, names)) = listed.get_mut(parent) {
+                    names.insert(name.to_os_string());
+                }
+            }
+        }
+        for (rel, (stamp, names)) in listed {
+            let ino = match self.inodes.ino(rel) {
+                Some(ino) => ino,
+                None if rel.as_os_str().is_empty() => crate::ROOT_INODE,
+                None => continue,
+            };
+            self.dirs.insert(
+                ino,
+                DirState {
+                    stamp,
+                    trusted: settled(&stamp),
+                    since: checked,
+                    checked,
+                    children: Some(names),
+                    misses: 0,
+                },
+            );
+            self.listed.insert(rel.to_path_buf(), ino);
+        }
+    }
+}
+
+fn settled(stamp: &RemoteAttr) -> bool {
+    let now = SystemTime::now()
+        .duration_since(SystemTime::UNIX_EPOCH)
+        .map(|d| d.as_secs() as i64)
+        .unwrap_or(0);
+    now - stamp.mtime >= STAMP_SETTLE.as_secs() as i64
+}
+
+impl TULFS {
+    /**
+     * Makes sure directory `ino` was compared against the server within the
+     * last TTL, one stat shared by all lookups in it. Returns when its current
+     * stamp was first seen, or None if the stamp can't vouch for anything.
+     */
+    fn revalidate_dir(&self, ino: u64, rel: &Path) -> Option<Instant> {
+        {
+            let st = self.st.lock().unwrap();
+            if let Some(dir) = st.dirs.get(&ino) {
+                if dir.checked.elapsed() < TTL {
+                    return dir.trusted.then_some(dir.since);
+                }
+            }
+        }
+
+        // Tree walks come back for the directories below soon, check the
+        // ones that are due along with this one
+        let due = self.due_below(ino, rel);
+        if due.len() >= BULK_MIN {
+            let paths: Vec<PathBuf> = due.iter().map(|(_, p)| p.clone()).collect();
+            if let Ok(entries) = self.bulk_stat_paths(&paths, 0) {
+                let stamps: HashMap<PathBuf, RemoteAttr> = entries.into_iter().collect();
+                for (dir_ino, dir_rel) in &due {
+                    self.update_stamp(*dir_ino, stamps.get(dir_rel).copied());
+                }
+                let st = self.st.lock().unwrap();
+                let dir = st.dirs.get(&ino)?;
+                return dir.trusted.then_some(dir.since);
+            }
+        }
+
+        let stamp = {
+            let sftp = self.sftp();
+            sftp.check(sftp.stat(&self.get_remote_abs_path(rel)))
+                .ok()
+                .map(|stat| remote_attr_from_stat(&stat))
+        };
+        self.update_stamp(ino, stamp)
+    }
+
+    /**
+     * Directory `ino` followed by listed directories below it whose stamps
+     * are due for a check, at most BULK_MAX of them. Only looks at the
+     * directories indexed under `rel` in `listed`, dropping entries that were
+     * renamed or lost their listing since.
+     */
+    fn due_below(&self, ino: u64, rel: &Path) -> Vec<(u64, PathBuf)> {
+        let mut due = vec![(ino, rel.to_path_buf())];
+        let mut st = self.st.lock().unwrap();
+        let mut stale = Vec::new();
+        let below = st
+            .listed
+            .range::<Path, _>((Bound::Included(rel), Bound::Unbounded))
+            .take_while(|(dir_rel, _)| dir_rel.starts_with(rel))
+            .take(DUE_SCAN);
+        for (dir_rel, &dir_ino) in below {
+            if due.len() >= BULK_MAX {
+                break;
+            }
+            let Some(dir) = st.dirs.get(&dir_ino).filter(|d| d.children.is_some()) else {
+                stale.push(dir_rel.clone());
+                continue;
+            };
+            if st.inodes.path(dir_ino).as_deref() != Some(dir_rel.as_path()) {
+                stale.push(dir_rel.clone());
+                continue;
+            }
+            if dir_ino == ino || dir_ino == crate::ROOT_INODE || dir.checked.elapsed() < TTL {
+                continue;
+            }
+            due.push((dir_ino, dir_rel.clone()));
+        }
+        for dir_rel in stale {
+            st.listed.remove(&dir_rel);
+        }
+        due
+    }
+
+    /**
+     * Compares directory `ino` against a fresh stat of it (None if it's gone)
+     * and starts over if it changed. Returns what revalidate_dir does.
+     */
+    fn update_stamp(&self, ino: u64, stamp: Option<RemoteAttr>) -> Option<Instant> {
+        let Some(stamp) = stamp.filter(|s| s.is_dir) else {
+            self.st.lock().unwrap().dirs.remove(&ino);
+            return None;
+        };
+        if ino != crate::ROOT_INODE {
+            self.cache_attr(ino, stamp, AttrSource::Sftp);
+        }
+
+        let now = Instant::now();
+        let mut st = self.st.lock().unwrap();
+        match st.dirs.get_mut(&ino) {
+            Some(dir) if dir.trusted && same_stamp(&dir.stamp, &stamp) => dir.checked = now,
+            _ => {
+                st.dirs.insert(
+                    ino,
+                    DirState {
+                        stamp,
+                        trusted: settled(&stamp),
+                        since: now,
+                        checked: now,
+                        children: None,
+                        misses: 0,
+                    },
+                );
+            }
+        }
+        let dir = &st.dirs[&ino];
+        dir.trusted.then_some(dir.since)
+    }
+
+    /**
+     * Reads directory `ino` in one go, caching the attributes of everything
+     * in it and remembering the full set of names. One round trip through the
+     * bulk stat helper, or a plain SFTP readdir without it.
+     */
+    pub(crate) fn load_listing(&self, ino: u64, rel: &Path) {
+        let checked = Instant::now();
+        if let Ok(entries) = self.bulk_stat_tree(rel, Some(1)) {
+            self.cache_bulk(&entries);
+            self.st
+                .lock()
+                .unwrap()
+                .record_listings(rel, Some(1), &entries, checked);
+            return;
+        }
+
+        let entries = {
+            let sftp = self.sftp();
+            sftp.check(sftp.readdir(&self.get_remote_abs_path(rel)))
+        };
+        let Ok(entries) = entries else {
+            return;
+        };
+        let mut names = HashSet::new();
+        for (path, stat) in entries {
+            let Some(name) = path.file_name() else {
+                continue;
+            };
+            if name == "." || name == ".." {
+                continue;
+            }
+            let child_ino = self.inode_for_path(&rel.join(name));
+            self.cache_attr(child_ino, remote_attr_from_stat(&stat), AttrSource::Sftp);
+            names.insert(name.to_os_string());
+        }
+        let mut st = self.st.lock().unwrap();
+        if let Some(dir) = st.dirs.get_mut(&ino) {
+            dir.children = Some(names);
+            st.listed.insert(rel.to_path_buf(), ino);
+        }
+    }
+
+    /**
+     * Refreshes, in one bulk stat, the expired attributes of regular files in
+     * listed directory `parent`, starting with `rel`. Tools like `git status`
+     * go on to stat the siblings next.
+     */
+    fn refresh_files(&self, parent: u64, parent_rel: &Path, rel: &Path) {
+        let mut batch = vec![rel.to_path_buf()];
+        {
+            let mut st = self.st.lock().unwrap();
+            let names: Vec<OsString> = match st.dirs.get(&parent).and_then(|d| d.children.as_ref()) {
+                Some(children) => children.iter().cloned().collect(),
+                None => Vec::new(),
+            };
+            for name in names {
+                if batch.len() >= BULK_MAX {
+                    break;
+                }
+                let sibling = parent_rel.join(&name);
+                if sibling == rel {
+                    continue;
+                }
+                let Some(ino) = st.inodes.ino(&sibling) else {
+                    continue;
+                };
+                let expired_file = st
+                    .attrs
+                    .get(&ino)
+                    .is_some_and(|c| c.attr.kind == FileType::RegularFile);
+                if expired_file && !st.has_valid_attr(ino) {
+                    batch.push(sibling);
+                }
+            }
+        }
+        if batch.len() < BULK_MIN {
+            return;
+        }
+        if let Ok(entries) = self.bulk_stat_paths(&batch, 0) {
+            self.cache_bulk(&entries);
+        }
+    }
+
+    /**
+     * Answers a lookup whose cached entry has expired from what we know of
+     * the parent, if the parent is provably unchanged: names missing from its
+     * listing still don't exist, and subdirectories we've seen still do (their
+     * own attributes are refreshed when they are revalidated as parents).
+     * Regular files may have been modified in place, which leaves the parent
+     * alone, so they are stat'ed again: in bulk with their expired siblings
+     * if the parent is listed, otherwise on their own by the caller (None).
+     */
+    pub(crate) fn lookup_by_parent(
+        &self,
+        parent: u64,
+        parent_rel: &Path,
+        name: &OsStr,
+        ino: u64,
+    ) -> Option<Result<FileAttr, libc::c_int>> {
+        let since = self.revalidate_dir(parent, parent_rel)?;
+
+        let need_listing = {
+            let mut st = self.st.lock().unwrap();
+            let dir = st.dirs.get_mut(&parent)?;
+            if let Some(children) = &dir.children {
+                if !children.contains(name) {
+                    return Some(Err(ENOENT));
+                }
+            }
+            let known = st.attrs.contains_key(&ino);
+            let dir = st.dirs.get_mut(&parent)?;
+            if !known && dir.children.is_none() {
+                dir.misses += 1;
+            }
+            dir.children.is_none() && dir.misses >= LISTING_AFTER_MISSES
+        };
+        if need_listing {
+            self.load_listing(parent, parent_rel);
+            let mut st = self.st.lock().unwrap();
+            let listed = st.dirs.get(&parent)?.children.as_ref()?.contains(name);
+            if !listed {
+                return Some(Err(ENOENT));
+            }
+            // Fresh from the listing
+            return st.valid_attr(ino).map(Ok);
+        }
+
+        let listed = {
+            let mut st = self.st.lock().unwrap();
+            let listed = st.dirs.get(&parent)?.children.is_some();
+            let cached = st.attrs.get_mut(&ino)?;
+            if cached.attr.kind == FileType::Directory {
+                if cached.fetched < since {
+                    return None;
+                }
+                cached.fetched = Instant::now();
+                return Some(Ok(cached.attr));
+            }
+            listed
+        };
+        if listed {
+            self.refresh_files(parent, parent_rel, &parent_rel.join(name));
+            return self.st.lock().unwrap().valid_attr(ino).map(Ok);
+        }
+        None
+    }
+
+    /**
+     * Entries of directory `ino` for readdir, sorted by name so that offsets
+     * stay stable between calls. The listing is reused while the directory's
+     * stamp vouches for it, or for the rest of a listing already under way
+     * when `restart` is false.
+     */
+    pub(crate) fn dir_entries(
+        &self,
+        ino: u64,
+        rel: &Path,
+        restart: bool,
+    ) -> Result<Vec<(u64, FileType, OsString)>, libc::c_int> {
+        let have_listing = |fs: &TULFS| {
+            let st = fs.st.lock().unwrap();
+            st.dirs.get(&ino).is_some_and(|d| d.children.is_some())
+        };
+        let current = !restart || self.revalidate_dir(ino, rel).is_some();
+        if !current || !have_listing(self) {
+            self.load_listing(ino, rel);
+        }
+
+        let st = self.st.lock().unwrap();
+        let Some(children) = st.dirs.get(&ino).and_then(|d| d.children.as_ref()) else {
+            return Err(ENOENT);
+        };
+        let mut names: Vec<&OsString> = children.iter().collect();
+        names.sort();
+        let mut entries = Vec::with_capacity(names.len());
+        for name in names {
+            let Some(child) = st.inodes.ino(&rel.join(name)) else {
+                continue;
+            };
+            let kind = st
+                .attrs
+                .get(&child)
+                .map(|cached| cached.attr.kind)
+                .unwrap_or(FileType::RegularFile);
+            entries.push((child, kind, name.clone()));
+        }
+        Ok(entries)
+    }
+}
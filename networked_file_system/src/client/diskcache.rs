@@ -0,0 +1,375 @@
+use crate::transfers::CHUNK;
+
+use std::collections::{BTreeMap, BTreeSet, HashMap, HashSet};
+
+// Share of the budget for files just closed, before they face admission
+const WINDOW_PCT: u64 = 1;
+const ROWS: usize = 4;
+// Counters stop here, telling 15 opens from 100 doesn't change a decision
+const MAX_COUNT: u8 = 15;
+// Sketch columns per file the budget holds at this average size
+const AVG_FILE: u64 = 256 << 10;
+// Files bigger than this are kept or evicted chunk by chunk
+const WHOLE_FILE_MAX: u64 = 4 * CHUNK;
+
+// Chunk index standing for a whole file
+pub(crate) const WHOLE: u64 = u64::MAX;
+
+// What is kept or evicted: (inode, chunk index or WHOLE)
+pub(crate) type Unit = (u64, u64);
+
+fn mix(mut x: u64) -> u64 {
+    // splitmix64 finalizer
+    x = (x ^ (x >> 30)).wrapping_mul(0xbf58476d1ce4e5b9);
+    x = (x ^ (x >> 27)).wrapping_mul(0x94d049bb133111eb);
+    x ^ (x >> 31)
+}
+
+/**
+ * Count-min sketch of how often each file was opened, or each chunk of a big
+ * file read, lately. All counters are halved every `sample` increments, so
+ * popularity fades and a file that was hot last week can be pushed out by
+ * one that is hot now.
+ */
+struct Sketch {
+    counters: Vec<u8>, // ROWS rows of `width`
+    width: usize,
+    additions: u64,
+    sample: u64,
+}
+
+impl Sketch {
+    fn new(files: u64) -> Self {
+        let width = (files.clamp(64, 1 << 20) as usize).next_power_of_two();
+        Sketch {
+            counters: vec![0; ROWS * width],
+            width,
+            additions: 0,
+            sample: 10 * width as u64,
+        }
+    }
+
+    fn slot(&self, unit: Unit, row: usize) -> usize {
+        let h = mix(unit.0 ^ mix(unit.1).wrapping_add(row as u64 * 0x9e3779b97f4a7c15));
+        row * self.width + (h as usize & (self.width - 1))
+    }
+
+    fn increment(&mut self, unit: Unit) {
+        let mut added = false;
+        for row in 0..ROWS {
+            let slot = self.slot(unit, row);
+            if self.counters[slot] < MAX_COUNT {
+                self.counters[slot] += 1;
+                added = true;
+            }
+        }
+        if added {
+            self.additions += 1;
+            if self.additions >= self.sample {
+                self.counters.iter_mut().for_each(|c| *c /= 2);
+                self.additions /= 2;
+            }
+        }
+    }
+
+    fn frequency(&self, unit: Unit) -> u8 {
+        (0..ROWS).map(|row| self.counters[self.slot(unit, row)]).min().unwrap()
+    }
+}
+
+#[derive(Clone, Copy, PartialEq)]
+enum Segment {
+    Window,
+    Main,
+}
+
+struct Entry {
+    bytes: u64,
+    tick: u64,
+    segment: Segment,
+}
+
+/**
+ * Which closed files keep their cache file, within a budget of bytes.
+ * Files being open are always kept and not counted. W-TinyLFU: a closed file
+ * enters a small LRU window, and what falls out of the window only displaces
+ * files of the main LRU that were opened less often lately. A sweep over
+ * many files opened once each, like a backup or a `cat` of something big,
+ * so passes through the window without evicting the working set. Without
+ * the filter the main LRU takes every file.
+ *
+ * Big files are kept per chunk rather than whole, each chunk weighed by how
+ * often it was read, so that the chunks nobody reads are punched out of the
+ * cache file and the budget holds the hot parts of many big files.
+ */
+pub(crate) struct DiskCache {
+    budget: u64, // None kept if 0
+    filter: bool,
+    sketch: Sketch,
+    entries: HashMap<Unit, Entry>,
+    chunks: HashMap<u64, HashSet<u64>>, // Units of each inode, for forget()
+    // Tick -> unit, least recent first
+    window: BTreeMap<u64, Unit>,
+    main: BTreeMap<u64, Unit>,
+    window_bytes: u64,
+    main_bytes: u64,
+    tick: u64,
+}
+
+impl Default for DiskCache {
+    fn default() -> Self {
+        DiskCache::new(0, false)
+    }
+}
+
+impl DiskCache {
+    pub(crate) fn new(budget: u64, filter: bool) -> Self {
+        DiskCache {
+            budget,
+            filter,
+            sketch: Sketch::new(budget / AVG_FILE),
+            entries: HashMap::new(),
+            chunks: HashMap::new(),
+            window: BTreeMap::new(),
+            main: BTreeMap::new(),
+            window_bytes: 0,
+            main_bytes: 0,
+            tick: 0,
+        }
+    }
+
+    pub(crate) fn limited(&self) -> bool {
+        self.budget > 0
+    }
+
+    fn window_cap(&self) -> u64 {
+        if self.filter {
+            self.budget * WINDOW_PCT / 100
+        } else {
+            0
+        }
+    }
+
+    fn link(&mut self, unit: Unit, bytes: u64, segment: Segment) {
+        self.tick += 1;
+        let tick = self.tick;
+        match segment {
+            Segment::Window => {
+                self.window.insert(tick, unit);
+                self.window_bytes += bytes;
+            }
+            Segment::Main => {
+                self.main.insert(tick, unit);
+                self.main_bytes += bytes;
+            }
+        }
+        self.entries.insert(unit, Entry { bytes, tick, segment });
+        self.chunks.entry(unit.0).or_default().insert(unit.1);
+    }
+
+    fn unlink(&mut self, unit: Unit) -> Option<u64> {
+        let entry = self.entries.remove(&unit)?;
+        match entry.segment {
+            Segment::Window => {
+                self.window.remove(&entry.tick);
+                self.window_bytes -= entry.bytes;
+            }
+            Segment::Main => {
+                self.main.remove(&entry.tick);
+                self.main_bytes -= entry.bytes;
+            }
+        }
+        if let Some(chunks) = self.chunks.get_mut(&unit.0) {
+            chunks.remove(&unit.1);
+            if chunks.is_empty() {
+                self.chunks.remove(&unit.0);
+            }
+        }
+        Some(entry.bytes)
+    }
+
+    /**
+     * Stops counting `ino`, whose cache file is gone or open again.
+     */
+    pub(crate) fn forget(&mut self, ino: u64) {
+        let chunks: Vec<u64> = self.chunks.get(&ino).into_iter().flatten().copied().collect();
+        for chunk in chunks {
+            self.unlink((ino, chunk));
+        }
+    }
+
+    pub(crate) fn opened(&mut self, ino: u64) {
+        if self.limited() {
+            self.sketch.increment((ino, WHOLE));
+        }
+        self.forget(ino);
+    }
+
+    /**
+     * Counts the cache file of `ino`, `bytes` long, as kept now that its last
+     * handle closed, minus the chunks `absent` from it. `touched` are the
+     * chunks read while it was open. Returns what has to go to stay in
+     * budget, which may include parts or all of this very file.
+     */
+    pub(crate) fn closed(&mut self, ino: u64, bytes: u64, touched: &[u64], absent: &BTreeSet<u64>) -> Vec<Unit> {
+        let mut drop = Vec::new();
+        if !self.limited() {
+            return drop;
+        }
+        self.forget(ino);
+        if bytes <= WHOLE_FILE_MAX {
+            self.link((ino, WHOLE), bytes, Segment::Window);
+        } else {
+            for &index in touched {
+                self.sketch.increment((ino, index));
+            }
+            // Untouched chunks go in as least recent, to be the first out
+            let touched: HashSet<u64> = touched.iter().copied().collect();
+            let present = (0..bytes.div_ceil(CHUNK)).filter(|i| !absent.contains(i));
+            let (hot, cold): (Vec<u64>, Vec<u64>) = present.partition(|i| touched.contains(i));
+            for index in cold.into_iter().chain(hot) {
+                let len = CHUNK.min(bytes - index * CHUNK);
+                self.link((ino, index), len, Segment::Window);
+                self.shrink_window(&mut drop);
+            }
+        }
+        self.shrink_window(&mut drop);
+        drop
+    }
+
+    fn shrink_window(&mut self, drop: &mut Vec<Unit>) {
+        let window_cap = self.window_cap();
+        while self.window_bytes > window_cap {
+            let Some((_, &candidate)) = self.window.first_key_value() else {
+                break;
+            };
+            let bytes = self.unlink(candidate).unwrap();
+            if !self.admit(candidate, bytes, drop) {
+                drop.push(candidate);
+            }
+        }
+    }
+
+    /**
+     * Moves `candidate` into the main LRU if there is room, or if it was
+     * used more often than each unit it would push out.
+     */
+    fn admit(&mut self, candidate: Unit, bytes: u64, drop: &mut Vec<Unit>) -> bool {
+        let cap = self.budget - self.window_cap();
+        if bytes > cap {
+            return false;
+        }
+        let mut victims = Vec::new();
+        let mut freed = 0;
+        for (_, &victim) in &self.main {
+            if self.main_bytes - freed + bytes <= cap {
+                break;
+            }
+            victims.push(victim);
+            freed += self.entries[&victim].bytes;
+        }
+        if self.filter {
+            let frequency = self.sketch.frequency(candidate);
+            if victims.iter().any(|&v| self.sketch.frequency(v) >= frequency) {
+                return false;
+            }
+        }
+        for victim in victims {
+            self.unlink(victim);
+            drop.push(victim);
+        }
+        self.link(candidate, bytes, Segment::Main);
+        true
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const MB: u64 = 1 << 20;
+
+    fn close(cache: &mut DiskCache, ino: u64, bytes: u64) -> Vec<Unit> {
+        cache.closed(ino, bytes, &[], &BTreeSet::new())
+    }
+
+    // The byte counters match the entries linked into each segment
+    fn check_bytes(cache: &DiskCache) {
+        let sum = |segment: Segment| -> u64 {
+            cache.entries.values().filter(|e| e.segment == segment).map(|e| e.bytes).sum()
+        };
+        assert_eq!(cache.window_bytes, sum(Segment::Window));
+        assert_eq!(cache.main_bytes, sum(Segment::Main));
+        assert_eq!(cache.window.len() + cache.main.len(), cache.entries.len());
+    }
+
+    #[test]
+    fn sweep_keeps_hot_set() {
+        // The hot set fills the main LRU, then a sweep of files opened once
+        // each passes through
+        let budget = 1 << 30;
+        let hot: Vec<u64> = (1..=1000).collect();
+        let sweep = 10_000..20_000;
+        let run = |filter: bool| {
+            let mut cache = DiskCache::new(budget, filter);
+            for _ in 0..8 {
+                for &ino in &hot {
+                    cache.opened(ino);
+                    assert!(close(&mut cache, ino, MB).is_empty());
+                }
+            }
+            let mut dropped = HashSet::new();
+            for ino in sweep.clone() {
+                cache.opened(ino);
+                dropped.extend(close(&mut cache, ino, MB).into_iter().map(|(ino, _)| ino));
+            }
+            hot.iter().filter(|ino| dropped.contains(ino)).count()
+        };
+        // A one-off sharing a counter with a hot file in every row looks as
+        // hot as it, the odd one of those gets in
+        assert!(run(true) <= hot.len() / 100);
+        // Plain LRU loses all of it
+        assert_eq!(run(false), hot.len());
+    }
+
+    #[test]
+    fn window_stays_within_cap() {
+        let budget = 256 * MB;
+        let mut cache = DiskCache::new(budget, true);
+        for ino in 1..2000 {
+            cache.opened(ino);
+            // Mix of small whole files and big ones kept per chunk
+            let bytes = match ino % 7 {
+                0 => 5 * CHUNK + 123,
+                3 => WHOLE_FILE_MAX,
+                _ => (ino % 13 + 1) * 64 << 10,
+            };
+            let touched: Vec<u64> = (0..bytes.div_ceil(CHUNK)).filter(|i| i % 2 == 0).collect();
+            cache.closed(ino, bytes, &touched, &BTreeSet::new());
+            assert!(cache.window_bytes <= cache.window_cap());
+            assert!(cache.window_bytes + cache.main_bytes <= budget);
+            check_bytes(&cache);
+        }
+    }
+
+    #[test]
+    fn forget_keeps_counts() {
+        let mut cache = DiskCache::new(64 * MB, true);
+        let absent: BTreeSet<u64> = [1].into();
+        for ino in 1..100 {
+            cache.opened(ino);
+            let bytes = if ino % 5 == 0 { 6 * CHUNK } else { (ino % 9 + 1) * 100 << 10 };
+            cache.closed(ino, bytes, &[0, 2], &absent);
+            if ino % 3 == 0 {
+                cache.forget(ino - 1);
+            }
+            check_bytes(&cache);
+        }
+        for ino in 1..100 {
+            cache.forget(ino);
+            check_bytes(&cache);
+        }
+        assert_eq!((cache.window_bytes, cache.main_bytes), (0, 0));
+        assert!(cache.entries.is_empty() && cache.chunks.is_empty());
+    }
+}
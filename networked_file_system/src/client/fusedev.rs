@@ -0,0 +1,763 @@
+use crate::notify::find_fuse_fd;
+
+use libc::{c_int, EBUSY, EINTR, EIO, ENODEV, ENOENT};
+
+use std::{
+    collections::HashMap,
+    io,
+    os::unix::io::{AsRawFd, RawFd},
+    ptr,
+    sync::{
+        atomic::{AtomicBool, AtomicU32, AtomicU64, Ordering},
+        Arc, Mutex,
+    },
+    thread,
+    time::{Duration, Instant},
+};
+
+// From <linux/fuse.h>
+const FUSE_OPEN: u32 = 14;
+const FUSE_READ: u32 = 15;
+const FUSE_WRITE: u32 = 16;
+const FUSE_RELEASE: u32 = 18;
+const FUSE_FLUSH: u32 = 25;
+const FUSE_INIT: u32 = 26;
+const FUSE_CREATE: u32 = 35;
+const IN_HEADER_LEN: usize = 40; // fuse_in_header: len u32, opcode u32, unique u64, nodeid u64, uid, gid, pid, padding u32
+const OUT_HEADER_LEN: usize = 16; // fuse_out_header: len u32, error i32, unique u64
+const READ_IN_LEN: usize = 40; // fuse_read_in: fh u64, offset u64, size u32, ...
+const WRITE_IN_LEN: usize = 40; // fuse_write_in: fh u64, offset u64, size u32, ...
+const COMPAT_WRITE_IN_LEN: usize = 24; // fuse_write_in up to protocol minor 8
+const RELEASE_IN_LEN: usize = 24; // fuse_release_in: fh u64, flags u32, release_flags u32, lock_owner u64
+const ENTRY_OUT_LEN: usize = 128; // fuse_entry_out, ahead of fuse_open_out in a CREATE reply
+const COMPAT_ENTRY_OUT_LEN: usize = 120; // fuse_entry_out up to protocol minor 8
+const OPEN_OUT_LEN: usize = 16; // fuse_open_out: fh u64, open_flags u32, backing_id u32
+const FUSE_WRITEBACK_CACHE: u32 = 1 << 16;
+const FUSE_MAX_PAGES: u32 = 1 << 22;
+const FUSE_INIT_EXT: u32 = 1 << 30;
+const FUSE_PASSTHROUGH: u32 = 1 << (37 - 32); // In flags2
+const FOPEN_PASSTHROUGH: u32 = 1 << 7;
+const FUSE_DEV_IOC_BACKING_OPEN: u32 = 0x4010_e501; // _IOW(229, 1, struct fuse_backing_map)
+const FUSE_DEV_IOC_BACKING_CLOSE: u32 = 0x4004_e502; // _IOW(229, 2, uint32_t)
+// Cache files sit on a plain local file system, nothing stacks below them
+const MAX_STACK_DEPTH: u32 = 1;
+// unique of the requests we make of fuser ourselves, the kernel's never get
+// this high
+const OWN_UNIQUE: u64 = 1 << 63;
+
+// The most a pipe may hold without privileges
+const PIPE_SIZE: usize = 1 << 20;
+// The kernel only splices a request into a pipe with room for a write of
+// max_write, so we lower what fuser offers (16M) to this
+const MAX_WRITE: u32 = (PIPE_SIZE / 2) as u32;
+// Biggest reply from fuser we pass on, readdir and xattr replies are far
+// smaller
+const REPLY_MAX: usize = 2 * PIPE_SIZE;
+
+/**
+ * What the device loop needs from the file system to serve READ and WRITE
+ * itself. The data never passes through our memory: it is spliced between
+ * the cache file and /dev/fuse through a pipe, or, for handles passed
+ * through, moved by the kernel without asking us at all.
+ */
+pub(crate) trait DataPath: Send + Sync + 'static {
+    type File: AsRawFd + Send;
+
+    /**
+     * Gets ready for a READ of `size` bytes at `offset` of handle `fh`.
+     * Returns the file to splice them from and how many of them it holds.
+     */
+    fn read_from(&self, ino: u64, fh: u64, offset: u64, size: u32) -> Result<(Self::File, usize), c_int>;
+
+    /**
+     * Gets ready for a WRITE of `len` bytes at `offset` of handle `fh`.
+     * Returns the file to splice them into.
+     */
+    fn write_to(&self, ino: u64, fh: u64, offset: u64, len: usize) -> Result<Self::File, c_int>;
+
+    /**
+     * Books a READ of `len` bytes that was replied to.
+     */
+    fn sent(&self, ino: u64, len: usize, elapsed: Duration);
+
+    /**
+     * Books `len` bytes written at `offset` of handle `fh`.
+     */
+    fn written(&self, ino: u64, fh: u64, offset: u64, len: usize, elapsed: Duration);
+
+    /**
+     * The file the kernel may read and write handle `fh` of `ino` in, just
+     * opened, without sending us READ or WRITE. None if it may not.
+     */
+    fn passthrough(&self, ino: u64, fh: u64) -> Option<Self::File>;
+
+    /**
+     * Books writes to the file of the handles of `ino` passed through,
+     * noticed at a flush or release of `fh`: they went to the file behind
+     * our back, and it went from `was` to `size` bytes.
+     */
+    fn changed(&self, ino: u64, fh: u64, size: u64, was: u64);
+}
+
+fn cvt(rc: c_int) -> io::Result<c_int> {
+    if rc < 0 {
+        Err(io::Error::last_os_error())
+    } else {
+        Ok(rc)
+    }
+}
+
+fn errno() -> c_int {
+    io::Error::last_os_error().raw_os_error().unwrap_or(EIO)
+}
+
+fn u32_at(b: &[u8], at: usize) -> u32 {
+    u32::from_ne_bytes(b[at..at + 4].try_into().unwrap())
+}
+
+fn u64_at(b: &[u8], at: usize) -> u64 {
+    u64::from_ne_bytes(b[at..at + 8].try_into().unwrap())
+}
+
+fn out_header(len: usize, error: c_int, unique: u64) -> [u8; OUT_HEADER_LEN] {
+    let mut h = [0u8; OUT_HEADER_LEN];
+    h[0..4].copy_from_slice(&(len as u32).to_ne_bytes());
+    h[4..8].copy_from_slice(&error.to_ne_bytes());
+    h[8..16].copy_from_slice(&unique.to_ne_bytes());
+    h
+}
+
+// Zero fills the reply of `n` bytes in `buf` up to `len`, returns its length
+fn extend(buf: &mut [u8], n: usize, len: usize) -> usize {
+    if n >= len {
+        return n;
+    }
+    buf[n..len].fill(0);
+    buf[0..4].copy_from_slice(&(len as u32).to_ne_bytes());
+    len
+}
+
+/**
+ * What tells whether a file was written to: with multigrain timestamps a
+ * change after we looked always moves ctime, even within a clock tick.
+ */
+#[derive(Clone, Copy, PartialEq, Default)]
+struct Stamp {
+    dev: u64,
+    ino: u64,
+    size: u64,
+    mtime: (i64, i64),
+    ctime: (i64, i64),
+}
+
+impl Stamp {
+    fn of(fd: RawFd) -> Stamp {
+        let mut st: libc::stat = unsafe { std::mem::zeroed() };
+        if unsafe { libc::fstat(fd, &mut st) } < 0 {
+            return Stamp::default();
+        }
+        Stamp {
+            dev: st.st_dev as u64,
+            ino: st.st_ino as u64,
+            size: st.st_size as u64,
+            mtime: (st.st_mtime as i64, st.st_mtime_nsec as i64),
+            ctime: (st.st_ctime as i64, st.st_ctime_nsec as i64),
+        }
+    }
+
+    fn same_file(&self, other: &Stamp) -> bool {
+        (self.dev, self.ino) == (other.dev, other.ino)
+    }
+}
+
+// struct fuse_backing_map
+#[repr(C)]
+struct BackingMap {
+    fd: i32,
+    flags: u32,
+    padding: u64,
+}
+
+/**
+ * The file the handles of an inode passed through share. The kernel wants
+ * every open of an inode passed through to the same one while any is.
+ */
+struct Backing<T> {
+    id: u32, // Registered with the device
+    handles: usize,
+    file: T,
+    stamp: Stamp, // When we last looked for writes to it
+}
+
+/**
+ * Which open handles the kernel reads and writes itself, and how many it
+ * sends us READ and WRITE for, by inode. It doesn't pass an inode through
+ * while it holds page cache for it under any handle.
+ */
+struct Handles<T> {
+    passed: HashMap<u64, u64>, // fh -> ino
+    backing: HashMap<u64, Backing<T>>,
+    cached: HashMap<u64, usize>,
+}
+
+/**
+ * A pipe requests are spliced into and replies out of, one per reader
+ * thread. Non-blocking, every read from it is of bytes already in it.
+ */
+struct Pipe {
+    r: RawFd,
+    w: RawFd,
+}
+
+impl Pipe {
+    fn new() -> io::Result<Self> {
+        let mut fds = [0; 2];
+        cvt(unsafe { libc::pipe2(fds.as_mut_ptr(), libc::O_CLOEXEC | libc::O_NONBLOCK) })?;
+        let pipe = Pipe { r: fds[0], w: fds[1] };
+        cvt(unsafe { libc::fcntl(pipe.w, libc::F_SETPIPE_SZ, PIPE_SIZE as c_int) })?;
+        Ok(pipe)
+    }
+
+    fn read_exact(&self, buf: &mut [u8]) -> bool {
+        let mut done = 0;
+        while done < buf.len() {
+            let n = unsafe { libc::read(self.r, buf[done..].as_mut_ptr() as *mut libc::c_void, buf.len() - done) };
+            if n <= 0 {
+                return false;
+            }
+            done += n as usize;
+        }
+        true
+    }
+
+    fn write_all(&self, buf: &[u8]) -> bool {
+        let n = unsafe { libc::write(self.w, buf.as_ptr() as *const libc::c_void, buf.len()) };
+        n == buf.len() as isize
+    }
+
+    // Throws away whatever is left of a request or reply
+    fn drain(&self) {
+        let mut buf = [0u8; 4096];
+        while unsafe { libc::read(self.r, buf.as_mut_ptr() as *mut libc::c_void, buf.len()) } > 0 {}
+    }
+}
+
+impl Drop for Pipe {
+    fn drop(&mut self) {
+        unsafe {
+            libc::close(self.r);
+            libc::close(self.w);
+        }
+    }
+}
+
+/**
+ * Our own loop on /dev/fuse in front of fuser's. fuser 0.12 reads every
+ * request into its buffer and writes every reply from one, so READ and
+ * WRITE data is copied through user space twice. We take the /dev/fuse fd
+ * from it and put one end of a socket pair in its place: READ and WRITE are
+ * served here with splice(2), everything else goes over the socket to
+ * fuser, and its replies back to the device.
+ *
+ * fuser's protocol version also predates passthrough, where the kernel does
+ * the reads and writes of a handle in a file we name at open. If the kernel
+ * offers it we agree to it in fuser's INIT reply, and name the cache file in
+ * its OPEN replies when the data is all there.
+ */
+pub(crate) struct DeviceLoop<F: DataPath> {
+    fs: F,
+    dev: RawFd,       // The /dev/fuse fd, ours alone now
+    fuser: RawFd,     // Our end of the socket fuser takes for /dev/fuse
+    splice: bool,     // Serve READ and WRITE here, else fuser does
+    init: AtomicU64,   // unique of the INIT request
+    offered: AtomicU32, // Flags the kernel offered in it
+    offered2: AtomicU32, // and flags2
+    minor: AtomicU32,  // Protocol minor version fuser agreed to
+    want_passthrough: bool,
+    passthrough: AtomicBool, // The kernel agreed to it
+    opens: Mutex<HashMap<u64, (u32, u64)>>, // unique -> opcode and inode of OPEN and CREATE requests
+    handles: Mutex<Handles<F::File>>,
+}
+
+impl<F: DataPath> DeviceLoop<F> {
+    /**
+     * Puts the loop in front of the FUSE session just created, with
+     * `readers` threads taking requests off the device. READ and WRITE are
+     * spliced if `splice`, handles are passed through where they can be if
+     * `passthrough`. Call before the session runs. On error fuser is left to
+     * talk to the device itself.
+     */
+    pub(crate) fn start(fs: F, readers: usize, splice: bool, passthrough: bool) -> io::Result<()> {
+        let fuser_fd = find_fuse_fd().ok_or_else(|| io::Error::from_raw_os_error(ENODEV))?;
+        let pipes = (0..readers.max(1)).map(|_| Pipe::new()).collect::<io::Result<Vec<_>>>()?;
+        let mut pair = [0; 2];
+        cvt(unsafe {
+            libc::socketpair(
+                libc::AF_UNIX,
+                libc::SOCK_SEQPACKET | libc::SOCK_CLOEXEC,
+                0,
+                pair.as_mut_ptr(),
+            )
+        })?;
+        for fd in pair {
+            // Room for the biggest message either way
+            let size = REPLY_MAX as c_int;
+            let opt = &size as *const c_int as *const libc::c_void;
+            let len = std::mem::size_of::<c_int>() as libc::socklen_t;
+            if unsafe { libc::setsockopt(fd, libc::SOL_SOCKET, libc::SO_SNDBUFFORCE, opt, len) } < 0 {
+                unsafe { libc::setsockopt(fd, libc::SOL_SOCKET, libc::SO_SNDBUF, opt, len) };
+            }
+        }
+        let dev = unsafe { libc::fcntl(fuser_fd, libc::F_DUPFD_CLOEXEC, 0) };
+        if dev < 0 || unsafe { libc::dup3(pair[0], fuser_fd, libc::O_CLOEXEC) } < 0 {
+            let err = io::Error::last_os_error();
+            unsafe {
+                libc::close(pair[0]);
+                libc::close(pair[1]);
+                if dev >= 0 {
+                    libc::close(dev);
+                }
+            }
+            return Err(err);
+        }
+        unsafe { libc::close(pair[0]) };
+
+        let device = Arc::new(DeviceLoop {
+            fs,
+            dev,
+            fuser: pair[1],
+            splice,
+            init: AtomicU64::new(0),
+            offered: AtomicU32::new(0),
+            offered2: AtomicU32::new(0),
+            minor: AtomicU32::new(0),
+            want_passthrough: passthrough,
+            passthrough: AtomicBool::new(false),
+            opens: Mutex::new(HashMap::new()),
+            handles: Mutex::new(Handles {
+                passed: HashMap::new(),
+                backing: HashMap::new(),
+                cached: HashMap::new(),
+            }),
+        });
+        for pipe in pipes {
+            let device = device.clone();
+            thread::spawn(move || device.serve(pipe));
+        }
+        thread::spawn(move || device.forward_replies());
+        Ok(())
+    }
+
+    fn serve(&self, pipe: Pipe) {
+        loop {
+            let n = unsafe { libc::splice(self.dev, ptr::null_mut(), pipe.w, ptr::null_mut(), PIPE_SIZE, 0) };
+            if n < 0 {
+                match errno() {
+                    // Interrupted, or the request was gone before we got it
+                    EINTR | ENOENT | libc::EAGAIN => continue,
+                    ENODEV => break, // Unmounted
+                    e => {
+                        eprintln!("Reading /dev/fuse failed: {}", io::Error::from_raw_os_error(e));
+                        break;
+                    }
+                }
+            }
+            let mut header = [0u8; IN_HEADER_LEN];
+            if !pipe.read_exact(&mut header) {
+                pipe.drain();
+                continue;
+            }
+            let len = u32_at(&header, 0) as usize;
+            let opcode = u32_at(&header, 4);
+            let unique = u64_at(&header, 8);
+            let ino = u64_at(&header, 16);
+            let body = len.saturating_sub(IN_HEADER_LEN);
+            match opcode {
+                FUSE_READ if self.splice => self.read(&pipe, unique, ino, body),
+                FUSE_WRITE if self.splice => self.write(&pipe, unique, ino, body),
+                _ => {
+                    let Some(msg) = self.request(&pipe, &header, body) else {
+                        continue;
+                    };
+                    match opcode {
+                        FUSE_INIT if msg.len() >= IN_HEADER_LEN + 16 => {
+                            // fuse_init_in: major, minor, max_readahead, flags,
+                            // flags2 since 7.36
+                            self.offered.store(u32_at(&msg, IN_HEADER_LEN + 12), Ordering::Relaxed);
+                            if msg.len() >= IN_HEADER_LEN + 20 {
+                                self.offered2.store(u32_at(&msg, IN_HEADER_LEN + 16), Ordering::Relaxed);
+                            }
+                            self.init.store(unique, Ordering::Relaxed);
+                        }
+                        FUSE_OPEN | FUSE_CREATE if self.passthrough.load(Ordering::Relaxed) => {
+                            self.opens.lock().unwrap().insert(unique, (opcode, ino));
+                        }
+                        FUSE_FLUSH | FUSE_RELEASE if body >= 8 && self.want_passthrough => {
+                            // Both start with the fh
+                            self.closing(ino, u64_at(&msg, IN_HEADER_LEN), opcode == FUSE_RELEASE);
+                        }
+                        _ => {}
+                    }
+                    self.send(&msg);
+                }
+            }
+        }
+        // fuser reads an empty request and leaves its loop
+        unsafe { libc::shutdown(self.fuser, libc::SHUT_RDWR) };
+    }
+
+    fn send(&self, msg: &[u8]) {
+        unsafe { libc::send(self.fuser, msg.as_ptr() as *const libc::c_void, msg.len(), 0) };
+    }
+
+    // The rest of a request for fuser, after its header
+    fn request(&self, pipe: &Pipe, header: &[u8], body: usize) -> Option<Vec<u8>> {
+        let mut msg = Vec::with_capacity(IN_HEADER_LEN + body);
+        msg.extend_from_slice(header);
+        msg.resize(IN_HEADER_LEN + body, 0);
+        if !pipe.read_exact(&mut msg[IN_HEADER_LEN..]) {
+            pipe.drain();
+            return None;
+        }
+        Some(msg)
+    }
+
+    /**
+     * Passes fuser's replies, and notifications written through its fd, on
+     * to the device.
+     */
+    fn forward_replies(&self) {
+        let mut buf = vec![0u8; REPLY_MAX];
+        loop {
+            let n = unsafe { libc::recv(self.fuser, buf.as_mut_ptr() as *mut libc::c_void, buf.len(), 0) };
+            if n < 0 && errno() == EINTR {
+                continue;
+            }
+            if n < OUT_HEADER_LEN as isize {
+                break; // fuser is gone
+            }
+            let mut n = n as usize;
+            let unique = u64_at(&buf, 8);
+            if unique == OWN_UNIQUE {
+                continue; // Nobody waits for it
+            }
+            if unique != 0 && unique == self.init.load(Ordering::Relaxed) {
+                n = self.init_reply(&mut buf, n);
+            }
+            let open = self.opens.lock().unwrap().remove(&unique);
+            let mut opened = None;
+            if let Some((opcode, ino)) = open.filter(|_| u32_at(&buf, 4) == 0) {
+                match self.open_reply(opcode, ino, &mut buf[..n]) {
+                    Ok(handle) => opened = Some(handle),
+                    Err(e) => {
+                        n = OUT_HEADER_LEN;
+                        buf[..n].copy_from_slice(&out_header(n, -e, unique));
+                    }
+                }
+            }
+            match self.write_reply(&buf[..n]) {
+                Err(ENODEV) => break,
+                // The open was interrupted, no release will come for it
+                Err(ENOENT) => {
+                    if let Some((ino, fh)) = opened {
+                        self.closing(ino, fh, true);
+                    }
+                }
+                _ => {}
+            }
+        }
+    }
+
+    /**
+     * Takes note of the protocol version fuser agreed to in its INIT reply,
+     * the first `n` bytes of `buf`, and makes requests as big as our pipes
+     * hold: max_write capped to fit, and max_pages, which fuser's protocol
+     * version doesn't know about, raised to match. Agrees to passthrough if
+     * the kernel offered it. Returns the new length.
+     */
+    fn init_reply(&self, buf: &mut [u8], n: usize) -> usize {
+        // fuse_init_out: major, minor, max_readahead, flags, max_background
+        // and congestion_threshold u16, max_write, time_gran, max_pages u16,
+        // map_alignment u16, flags2, max_stack_depth
+        if n < OUT_HEADER_LEN + 24 {
+            return n; // An error
+        }
+        let mut n = n;
+        let out = &mut buf[OUT_HEADER_LEN..];
+        self.minor.store(u32_at(out, 4), Ordering::Relaxed);
+        let offered = self.offered.load(Ordering::Relaxed);
+        let mut flags = u32_at(out, 12);
+        let max_write = u32_at(out, 20).min(MAX_WRITE);
+        out[20..24].copy_from_slice(&max_write.to_ne_bytes());
+        if offered & FUSE_MAX_PAGES != 0 {
+            n = extend(buf, n, OUT_HEADER_LEN + 32);
+            let page = unsafe { libc::sysconf(libc::_SC_PAGESIZE) } as u32;
+            buf[OUT_HEADER_LEN + 28..OUT_HEADER_LEN + 30].copy_from_slice(&((max_write / page) as u16).to_ne_bytes());
+            flags |= FUSE_MAX_PAGES;
+        }
+        let offered2 = self.offered2.load(Ordering::Relaxed);
+        if self.want_passthrough && offered & FUSE_INIT_EXT != 0 && offered2 & FUSE_PASSTHROUGH != 0 {
+            n = extend(buf, n, OUT_HEADER_LEN + 40);
+            let out = &mut buf[OUT_HEADER_LEN..];
+            let flags2 = u32_at(out, 32) | FUSE_PASSTHROUGH;
+            out[32..36].copy_from_slice(&flags2.to_ne_bytes());
+            out[36..40].copy_from_slice(&MAX_STACK_DEPTH.to_ne_bytes());
+            // The kernel won't pass through under a writeback cache
+            flags = (flags | FUSE_INIT_EXT) & !FUSE_WRITEBACK_CACHE;
+            self.passthrough.store(true, Ordering::Relaxed);
+        }
+        buf[OUT_HEADER_LEN + 12..OUT_HEADER_LEN + 16].copy_from_slice(&flags.to_ne_bytes());
+        n
+    }
+
+    /**
+     * Passes a handle fuser just opened through to its file if it may be,
+     * by setting its backing file in the reply, `out`. Returns the inode and
+     * the handle, or the error to reply with instead.
+     */
+    fn open_reply(&self, opcode: u32, ino: u64, out: &mut [u8]) -> Result<(u64, u64), c_int> {
+        let out = &mut out[OUT_HEADER_LEN..];
+        // A CREATE reply has the new entry, nodeid first, ahead of the open
+        let at = match opcode {
+            FUSE_CREATE if self.minor.load(Ordering::Relaxed) < 9 => COMPAT_ENTRY_OUT_LEN,
+            FUSE_CREATE => ENTRY_OUT_LEN,
+            _ => 0,
+        };
+        if out.len() < at + OPEN_OUT_LEN {
+            return Err(EIO); // Not from fuser
+        }
+        let ino = if opcode == FUSE_CREATE { u64_at(out, 0) } else { ino };
+        let fh = u64_at(out, at);
+
+        let mut handles = self.handles.lock().unwrap();
+        let backing_id = if let Some(backing) = handles.backing.get_mut(&ino) {
+            // Other handles are passed through, so this one must be too, to
+            // the same file. If a refetch replaced the cache file since they
+            // were opened, this handle would read stale data and its writes
+            // would never be uploaded: refuse it until they're closed
+            let same = self.fs.passthrough(ino, fh).is_some_and(|file| {
+                Stamp::of(file.as_raw_fd()).same_file(&Stamp::of(backing.file.as_raw_fd()))
+            });
+            if !same {
+                drop(handles);
+                self.release(ino, fh);
+                return Err(EBUSY);
+            }
+            backing.handles += 1;
+            Some(backing.id)
+        } else if handles.cached.contains_key(&ino) {
+            None
+        } else {
+            self.fs.passthrough(ino, fh).and_then(|file| {
+                let id = self.register(&file)?;
+                let stamp = Stamp::of(file.as_raw_fd());
+                handles.backing.insert(ino, Backing { id, handles: 1, file, stamp });
+                Some(id)
+            })
+        };
+        match backing_id {
+            Some(id) => {
+                // fuse_open_out: fh, open_flags, backing_id
+                let open_flags = u32_at(out, at + 8) | FOPEN_PASSTHROUGH;
+                out[at + 8..at + 12].copy_from_slice(&open_flags.to_ne_bytes());
+                out[at + 12..at + 16].copy_from_slice(&id.to_ne_bytes());
+                handles.passed.insert(fh, ino);
+            }
+            None => *handles.cached.entry(ino).or_default() += 1,
+        }
+        Ok((ino, fh))
+    }
+
+    /**
+     * Registers `file` with the device for handles to be passed through to,
+     * None if the kernel won't. A kernel refusing for good turns passthrough
+     * off, so later opens don't try again.
+     */
+    fn register(&self, file: &F::File) -> Option<u32> {
+        let map = BackingMap { fd: file.as_raw_fd(), flags: 0, padding: 0 };
+        let id = unsafe { libc::ioctl(self.dev, FUSE_DEV_IOC_BACKING_OPEN as _, &map) };
+        if id > 0 {
+            return Some(id as u32);
+        }
+        let e = errno();
+        if matches!(e, libc::EPERM | libc::EOPNOTSUPP | libc::ENOTTY) {
+            eprintln!("Kernel refused a backing file, no passthrough: {}", io::Error::from_raw_os_error(e));
+            self.passthrough.store(false, Ordering::Relaxed);
+        }
+        None
+    }
+
+    /**
+     * Looks for writes through the handles of `ino` passed through at a
+     * flush or release of `fh`, and forgets `fh` if it is released.
+     */
+    fn closing(&self, ino: u64, fh: u64, released: bool) {
+        let mut handles = self.handles.lock().unwrap();
+        let Some(&ino) = handles.passed.get(&fh) else {
+            if released {
+                if let Some(n) = handles.cached.get_mut(&ino) {
+                    *n -= 1;
+                    if *n == 0 {
+                        handles.cached.remove(&ino);
+                    }
+                }
+            }
+            return;
+        };
+        if released {
+            handles.passed.remove(&fh);
+        }
+        let Some(backing) = handles.backing.get_mut(&ino) else {
+            return;
+        };
+        let stamp = Stamp::of(backing.file.as_raw_fd());
+        if stamp != backing.stamp {
+            self.fs.changed(ino, fh, stamp.size, backing.stamp.size);
+            backing.stamp = stamp;
+        }
+        if !released {
+            return;
+        }
+        backing.handles -= 1;
+        if backing.handles == 0 {
+            // The kernel holds on to the file for as long as it needs it
+            unsafe { libc::ioctl(self.dev, FUSE_DEV_IOC_BACKING_CLOSE as _, &backing.id) };
+            handles.backing.remove(&ino);
+        }
+    }
+
+    // Has fuser release handle `fh` of `ino`, which the kernel won't
+    fn release(&self, ino: u64, fh: u64) {
+        let len = IN_HEADER_LEN + RELEASE_IN_LEN;
+        let mut msg = vec![0u8; len];
+        msg[0..4].copy_from_slice(&(len as u32).to_ne_bytes());
+        msg[4..8].copy_from_slice(&FUSE_RELEASE.to_ne_bytes());
+        msg[8..16].copy_from_slice(&OWN_UNIQUE.to_ne_bytes());
+        msg[16..24].copy_from_slice(&ino.to_ne_bytes());
+        msg[IN_HEADER_LEN..IN_HEADER_LEN + 8].copy_from_slice(&fh.to_ne_bytes());
+        self.send(&msg);
+    }
+
+    fn write_reply(&self, msg: &[u8]) -> Result<(), c_int> {
+        let rc = unsafe { libc::write(self.dev, msg.as_ptr() as *const libc::c_void, msg.len()) };
+        if rc < 0 { Err(errno()) } else { Ok(()) }
+    }
+
+    // Whether the device is still there
+    fn reply(&self, msg: &[u8]) -> bool {
+        // ENOENT: the request was interrupted and is gone
+        self.write_reply(msg) != Err(ENODEV)
+    }
+
+    fn reply_error(&self, unique: u64, errno: c_int) {
+        self.reply(&out_header(OUT_HEADER_LEN, -errno, unique));
+    }
+
+    fn read(&self, pipe: &Pipe, unique: u64, ino: u64, body: usize) {
+        let mut arg = [0u8; READ_IN_LEN];
+        let arg_len = body.min(READ_IN_LEN);
+        if !pipe.read_exact(&mut arg[..arg_len]) || arg_len < 20 {
+            pipe.drain();
+            self.reply_error(unique, EIO);
+            return;
+        }
+        let (fh, offset, size) = (u64_at(&arg, 0), u64_at(&arg, 8), u32_at(&arg, 16));
+        let start = Instant::now();
+        let (file, len) = match self.fs.read_from(ino, fh, offset, size) {
+            Ok(source) => source,
+            Err(e) => {
+                self.reply_error(unique, e);
+                return;
+            }
+        };
+        if len == 0 {
+            self.reply(&out_header(OUT_HEADER_LEN, 0, unique));
+            self.fs.sent(ino, 0, start.elapsed());
+            return;
+        }
+
+        // The header, then the pages of the cache file behind it
+        pipe.write_all(&out_header(OUT_HEADER_LEN + len, 0, unique));
+        let mut off = offset as i64;
+        let mut moved = 0;
+        while moved < len {
+            let n = unsafe { libc::splice(file.as_raw_fd(), &mut off, pipe.w, ptr::null_mut(), len - moved, 0) };
+            if n <= 0 {
+                break;
+            }
+            moved += n as usize;
+        }
+        if moved < len {
+            // The file got shorter than the header says, send what it has
+            pipe.drain();
+            let mut data = vec![0u8; len];
+            let n = unsafe {
+                libc::pread(file.as_raw_fd(), data.as_mut_ptr() as *mut libc::c_void, len, offset as i64)
+            };
+            if n < 0 {
+                self.reply_error(unique, EIO);
+                return;
+            }
+            let mut msg = out_header(OUT_HEADER_LEN + n as usize, 0, unique).to_vec();
+            msg.extend_from_slice(&data[..n as usize]);
+            self.reply(&msg);
+            self.fs.sent(ino, n as usize, start.elapsed());
+            return;
+        }
+        let total = OUT_HEADER_LEN + len;
+        let n = unsafe { libc::splice(pipe.r, ptr::null_mut(), self.dev, ptr::null_mut(), total, libc::SPLICE_F_MOVE) };
+        if n != total as isize {
+            pipe.drain();
+        }
+        self.fs.sent(ino, len, start.elapsed());
+    }
+
+    fn write(&self, pipe: &Pipe, unique: u64, ino: u64, body: usize) {
+        let arg_len = if self.minor.load(Ordering::Relaxed) < 9 {
+            COMPAT_WRITE_IN_LEN
+        } else {
+            WRITE_IN_LEN
+        };
+        let mut arg = [0u8; WRITE_IN_LEN];
+        if body < arg_len || !pipe.read_exact(&mut arg[..arg_len]) {
+            pipe.drain();
+            self.reply_error(unique, EIO);
+            return;
+        }
+        let (fh, offset) = (u64_at(&arg, 0), u64_at(&arg, 8));
+        let len = body - arg_len;
+        let start = Instant::now();
+        let file = match self.fs.write_to(ino, fh, offset, len) {
+            Ok(file) => file,
+            Err(e) => {
+                pipe.drain();
+                self.reply_error(unique, e);
+                return;
+            }
+        };
+
+        // Straight from the pipe into the cache file's page cache
+        let mut off = offset as i64;
+        let mut moved = 0;
+        while moved < len {
+            let n = unsafe { libc::splice(pipe.r, ptr::null_mut(), file.as_raw_fd(), &mut off, len - moved, libc::SPLICE_F_MOVE) };
+            if n <= 0 {
+                break;
+            }
+            moved += n as usize;
+        }
+        pipe.drain();
+        if moved > 0 {
+            self.fs.written(ino, fh, offset, moved, start.elapsed());
+        }
+        if moved == 0 && len > 0 {
+            self.reply_error(unique, EIO);
+            return;
+        }
+        // fuse_write_out: size u32, padding u32
+        let mut msg = out_header(OUT_HEADER_LEN + 8, 0, unique).to_vec();
+        msg.extend_from_slice(&(moved as u32).to_ne_bytes());
+        msg.extend_from_slice(&0u32.to_ne_bytes());
+        self.reply(&msg);
+    }
+}
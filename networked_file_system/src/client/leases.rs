@@ -0,0 +1,478 @@
+use crate::{file_attr, remote_attr_from_stat, CachedAttr, Lease, State, TULFS};
+use crate::server_conn::ServerConn;
+
+use networked_file_system::protocol::{LeaseKind, Message, RemoteAttr, LEASE_TERM};
+
+use libc::{EAGAIN, EIO, ENOENT, ESTALE};
+
+use std::{
+    ffi::OsString,
+    fs::{File, OpenOptions},
+    path::{Path, PathBuf},
+    sync::{
+        mpsc::{Receiver, RecvTimeoutError},
+        Mutex,
+    },
+    time::{Duration, Instant},
+};
+
+// We consider a lease expired this long before the server does, to absorb
+// delays on our side between checking a lease and acting on it
+const LEASE_MARGIN: Duration = Duration::from_secs(1);
+// Leases not used for this long are given back instead of renewed
+const LEASE_IDLE: Duration = Duration::from_secs(30);
+// Closed files held under a write lease are uploaded once idle this long
+const WRITE_BEHIND: Duration = Duration::from_secs(3);
+
+pub const LEASE_RETRIES: u32 = 20;
+const LEASE_RETRY_DELAY: Duration = Duration::from_millis(50);
+
+impl State {
+    /**
+     * Records a lease granted on `ino` for a request sent at `sent`, along
+     * with the attributes that came with it. If the file is not the version
+     * we have cached it changed while we held no lease, so the cached copy
+     * goes.
+     */
+    fn record_lease(
+        &mut self,
+        ino: u64,
+        kind: LeaseKind,
+        sent: Instant,
+        attr: RemoteAttr,
+        cache_dir: &Path,
+    ) {
+        let stale = self
+            .attrs
+            .get(&ino)
+            .and_then(|cached| cached.version)
+            .is_some_and(|version| !version.same_version(&attr));
+        if stale && !self.is_dirty(ino) {
+            self.drop_cached(ino, cache_dir);
+        }
+        let now = Instant::now();
+        self.leases.insert(
+            ino,
+            Lease {
+                kind,
+                expires: sent + LEASE_TERM - LEASE_MARGIN,
+                last_used: now,
+            },
+        );
+        self.attrs.insert(
+            ino,
+            CachedAttr {
+                attr: file_attr(&attr, ino),
+                version: Some(attr),
+                callback: false,
+                fetched: now,
+            },
+        );
+    }
+}
+
+impl TULFS {
+    pub(crate) fn cache_dir(&self) -> PathBuf {
+        self.get_local_abs_path(Path::new(""))
+    }
+
+    /**
+     * Returns the server connection if we are running with leases and the
+     * server is still there.
+     */
+    pub(crate) fn lease_server(&self) -> Option<&ServerConn> {
+        let server = self.server.as_deref()?;
+        if self.config.leases && self.st.lock().unwrap().server_up {
+            Some(server)
+        } else {
+            None
+        }
+    }
+
+    /**
+     * Acquires or renews a lease of `kind` on `ino`, retrying up to `retries`
+     * times while the server recalls a conflicting lease from another client.
+     * Returns the current attributes whether or not the lease was granted.
+     */
+    pub(crate) fn acquire_lease(
+        &self,
+        server: &ServerConn,
+        ino: u64,
+        remote_path: &Path,
+        kind: LeaseKind,
+        retries: u32,
+    ) -> Result<RemoteAttr, libc::c_int> {
+        let mut attempt = 0;
+        loop {
+            let sent = Instant::now();
+            let requests = vec![(remote_path.to_path_buf(), kind)];
+            let grant = match server.call(Message::Lease { requests })? {
+                Message::Leases(mut grants) if grants.len() == 1 => grants.pop().unwrap(),
+                _ => return Err(EIO),
+            };
+            let Some(attr) = grant.attr else {
+                return Err(ENOENT);
+            };
+            if let Some(granted) = grant.kind {
+                self.st
+                    .lock()
+                    .unwrap()
+                    .record_lease(ino, granted, sent, attr, &self.cache_dir());
+                return Ok(attr);
+            }
+            if attempt >= retries {
+                return Ok(attr);
+            }
+            attempt += 1;
+            std::thread::sleep(LEASE_RETRY_DELAY);
+        }
+    }
+
+    /**
+     * Tries once for a write lease on `ino`. Without one, writes go through
+     * to the server on flush as usual.
+     */
+    pub(crate) fn try_write_lease(&self, ino: u64) {
+        let Some(server) = self.lease_server() else {
+            return;
+        };
+        let Some(path) = self.path_for_inode(ino) else {
+            return;
+        };
+        let remote_path = self.get_remote_abs_path(path.strip_prefix("/").unwrap_or(&path));
+        let _ = self.acquire_lease(server, ino, &remote_path, LeaseKind::Write, 0);
+    }
+
+    /**
+     * Takes a lease of `kind` on `ino` ahead of a change we make to the
+     * remote file in place, not by uploading: other clients give up their
+     * copies and their deferred writes first. Err(EAGAIN) if it wasn't
+     * granted. Without leases, or without the server, there's nothing to
+     * take and the change goes ahead as any other would.
+     */
+    pub(crate) fn lease_for_change(&self, ino: u64, kind: LeaseKind) -> Result<(), libc::c_int> {
+        let Some(server) = self.lease_server() else {
+            return Ok(());
+        };
+        let held = |st: &mut State| match kind {
+            LeaseKind::Write => st.holds_write_lease(ino),
+            LeaseKind::Read => st.lease_valid(ino),
+        };
+        if held(&mut self.st.lock().unwrap()) {
+            return Ok(());
+        }
+        let path = self.path_for_inode(ino).ok_or(ENOENT)?;
+        let remote_path = self.get_remote_abs_path(path.strip_prefix("/").unwrap_or(&path));
+        self.acquire_lease(server, ino, &remote_path, kind, LEASE_RETRIES)?;
+        match held(&mut self.st.lock().unwrap()) {
+            true => Ok(()),
+            false => Err(EAGAIN),
+        }
+    }
+
+    /**
+     * Our own upload changed the file's version. Renew the lease to learn the
+     * new version while keeping the data we just uploaded as the cached copy.
+     */
+    pub(crate) fn relock_after_upload(
+        &self,
+        server: &ServerConn,
+        ino: u64,
+        remote_path: &Path,
+    ) -> bool {
+        let kind = {
+            let st = self.st.lock().unwrap();
+            st.leases.get(&ino).map(|l| l.kind).unwrap_or(LeaseKind::Read)
+        };
+        let sent = Instant::now();
+        let requests = vec![(remote_path.to_path_buf(), kind)];
+        let Ok(Message::Leases(grants)) = server.call(Message::Lease { requests }) else {
+            return false;
+        };
+        let Some(grant) = grants.first() else {
+            return false;
+        };
+        let (Some(kind), Some(attr)) = (grant.kind, grant.attr) else {
+            return false;
+        };
+        let mut st = self.st.lock().unwrap();
+        // Forget the old version first so record_lease doesn't treat our own
+        // upload as a remote change
+        st.attrs.remove(&ino);
+        st.record_lease(ino, kind, sent, attr, &self.cache_dir());
+        st.valid_data.insert(ino);
+        true
+    }
+
+    /**
+     * Uploads the local cache file of `ino` and marks every handle on it
+     * clean. On failure the data is queued again as deferred.
+     */
+    pub(crate) fn upload_inode(&self, ino: u64) -> Result<PathBuf, libc::c_int> {
+        let _transfer = self.begin_transfer(ino);
+        let path = {
+            let mut st = self.st.lock().unwrap();
+            // Clear dirty state before reading, writes racing with the upload
+            // mark the file dirty again
+            st.deferred.remove(&ino);
+            if let Some(cached) = st.inodes.cached(ino) {
+                cached.take_dirty();
+            }
+            st.inodes.path(ino)
+        };
+        let Some(path) = path else {
+            return Err(ENOENT);
+        };
+        let remote_path = self.get_remote_abs_path(&path);
+        let local_path = self.get_local_abs_path(&path);
+        let res = OpenOptions::new()
+            .read(true)
+            .open(&local_path)
+            .map_err(|_| EIO)
+            .and_then(|f| self.copy_from_local_to_remote(f, &remote_path));
+        if let Err(e) = res {
+            self.st.lock().unwrap().deferred.insert(ino, Instant::now());
+            return Err(e);
+        }
+        Ok(remote_path)
+    }
+
+    /**
+     * Makes sure the deferred writes of `ino` may still overwrite
+     * `remote_path`: we hold its write lease, or take it again and find the
+     * file still the version we last saw. With the server gone, the file
+     * must at least look unchanged over SFTP. Err(EAGAIN) while another
+     * client holds the lease, Err(ESTALE) if someone else changed the file.
+     */
+    fn recheck_write_lease(&self, ino: u64, remote_path: &Path) -> Result<(), libc::c_int> {
+        let version = {
+            let mut st = self.st.lock().unwrap();
+            if st.holds_write_lease(ino) {
+                return Ok(());
+            }
+            st.attrs.get(&ino).and_then(|cached| cached.version)
+        };
+        // Without the version our writes started from there's nothing to compare
+        let Some(version) = version else {
+            return Err(ESTALE);
+        };
+        let Some(server) = self.lease_server() else {
+            let sftp = self.sftp();
+            let stat = sftp.check(sftp.stat(remote_path)).map_err(|_| ESTALE)?;
+            // SFTP has mtime in seconds only
+            let now = remote_attr_from_stat(&stat);
+            return match now.size == version.size && now.mtime == version.mtime {
+                true => Ok(()),
+                false => Err(ESTALE),
+            };
+        };
+        let attr = match self.acquire_lease(server, ino, remote_path, LeaseKind::Write, LEASE_RETRIES) {
+            Ok(attr) => attr,
+            Err(ENOENT) => return Err(ESTALE),
+            Err(e) => return Err(e),
+        };
+        if !attr.same_version(&version) {
+            return Err(ESTALE);
+        }
+        match self.st.lock().unwrap().holds_write_lease(ino) {
+            true => Ok(()),
+            false => Err(EAGAIN),
+        }
+    }
+
+    /**
+     * Uploads the deferred writes of `ino` once recheck_write_lease() allows
+     * it. Writes that would overwrite someone else's go next to the file as
+     * `<name>.conflict` instead, and our copy is dropped for theirs.
+     */
+    fn upload_leased(&self, ino: u64) -> Result<PathBuf, libc::c_int> {
+        let Some(path) = self.st.lock().unwrap().inodes.path(ino) else {
+            return Err(ENOENT);
+        };
+        let remote_path = self.get_remote_abs_path(&path);
+        match self.recheck_write_lease(ino, &remote_path) {
+            Ok(()) => return self.upload_inode(ino),
+            Err(ESTALE) => {}
+            Err(e) => return Err(e), // Still deferred, try again later
+        }
+        let mut name = OsString::from(remote_path.file_name().unwrap_or_default());
+        name.push(".conflict");
+        let conflict_path = remote_path.with_file_name(name);
+        eprintln!(
+            "Inode {} changed on the server while its writes were deferred, keeping them as {:?}",
+            ino, conflict_path
+        );
+        let res = File::open(self.get_local_abs_path(&path))
+            .map_err(|_| EIO)
+            .and_then(|f| self.copy_from_local_to_remote(f, &conflict_path));
+        if let Err(e) = res {
+            // Keep them deferred rather than lose them
+            eprintln!("Could not save conflicting writes of inode {}: {}", ino, e);
+            return Err(e);
+        }
+        let mut st = self.st.lock().unwrap();
+        st.deferred.remove(&ino);
+        if let Some(cached) = st.inodes.cached(ino) {
+            cached.take_dirty();
+        }
+        st.drop_cached(ino, &self.cache_dir());
+        Err(ESTALE)
+    }
+
+    /**
+     * Uploads files whose last handle was closed under a write lease, all of
+     * them if `all`, otherwise only those that have been idle for a while.
+     * The lease may have lapsed since, so it is checked again first.
+     */
+    pub(crate) fn upload_deferred(&self, all: bool) {
+        let due: Vec<u64> = {
+            let st = self.st.lock().unwrap();
+            st.deferred
+                .iter()
+                .filter(|(_, released)| all || released.elapsed() >= WRITE_BEHIND)
+                .map(|(&ino, _)| ino)
+                .collect()
+        };
+        // Upload several at once so the transfer lanes can put small files
+        // ahead of big ones
+        let uploaders = self.config.lanes.min(due.len());
+        let due = Mutex::new(due);
+        std::thread::scope(|s| {
+            for _ in 0..uploaders {
+                s.spawn(|| loop {
+                    let Some(ino) = due.lock().unwrap().pop() else {
+                        return;
+                    };
+                    match self.upload_leased(ino) {
+                        Ok(remote_path) => {
+                            self.after_upload(ino, &remote_path);
+                            // Clean now, the cache file stays under the usual budget
+                            let mut st = self.st.lock().unwrap();
+                            if st.valid_data.contains(&ino) && !st.is_open(ino) && !st.is_dirty(ino) {
+                                st.keep_closed(ino, &self.cache_dir(), &self.stats, &[]);
+                            }
+                        }
+                        Err(ESTALE) => {}
+                        Err(e) => eprintln!("Failed to upload deferred writes of inode {}: {}", ino, e),
+                    }
+                });
+            }
+        });
+    }
+
+    /**
+     * Hands a lease back to the server, uploading dirty data first. A lease
+     * that couldn't be renewed may be someone else's by now, so that goes
+     * through the same check as write-behind.
+     */
+    fn give_up_lease(&self, ino: u64) {
+        let mut keep = false;
+        if self.st.lock().unwrap().is_dirty(ino) {
+            match self.upload_leased(ino) {
+                Ok(_) | Err(ESTALE) => {}
+                Err(e) => {
+                    // Left deferred, the cache file is all there is of them
+                    eprintln!("Failed to upload inode {} on recall: {}", ino, e);
+                    keep = true;
+                }
+            }
+        }
+        let path = {
+            let mut st = self.st.lock().unwrap();
+            st.leases.remove(&ino);
+            if !keep {
+                st.drop_cached(ino, &self.cache_dir());
+            }
+            st.inodes.path(ino)
+        };
+        if let (Some(server), Some(path)) = (self.lease_server(), path) {
+            let paths = vec![self.get_remote_abs_path(&path)];
+            server.notify(Message::Unlease { paths });
+        }
+    }
+
+    /**
+     * Renews, in one request, every lease that is in use and halfway to
+     * expiring, and gives back the ones nobody has used for a while.
+     */
+    fn renew_leases(&self, server: &ServerConn) {
+        let now = Instant::now();
+        let mut renew = Vec::new();
+        let mut idle = Vec::new();
+        {
+            let st = self.st.lock().unwrap();
+            for (&ino, lease) in &st.leases {
+                let Some(path) = st.inodes.path(ino) else {
+                    continue;
+                };
+                let remote_path = self.get_remote_abs_path(&path);
+                if lease.last_used.elapsed() > LEASE_IDLE && !st.is_open(ino) && !st.is_dirty(ino) {
+                    idle.push((ino, remote_path));
+                } else if lease.expires.saturating_duration_since(now) < LEASE_TERM / 2 {
+                    renew.push((ino, remote_path, lease.kind));
+                }
+            }
+        }
+
+        if !idle.is_empty() {
+            let mut st = self.st.lock().unwrap();
+            for (ino, _) in &idle {
+                st.leases.remove(ino);
+                st.drop_cached(*ino, &self.cache_dir());
+            }
+            drop(st);
+            let paths = idle.into_iter().map(|(_, p)| p).collect();
+            server.notify(Message::Unlease { paths });
+        }
+
+        if renew.is_empty() {
+            return;
+        }
+        let sent = Instant::now();
+        let requests = renew.iter().map(|(_, p, kind)| (p.clone(), *kind)).collect();
+        let grants = match server.call(Message::Lease { requests }) {
+            Ok(Message::Leases(grants)) if grants.len() == renew.len() => grants,
+            _ => return, // Try again next round, the leases are still good for a while
+        };
+        let mut lost = Vec::new();
+        {
+            let mut st = self.st.lock().unwrap();
+            for ((ino, _, _), grant) in renew.iter().zip(grants) {
+                match (grant.kind, grant.attr) {
+                    (Some(kind), Some(attr)) => {
+                        st.record_lease(*ino, kind, sent, attr, &self.cache_dir())
+                    }
+                    _ => lost.push(*ino),
+                }
+            }
+        }
+        for ino in lost {
+            self.give_up_lease(ino);
+        }
+    }
+
+    /**
+     * Background thread in lease mode: handles recalls from the server,
+     * writes back deferred files and renews leases in bulk.
+     */
+    pub(crate) fn lease_loop(&self, recalls: Receiver<u64>) {
+        let tick = LEASE_TERM / 4;
+        loop {
+            let mut recalled = Vec::new();
+            match recalls.recv_timeout(tick) {
+                Ok(ino) => recalled.push(ino),
+                Err(RecvTimeoutError::Timeout) => {}
+                // Server is gone; deferred writes still need to go out
+                Err(RecvTimeoutError::Disconnected) => std::thread::sleep(tick),
+            }
+            recalled.extend(recalls.try_iter());
+            for ino in recalled {
+                self.give_up_lease(ino);
+            }
+            self.upload_deferred(false);
+            if let Some(server) = self.lease_server() {
+                self.renew_leases(server);
+            }
+        }
+    }
+}
@@ -0,0 +1,359 @@
+use crate::cached::CachedInode;
+use crate::stats::Stats;
+use crate::TULFS;
+
+use std::{
+    collections::{BTreeMap, HashMap, HashSet, VecDeque},
+    os::unix::fs::FileExt,
+    sync::{Arc, Mutex},
+};
+
+// Files are held in blocks of this size, a small file is one short block
+pub(crate) const BLOCK: u64 = 64 << 10;
+// Files up to this size are taken in whole on their first read. Blocks of
+// bigger ones only once read twice, so a scan through a big file passes by
+const SMALL_FILE: u64 = 256 << 10;
+// Share of the budget for blocks hit again after they came in
+const PROTECTED_PCT: u64 = 80;
+
+type Key = (u64, u64); // Inode, block index
+
+struct Block {
+    data: Arc<[u8]>,
+    generation: u64,
+    protected: bool,
+    tick: u64, // Position in its segment's LRU order
+}
+
+#[derive(Default)]
+struct Inner {
+    generations: HashMap<u64, u64>, // Of each inode's cache file, see generation()
+    next_generation: u64,
+    // Changes made to each inode's cache file, see changes()
+    changes: HashMap<u64, u64>,
+    blocks: HashMap<Key, Block>,
+    // Least recently used first
+    probation: BTreeMap<u64, Key>,
+    protected: BTreeMap<u64, Key>,
+    probation_bytes: u64,
+    protected_bytes: u64,
+    tick: u64,
+    // Blocks of big files read once recently, admitted if read again
+    ghosts: HashSet<Key>,
+    ghost_order: VecDeque<Key>,
+}
+
+impl Inner {
+    fn next_tick(&mut self) -> u64 {
+        self.tick += 1;
+        self.tick
+    }
+
+    fn unlink(&mut self, key: &Key) -> Option<Block> {
+        let block = self.blocks.remove(key)?;
+        let len = block.data.len() as u64;
+        if block.protected {
+            self.protected.remove(&block.tick);
+            self.protected_bytes -= len;
+        } else {
+            self.probation.remove(&block.tick);
+            self.probation_bytes -= len;
+        }
+        Some(block)
+    }
+
+    fn link(&mut self, key: Key, mut block: Block) {
+        block.tick = self.next_tick();
+        let len = block.data.len() as u64;
+        if block.protected {
+            self.protected.insert(block.tick, key);
+            self.protected_bytes += len;
+        } else {
+            self.probation.insert(block.tick, key);
+            self.probation_bytes += len;
+        }
+        self.blocks.insert(key, block);
+    }
+
+    fn remember_ghost(&mut self, key: Key, max: usize) {
+        if self.ghosts.insert(key) {
+            self.ghost_order.push_back(key);
+        }
+        while self.ghost_order.len() > max {
+            if let Some(old) = self.ghost_order.pop_front() {
+                self.ghosts.remove(&old);
+            }
+        }
+    }
+}
+
+/**
+ * Bounded in-memory copy of hot cache file data, in front of the cache
+ * files. Segmented LRU: blocks come in on probation and move to the
+ * protected segment when hit again; protected blocks pushed out go back on
+ * probation, and eviction takes the least recent probation block. Blocks
+ * read once and never again, like a scan, so only ever churn probation.
+ * Writes go to the cache file as before and update the blocks held here.
+ */
+pub(crate) struct MemTier {
+    budget: u64,
+    inner: Mutex<Inner>,
+    stats: Arc<Stats>,
+}
+
+impl MemTier {
+    pub(crate) fn new(budget: u64, stats: Arc<Stats>) -> Self {
+        MemTier {
+            budget,
+            inner: Mutex::new(Inner::default()),
+            stats,
+        }
+    }
+
+    /**
+     * The generation blocks of `ino` are cached under. A cache file that was
+     * `fresh`ly fetched starts a new one and drops what we held of the old
+     * contents; reads of handles still on the old file are then never taken
+     * in again.
+     */
+    pub(crate) fn generation(&self, ino: u64, fresh: bool) -> u64 {
+        let mut inner = self.inner.lock().unwrap();
+        if let Some(&generation) = inner.generations.get(&ino) {
+            if !fresh {
+                return generation;
+            }
+            let stale: Vec<Key> = inner.blocks.keys().filter(|k| k.0 == ino).copied().collect();
+            for key in stale {
+                inner.unlink(&key);
+            }
+        }
+        inner.next_generation += 1;
+        let generation = inner.next_generation;
+        inner.generations.insert(ino, generation);
+        generation
+    }
+
+    /**
+     * Drops all we know of `ino`, whose cache file was deleted. The next
+     * open fetches it again and starts a new generation, so handles still
+     * holding an old one can't take blocks in under it.
+     */
+    pub(crate) fn forget(&self, ino: u64) {
+        let mut inner = self.inner.lock().unwrap();
+        inner.changes.remove(&ino);
+        if inner.generations.remove(&ino).is_none() {
+            return; // Never cached under a generation, so no blocks
+        }
+        let held: Vec<Key> = inner.blocks.keys().filter(|k| k.0 == ino).copied().collect();
+        for key in held {
+            inner.unlink(&key);
+        }
+    }
+
+    /**
+     * Block `index` of `ino` if held for `generation` and at least `need`
+     * bytes long.
+     */
+    pub(crate) fn get(&self, ino: u64, generation: u64, index: u64, need: usize) -> Option<Arc<[u8]>> {
+        let mut inner = self.inner.lock().unwrap();
+        let key = (ino, index);
+        let block = inner.unlink(&key)?;
+        if block.generation != generation || block.data.len() < need {
+            return None; // Stale or grown since, read it again
+        }
+        let data = block.data.clone();
+        let promoted = Block {
+            protected: true,
+            ..block
+        };
+        inner.link(key, promoted);
+        // Keep the protected segment to its share, demoting the least recent
+        let cap = self.budget * PROTECTED_PCT / 100;
+        while inner.protected_bytes > cap {
+            let Some((_, key)) = inner.protected.pop_first() else {
+                break;
+            };
+            let block = inner.blocks.remove(&key).unwrap();
+            inner.protected_bytes -= block.data.len() as u64;
+            inner.link(key, Block {
+                protected: false,
+                ..block
+            });
+        }
+        Some(data)
+    }
+
+    /**
+     * Whether block `index` of `ino`, a file of `file_size` bytes, should be
+     * taken in now that a read missed it.
+     */
+    pub(crate) fn admit(&self, ino: u64, index: u64, file_size: u64) -> bool {
+        if file_size <= SMALL_FILE {
+            return true;
+        }
+        let mut inner = self.inner.lock().unwrap();
+        let key = (ino, index);
+        if inner.ghosts.remove(&key) {
+            return true;
+        }
+        let max = (self.budget / BLOCK) as usize;
+        inner.remember_ghost(key, max);
+        false
+    }
+
+    /**
+     * Counts the writes and other changes to the cache file of `ino` that
+     * were applied here. A block read from the file is only taken in if the
+     * count is still what it was before the read, a change landing in
+     * between would find no block to update and be lost.
+     */
+    pub(crate) fn changes(&self, ino: u64) -> u64 {
+        self.inner.lock().unwrap().changes.get(&ino).copied().unwrap_or(0)
+    }
+
+    /**
+     * Takes in block `index` of `ino`, read from the cache file after
+     * changes() returned `changes`.
+     */
+    pub(crate) fn insert(&self, ino: u64, generation: u64, changes: u64, index: u64, data: Arc<[u8]>) {
+        let len = data.len() as u64;
+        if len > self.budget {
+            return;
+        }
+        let mut inner = self.inner.lock().unwrap();
+        if inner.generations.get(&ino) != Some(&generation) {
+            return; // The file was fetched again meanwhile
+        }
+        if inner.changes.get(&ino).copied().unwrap_or(0) != changes {
+            return; // Written meanwhile, the block may be from before
+        }
+        let key = (ino, index);
+        inner.unlink(&key);
+        inner.link(key, Block {
+            data,
+            generation,
+            protected: false,
+            tick: 0,
+        });
+        while inner.probation_bytes + inner.protected_bytes > self.budget {
+            let victim = match inner.probation.first_key_value() {
+                Some((_, &key)) => key,
+                None => match inner.protected.first_key_value() {
+                    Some((_, &key)) => key,
+                    None => break,
+                },
+            };
+            inner.unlink(&victim);
+            self.stats.record_tier_eviction();
+        }
+    }
+
+    /**
+     * Applies a write of `data` at `offset` to the blocks of `ino` held for
+     * `generation`, after it went to the cache file.
+     */
+    pub(crate) fn write(&self, ino: u64, generation: u64, offset: u64, data: &[u8]) {
+        if data.is_empty() {
+            return;
+        }
+        let end = offset + data.len() as u64;
+        let mut inner = self.inner.lock().unwrap();
+        *inner.changes.entry(ino).or_default() += 1;
+        for index in offset / BLOCK..=(end - 1) / BLOCK {
+            let key = (ino, index);
+            let Some(block) = inner.unlink(&key) else {
+                continue;
+            };
+            if block.generation != generation {
+                continue;
+            }
+            let start = index * BLOCK;
+            let from = offset.max(start);
+            let to = end.min(start + BLOCK);
+            let mut bytes = block.data.to_vec();
+            let (lo, hi) = ((from - start) as usize, (to - start) as usize);
+            if bytes.len() < hi {
+                bytes.resize(hi, 0);
+            }
+            bytes[lo..hi].copy_from_slice(&data[(from - offset) as usize..(to - offset) as usize]);
+            inner.link(key, Block {
+                data: bytes.into(),
+                ..block
+            });
+        }
+    }
+
+    /**
+     * Drops the blocks of `ino` overlapping the `len` bytes at `offset`,
+     * which changed in the cache file without going through write().
+     */
+    pub(crate) fn discard(&self, ino: u64, offset: u64, len: u64) {
+        if len == 0 {
+            return;
+        }
+        let mut inner = self.inner.lock().unwrap();
+        *inner.changes.entry(ino).or_default() += 1;
+        for index in offset / BLOCK..=(offset + len - 1) / BLOCK {
+            inner.unlink(&(ino, index));
+        }
+    }
+}
+
+impl TULFS {
+    /**
+     * The blocks of `ino` holding the `len` bytes at `offset`, all of them
+     * held by the memory tier or taken in from the cache file now. None if
+     * some block doesn't qualify yet, the read then goes to the cache file.
+     */
+    pub(crate) fn tier_blocks(
+        &self,
+        tier: &MemTier,
+        ino: u64,
+        cached: &CachedInode,
+        offset: u64,
+        len: usize,
+    ) -> Option<Vec<Arc<[u8]>>> {
+        let size = cached.fetched();
+        let end = offset + len as u64;
+        let mut blocks = Vec::new();
+        let mut hit = true;
+        for index in offset / BLOCK..=(end - 1) / BLOCK {
+            let start = index * BLOCK;
+            let need = (end.min(start + BLOCK) - start) as usize;
+            if let Some(block) = tier.get(ino, cached.generation, index, need) {
+                blocks.push(block);
+                continue;
+            }
+            hit = false;
+            if !tier.admit(ino, index, size) {
+                break;
+            }
+            let changes = tier.changes(ino);
+            let mut data = vec![0u8; (size.min(start + BLOCK) - start) as usize];
+            if cached.file.read_exact_at(&mut data, start).is_err() {
+                break;
+            }
+            let block: Arc<[u8]> = data.into();
+            tier.insert(ino, cached.generation, changes, index, block.clone());
+            blocks.push(block);
+        }
+        self.stats.record_tier_read(hit);
+        let complete = blocks.len() as u64 == (end - 1) / BLOCK - offset / BLOCK + 1;
+        complete.then_some(blocks)
+    }
+}
+
+/**
+ * Copies `out.len()` bytes starting `offset` bytes into the first of
+ * `blocks`, which follow each other in the file.
+ */
+pub(crate) fn gather(blocks: &[Arc<[u8]>], offset: usize, out: &mut [u8]) {
+    let mut skip = offset;
+    let mut done = 0;
+    for block in blocks {
+        let n = (block.len() - skip).min(out.len() - done);
+        out[done..done + n].copy_from_slice(&block[skip..skip + n]);
+        done += n;
+        skip = 0;
+    }
+}
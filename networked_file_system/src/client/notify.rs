@@ -0,0 +1,127 @@
+use std::{
+    ffi::OsString,
+    os::unix::{ffi::OsStrExt, io::RawFd},
+    path::Path,
+    sync::{mpsc, Mutex},
+};
+
+// From <linux/fuse.h>
+const FUSE_NOTIFY_INVAL_INODE: i32 = 2;
+const FUSE_NOTIFY_INVAL_ENTRY: i32 = 3;
+const OUT_HEADER_LEN: usize = 16; // fuse_out_header: len u32, error i32, unique u64
+
+enum Notification {
+    InvalInode { ino: u64, off: i64, len: i64 },
+    InvalEntry { parent: u64, name: OsString },
+}
+
+/**
+ * Pushes cache invalidations into the kernel through the FUSE notification
+ * channel, so that long entry/attr timeouts and keep_cache can be used.
+ *
+ * fuser 0.12 has no notification API and keeps the /dev/fuse fd to itself,
+ * so we find the fd in /proc/self/fd and write the notify messages
+ * ourselves. Messages are written from a dedicated thread: invalidating an
+ * inode from inside a request handler can deadlock against the kernel
+ * waiting for that very request.
+ */
+#[derive(Default)]
+pub struct KernelNotifier {
+    tx: Mutex<Option<mpsc::Sender<Notification>>>, // None until attached, notifications are dropped
+}
+
+impl KernelNotifier {
+    /**
+     * Starts delivering notifications. Call once the FUSE session exists.
+     */
+    pub fn attach(&self) -> bool {
+        let Some(fd) = find_fuse_fd() else {
+            eprintln!("Could not find /dev/fuse fd, kernel cache invalidation disabled");
+            return false;
+        };
+        let (tx, rx) = mpsc::channel::<Notification>();
+        std::thread::spawn(move || {
+            for n in rx {
+                write_notification(fd, &n);
+            }
+        });
+        *self.tx.lock().unwrap() = Some(tx);
+        true
+    }
+
+    pub fn is_attached(&self) -> bool {
+        self.tx.lock().unwrap().is_some()
+    }
+
+    /**
+     * Drops the kernel's cached attributes of `ino` and its page cache,
+     * all of it if `len` is 0.
+     */
+    pub fn inval_inode(&self, ino: u64, off: i64, len: i64) {
+        self.send(Notification::InvalInode { ino, off, len });
+    }
+
+    /**
+     * Drops the kernel's dentry for `name` in directory `parent`.
+     */
+    pub fn inval_entry(&self, parent: u64, name: &std::ffi::OsStr) {
+        self.send(Notification::InvalEntry {
+            parent,
+            name: name.to_os_string(),
+        });
+    }
+
+    fn send(&self, n: Notification) {
+        if let Some(tx) = self.tx.lock().unwrap().as_ref() {
+            let _ = tx.send(n);
+        }
+    }
+}
+
+pub(crate) fn find_fuse_fd() -> Option<RawFd> {
+    let dir = std::fs::read_dir("/proc/self/fd").ok()?;
+    for entry in dir.flatten() {
+        if std::fs::read_link(entry.path()).is_ok_and(|t| t == Path::new("/dev/fuse")) {
+            return entry.file_name().to_str()?.parse().ok();
+        }
+    }
+    None
+}
+
+fn write_notification(fd: RawFd, n: &Notification) {
+    let (code, mut body) = match n {
+        Notification::InvalInode { ino, off, len } => {
+            // fuse_notify_inval_inode_out
+            let mut b = Vec::with_capacity(24);
+            b.extend_from_slice(&ino.to_ne_bytes());
+            b.extend_from_slice(&off.to_ne_bytes());
+            b.extend_from_slice(&len.to_ne_bytes());
+            (FUSE_NOTIFY_INVAL_INODE, b)
+        }
+        Notification::InvalEntry { parent, name } => {
+            // fuse_notify_inval_entry_out followed by the NUL terminated name
+            let name = name.as_bytes();
+            let mut b = Vec::with_capacity(16 + name.len() + 1);
+            b.extend_from_slice(&parent.to_ne_bytes());
+            b.extend_from_slice(&(name.len() as u32).to_ne_bytes());
+            b.extend_from_slice(&0u32.to_ne_bytes());
+            b.extend_from_slice(name);
+            b.push(0);
+            (FUSE_NOTIFY_INVAL_ENTRY, b)
+        }
+    };
+    let mut msg = Vec::with_capacity(OUT_HEADER_LEN + body.len());
+    msg.extend_from_slice(&((OUT_HEADER_LEN + body.len()) as u32).to_ne_bytes());
+    msg.extend_from_slice(&code.to_ne_bytes());
+    msg.extend_from_slice(&0u64.to_ne_bytes()); // unique 0 marks a notification
+    msg.append(&mut body);
+
+    let rc = unsafe { libc::write(fd, msg.as_ptr() as *const libc::c_void, msg.len()) };
+    if rc < 0 {
+        let err = std::io::Error::last_os_error();
+        // ENOENT just means the kernel wasn't caching it
+        if err.raw_os_error() != Some(libc::ENOENT) {
+            eprintln!("FUSE notification failed: {err}");
+        }
+    }
+}
@@ -0,0 +1,116 @@
+use crate::cached::CachedInode;
+use crate::transfers::CHUNK;
+use crate::TULFS;
+
+use std::{ops::Range, sync::Arc};
+
+// The window grows to this many bytes ahead of a sequential reader
+const MAX_WINDOW: u64 = 8 * CHUNK;
+
+/**
+ * Access pattern of one handle. Reads starting where the last one ended
+ * double the readahead window, up to MAX_WINDOW; any other read drops it.
+ */
+#[derive(Default)]
+pub(crate) struct ReadPattern {
+    next: u64,   // Where a sequential read would start
+    window: u64, // Bytes to have fetched ahead of `next`, 0 if random
+}
+
+impl ReadPattern {
+    /**
+     * Takes in a read of `len` bytes at `offset` and returns the range that
+     * should be fetched ahead of it.
+     */
+    pub(crate) fn advance(&mut self, offset: u64, len: usize) -> Option<Range<u64>> {
+        let sequential = offset == self.next && offset > 0;
+        self.window = match (sequential, self.window) {
+            (false, _) => 0,
+            (true, 0) => CHUNK,
+            (true, w) => (w * 2).min(MAX_WINDOW),
+        };
+        self.next = offset + len as u64;
+        (self.window > 0).then(|| self.next..self.next + self.window)
+    }
+}
+
+impl TULFS {
+    /**
+     * Starts fetching the chunks of `range` punched out of the cache file of
+     * `ino`, without waiting for them.
+     */
+    pub(crate) fn read_ahead(&self, ino: u64, cached: &Arc<CachedInode>, range: Range<u64>) {
+        let range = range.start..range.end.min(cached.fetched());
+        let chunks = cached.start_fill(range);
+        if chunks.is_empty() {
+            return;
+        }
+        let Some(path) = self.path_for_inode(ino) else {
+            cached.landed(&chunks, false);
+            return;
+        };
+        let path = path.strip_prefix("/").unwrap_or(&path);
+        let remote_path = self.get_remote_abs_path(path);
+        self.stats.record_readahead(chunks.len());
+        let (pending, landed) = (cached.clone(), chunks.clone());
+        self.transfers
+            .fetch_chunks_then(&remote_path, &cached.file, &chunks, move |res| {
+                pending.landed(&landed, res.is_ok())
+            });
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const LEN: usize = 128 << 10;
+
+    // Reads `count` LEN-sized blocks in order from `start`, returning the
+    // window after each
+    fn sequential(pattern: &mut ReadPattern, start: u64, count: u64) -> Vec<u64> {
+        (0..count)
+            .map(|i| {
+                let offset = start + i * LEN as u64;
+                let ahead = pattern.advance(offset, LEN);
+                let window = ahead.as_ref().map_or(0, |r| r.end - r.start);
+                if let Some(ahead) = ahead {
+                    assert_eq!(ahead.start, offset + LEN as u64);
+                }
+                window
+            })
+            .collect()
+    }
+
+    #[test]
+    fn first_read_at_zero_has_no_window() {
+        let mut pattern = ReadPattern::default();
+        assert_eq!(pattern.advance(0, LEN), None);
+        // Also not for a read that would otherwise continue an empty one
+        let mut pattern = ReadPattern::default();
+        assert_eq!(pattern.advance(0, 0), None);
+        assert_eq!(pattern.advance(0, LEN), None);
+    }
+
+    #[test]
+    fn window_doubles_to_max() {
+        let mut pattern = ReadPattern::default();
+        let windows = sequential(&mut pattern, 0, 8);
+        assert_eq!(
+            windows,
+            [0, CHUNK, 2 * CHUNK, 4 * CHUNK, MAX_WINDOW, MAX_WINDOW, MAX_WINDOW, MAX_WINDOW]
+        );
+    }
+
+    #[test]
+    fn random_read_collapses_window() {
+        let mut pattern = ReadPattern::default();
+        sequential(&mut pattern, 0, 6);
+        assert_eq!(pattern.advance(100 * CHUNK, LEN), None);
+        // Sequential again from there, it starts over from one chunk
+        let next = 100 * CHUNK + LEN as u64;
+        assert_eq!(sequential(&mut pattern, next, 3), [CHUNK, 2 * CHUNK, 4 * CHUNK]);
+        // Going back to reread the same block counts as random too
+        assert_eq!(pattern.advance(next, LEN), None);
+    }
+}
@@ -0,0 +1,289 @@
+use crate::transfers::CHUNK;
+use crate::{ROOT_INODE, TTL, TULFS};
+
+use networked_file_system::protocol::{LeaseKind, Message};
+
+use fuser::{ReplyAttr, ReplyEmpty, TimeOrNow};
+use libc::{
+    c_int, EACCES, EBADF, EIO, ENOENT, EOPNOTSUPP, FALLOC_FL_KEEP_SIZE, FALLOC_FL_PUNCH_HOLE,
+    FALLOC_FL_ZERO_RANGE, O_ACCMODE, O_RDONLY,
+};
+use ssh2::{ErrorCode, FileStat};
+
+use std::{
+    fs::{self, File, OpenOptions},
+    os::fd::AsRawFd,
+    path::{Path, PathBuf},
+    time::{SystemTime, UNIX_EPOCH},
+};
+
+fn sftp_errno(e: &ssh2::Error) -> c_int {
+    match e.code() {
+        ErrorCode::SFTP(2) => ENOENT, // SSH_FX_NO_SUCH_FILE
+        ErrorCode::SFTP(3) => EACCES, // SSH_FX_PERMISSION_DENIED
+        _ => EIO,
+    }
+}
+
+fn size_stat(size: u64) -> FileStat {
+    FileStat {
+        size: Some(size),
+        uid: None,
+        gid: None,
+        perm: None,
+        atime: None,
+        mtime: None,
+    }
+}
+
+fn epoch_secs(t: SystemTime) -> u64 {
+    t.duration_since(UNIX_EPOCH).map_or(0, |d| d.as_secs())
+}
+
+fn time_secs(t: TimeOrNow) -> u64 {
+    match t {
+        TimeOrNow::SpecificTime(t) => epoch_secs(t),
+        TimeOrNow::Now => epoch_secs(SystemTime::now()),
+    }
+}
+
+impl TULFS {
+    /**
+     * Sends an attribute change of `ino` to the remote file with one SFTP
+     * setstat. A new size is applied to the cache file the same way, so a
+     * truncate moves no file data whatever the size.
+     */
+    pub(crate) fn do_setattr(
+        &self,
+        ino: u64,
+        mode: Option<u32>,
+        uid: Option<u32>,
+        gid: Option<u32>,
+        size: Option<u64>,
+        atime: Option<TimeOrNow>,
+        mtime: Option<TimeOrNow>,
+        reply: ReplyAttr,
+    ) {
+        let Some(path) = self.path_for_inode(ino) else {
+            reply.error(ENOENT);
+            return;
+        };
+        let rel = path.strip_prefix("/").unwrap_or(&path).to_path_buf();
+        // SFTP sets both times or neither, and the owner and group together,
+        // keep the one of each pair not asked for
+        let partial = atime.is_some() != mtime.is_some() || uid.is_some() != gid.is_some();
+        let current = match partial {
+            true => match self.attr_from_remote(rel.clone(), ino) {
+                Ok(attr) => Some(attr),
+                Err(e) => {
+                    reply.error(e);
+                    return;
+                }
+            },
+            false => None,
+        };
+        let (atime, mtime) = match (atime, mtime, current) {
+            (Some(a), Some(m), _) => (Some(time_secs(a)), Some(time_secs(m))),
+            (a, m, Some(attr)) if a.is_some() || m.is_some() => (
+                Some(a.map_or(epoch_secs(attr.atime), time_secs)),
+                Some(m.map_or(epoch_secs(attr.mtime), time_secs)),
+            ),
+            _ => (None, None),
+        };
+        let (uid, gid) = match (uid, gid, current) {
+            (Some(uid), None, Some(attr)) => (Some(uid), Some(attr.gid)),
+            (None, Some(gid), Some(attr)) => (Some(attr.uid), Some(gid)),
+            (uid, gid, _) => (uid, gid),
+        };
+        let stat = FileStat {
+            size,
+            uid,
+            gid,
+            perm: mode,
+            atime,
+            mtime,
+        };
+        let truncate = size.map(|size| (move |_| size, |_: &File| Ok(())));
+        if let Err(e) = self.change_remote(ino, &rel, |remote_path| self.setstat(remote_path, stat), truncate) {
+            reply.error(e);
+            return;
+        }
+        if ino == ROOT_INODE {
+            reply.attr(&TTL, &self.root_attr());
+            return;
+        }
+        match self.attr_from_remote(rel, ino) {
+            Ok(attr) => reply.attr(&self.kernel_ttl(ino), &attr),
+            Err(e) => reply.error(e),
+        }
+    }
+
+    /**
+     * fallocate on a handle, run on the remote file by the TULFS server and
+     * then on the cache file. Without a server only plain allocation works,
+     * as an extension of the size through setstat that reserves no space.
+     */
+    pub(crate) fn do_fallocate(&self, ino: u64, fh: u64, offset: u64, len: u64, mode: i32, reply: ReplyEmpty) {
+        let Some(entry) = self.files.get(fh) else {
+            reply.error(EBADF);
+            return;
+        };
+        if entry.flags & O_ACCMODE as u32 == O_RDONLY as u32 {
+            reply.error(EBADF);
+            return;
+        }
+        let Some(path) = self.path_for_inode(ino) else {
+            reply.error(ENOENT);
+            return;
+        };
+        let rel = path.strip_prefix("/").unwrap_or(&path).to_path_buf();
+        let end = offset + len;
+        let keep_size = mode & FALLOC_FL_KEEP_SIZE != 0;
+        let server = self.callback_server().or(self.lease_server());
+        if server.is_none() && mode != 0 {
+            reply.error(EOPNOTSUPP);
+            return;
+        }
+        let allocate = |remote_path: &Path| match server {
+            Some(server) => match server.call(Message::Allocate {
+                path: remote_path.to_path_buf(),
+                offset,
+                len,
+                mode,
+            }) {
+                Ok(Message::Attr(_)) => Ok(()),
+                Ok(Message::Error { errno }) => Err(errno),
+                Ok(_) => Err(EIO),
+                Err(e) => Err(e),
+            },
+            None if end <= entry.cached.fetched() => Ok(()),
+            None => self.setstat(remote_path, size_stat(end)),
+        };
+        let resize = move |old: u64| if keep_size { old } else { old.max(end) };
+        let local = |file: &File| {
+            if unsafe { libc::fallocate(file.as_raw_fd(), mode, offset as i64, len as i64) } < 0 {
+                return Err(std::io::Error::last_os_error());
+            }
+            Ok(())
+        };
+        if let Err(e) = self.change_remote(ino, &rel, allocate, Some((resize, local))) {
+            reply.error(e);
+            return;
+        }
+        if mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE) != 0 {
+            if let Some(tier) = &self.tier {
+                tier.discard(ino, offset, len);
+            }
+        }
+        reply.ok();
+    }
+
+    /**
+     * Truncates `ino`, at `rel` under the backing root, to `size` bytes.
+     */
+    pub(crate) fn truncate(&self, ino: u64, rel: &Path, size: u64) -> Result<(), c_int> {
+        let truncate = Some((move |_| size, |_: &File| Ok(())));
+        self.change_remote(ino, rel, |remote_path| self.setstat(remote_path, size_stat(size)), truncate)
+    }
+
+    fn setstat(&self, remote_path: &Path, stat: FileStat) -> Result<(), c_int> {
+        let sftp = self.sftp();
+        sftp.check(sftp.setstat(remote_path, stat)).map_err(|e| {
+            eprintln!("setstat {:?} failed: {}", remote_path, e);
+            sftp_errno(&e)
+        })
+    }
+
+    /**
+     * Runs `remote` on the remote file of `ino`, at `rel` under the backing
+     * root. If that changed the data, `change` makes the same change to our
+     * copy: its function of the old size gives the new one, and it runs on
+     * the cache file before the resize. A copy that wasn't current is
+     * dropped rather than changed, and other clients are told as after an
+     * upload. With leases, the write lease is taken first like for any
+     * other write.
+     */
+    fn change_remote(
+        &self,
+        ino: u64,
+        rel: &Path,
+        remote: impl FnOnce(&Path) -> Result<(), c_int>,
+        change: Option<(impl FnOnce(u64) -> u64, impl FnOnce(&File) -> std::io::Result<()>)>,
+    ) -> Result<(), c_int> {
+        let remote_path = self.get_remote_abs_path(rel);
+        self.lease_for_change(ino, LeaseKind::Write)?;
+        // Not while the file is being fetched or uploaded
+        let _transfer = self.begin_transfer(ino);
+        remote(&remote_path)?;
+
+        let Some((resize, local)) = change else {
+            // Only attributes changed, the data we have is as current as it was
+            let current = {
+                let st = self.st.lock().unwrap();
+                st.valid_data.contains(&ino) || st.is_open(ino)
+            };
+            if current {
+                self.after_upload(ino, &remote_path);
+            } else {
+                self.st.lock().unwrap().attrs.remove(&ino);
+            }
+            return Ok(());
+        };
+        let cache_dir = self.cache_dir();
+        let mut st = self.st.lock().unwrap();
+        let sizes = if let Some(cached) = st.inodes.cached(ino) {
+            let old = cached.fetched();
+            let new = resize(old);
+            let res = local(&cached.file).and_then(|_| match new != old {
+                true => cached.resize(new),
+                false => Ok(()),
+            });
+            if let Err(e) = res {
+                // The file is open, fetch it again on the next open
+                eprintln!("Could not apply remote change to inode {}: {}", ino, e);
+                st.valid_data.remove(&ino);
+                return Err(EIO);
+            }
+            Some((old, new))
+        } else if st.valid_data.contains(&ino) {
+            let local_path: PathBuf = cache_dir.join(rel);
+            let res = OpenOptions::new().read(true).write(true).open(&local_path).and_then(|file| {
+                let old = file.metadata()?.len();
+                let new = resize(old);
+                local(&file)?;
+                file.set_len(new)?;
+                Ok((old, new))
+            });
+            match res {
+                Ok((old, new)) => {
+                    if let Some(absent) = st.absent.get_mut(&ino) {
+                        absent.retain(|&index| index * CHUNK < new);
+                    }
+                    if new != old && !st.deferred.contains_key(&ino) {
+                        st.keep_closed(ino, &cache_dir, &self.stats, &[]);
+                    }
+                    Some((old, new))
+                }
+                Err(e) => {
+                    eprintln!("Could not apply remote change to {:?}: {}", local_path, e);
+                    st.drop_cached(ino, &cache_dir);
+                    return Err(EIO);
+                }
+            }
+        } else {
+            // Out of date, and about to be taken for the current version
+            let _ = fs::remove_file(cache_dir.join(rel));
+            st.forget_tier(ino);
+            st.disk.forget(ino);
+            st.absent.remove(&ino);
+            None
+        };
+        drop(st);
+
+        if let (Some(tier), Some((old, new))) = (&self.tier, sizes) {
+            tier.discard(ino, old.min(new), old.abs_diff(new));
+        }
+        self.after_upload(ino, &remote_path);
+        Ok(())
+    }
+}
@@ -0,0 +1,225 @@
+use crate::sftp_pool::SftpPool;
+
+use networked_file_system::protocol::{self, Frame, Message, PUSH_ID, SERVER_SOCKET};
+
+use libc::EIO;
+use ssh2::{BlockDirections, Channel, Session};
+
+use tokio::{
+    io::BufReader,
+    net::UnixStream,
+    runtime::Handle,
+    sync::{mpsc as async_mpsc, oneshot},
+};
+
+use std::{
+    collections::HashMap,
+    io::{ErrorKind, Read, Write},
+    os::{fd::AsRawFd, unix::net::UnixStream as StdUnixStream},
+    sync::{
+        atomic::{AtomicU64, Ordering},
+        mpsc, Arc, Mutex,
+    },
+    thread,
+};
+
+/**
+ * What the reader task hands to the client for anything that is not a
+ * reply to one of our requests.
+ */
+pub enum ServerEvent {
+    Push(Message),
+    Disconnected, // Every callback we held is gone
+}
+
+type Pending = Arc<Mutex<HashMap<u64, oneshot::Sender<Message>>>>;
+
+// How long the tunnel thread sleeps in poll when neither side moves
+const PUMP_POLL_MS: i32 = 1000;
+
+/**
+ * Connection to the TULFS server. Requests from any thread are multiplexed
+ * over one stream and matched to their replies by id. The socket is driven
+ * by a reader and a writer task on the client's runtime, so any number of
+ * requests can be outstanding without a thread each.
+ *
+ * The server only listens on a Unix socket on its own host. We reach it
+ * through an SSH session authenticated like the SFTP ones, forwarding a
+ * channel to that socket, so the server sees the SSH user as the peer and
+ * nobody without our key can talk to it.
+ */
+pub struct ServerConn {
+    out: async_mpsc::UnboundedSender<Frame>,
+    next_id: AtomicU64,
+    pending: Pending,
+}
+
+impl ServerConn {
+    pub fn connect(
+        pool: &SftpPool,
+        rt: &Handle,
+        on_event: impl Fn(ServerEvent) + Send + 'static,
+    ) -> std::io::Result<Arc<Self>> {
+        let session = pool.session().map_err(std::io::Error::other)?;
+        let channel = session
+            .channel_direct_streamlocal(SERVER_SOCKET, None)
+            .map_err(std::io::Error::other)?;
+        let (ours, tunnel) = StdUnixStream::pair()?;
+        tunnel.set_nonblocking(true)?;
+        thread::Builder::new()
+            .name("tulfs-tunnel".to_string())
+            .spawn(move || pump(session, channel, tunnel))?;
+        ours.set_nonblocking(true)?;
+        let stream = {
+            let _rt = rt.enter();
+            UnixStream::from_std(ours)?
+        };
+        let (reader, mut writer) = stream.into_split();
+        let pending: Pending = Arc::new(Mutex::new(HashMap::new()));
+
+        // Events may block (a recall uploads), give them a thread of their
+        // own so the reader keeps matching replies meanwhile
+        let (event_tx, event_rx) = mpsc::channel();
+        thread::Builder::new()
+            .name("tulfs-events".to_string())
+            .spawn(move || {
+                for ev in event_rx {
+                    on_event(ev);
+                }
+            })?;
+
+        let reader_pending = pending.clone();
+        rt.spawn(async move {
+            let mut reader = BufReader::new(reader);
+            loop {
+                let frame = match protocol::read_frame(&mut reader).await {
+                    Ok(Some(f)) => f,
+                    Ok(None) => break,
+                    Err(e) => {
+                        eprintln!("TULFS server connection error: {e}");
+                        break;
+                    }
+                };
+                if frame.id == PUSH_ID {
+                    let _ = event_tx.send(ServerEvent::Push(frame.msg));
+                } else if let Some(tx) = reader_pending.lock().unwrap().remove(&frame.id) {
+                    let _ = tx.send(frame.msg);
+                }
+            }
+            // Wake up everybody still waiting for a reply
+            reader_pending.lock().unwrap().clear();
+            let _ = event_tx.send(ServerEvent::Disconnected);
+        });
+
+        let (out, mut out_rx) = async_mpsc::unbounded_channel::<Frame>();
+        rt.spawn(async move {
+            while let Some(frame) = out_rx.recv().await {
+                if protocol::write_frame(&mut writer, &frame).await.is_err() {
+                    break;
+                }
+            }
+        });
+
+        Ok(Arc::new(ServerConn {
+            out,
+            next_id: AtomicU64::new(PUSH_ID + 1),
+            pending,
+        }))
+    }
+
+    /**
+     * Sends `msg` and blocks until the server replies. Must not be called
+     * from a task on the runtime.
+     */
+    pub fn call(&self, msg: Message) -> Result<Message, libc::c_int> {
+        let id = self.next_id.fetch_add(1, Ordering::Relaxed);
+        let (tx, rx) = oneshot::channel();
+        self.pending.lock().unwrap().insert(id, tx);
+        if self.out.send(Frame { id, msg }).is_err() {
+            self.pending.lock().unwrap().remove(&id);
+            return Err(EIO);
+        }
+        match rx.blocking_recv() {
+            Ok(Message::Error { errno }) => Err(errno),
+            Ok(reply) => Ok(reply),
+            Err(_) => Err(EIO), // Connection went away
+        }
+    }
+
+    /**
+     * Sends `msg` without waiting for a reply.
+     */
+    pub fn notify(&self, msg: Message) {
+        let id = self.next_id.fetch_add(1, Ordering::Relaxed);
+        let _ = self.out.send(Frame { id, msg });
+    }
+}
+
+/**
+ * Moves bytes both ways between `local`, the other end of the stream the
+ * connection tasks use, and the forwarded `channel` until either side
+ * closes. The session is non-blocking so one thread can serve both
+ * directions; it sleeps in poll on both sockets when neither can move.
+ */
+fn pump(session: Session, mut channel: Channel, mut local: StdUnixStream) {
+    session.set_blocking(false);
+    let mut up: Vec<u8> = Vec::new(); // Read from local, not yet in the channel
+    let mut down: Vec<u8> = Vec::new(); // The other way
+    let mut buf = vec![0u8; 64 << 10];
+    loop {
+        let mut moved = false;
+        if up.is_empty() {
+            match local.read(&mut buf) {
+                Ok(0) => break,
+                Ok(n) => up.extend_from_slice(&buf[..n]),
+                Err(e) if e.kind() == ErrorKind::WouldBlock => {}
+                Err(_) => break,
+            }
+        }
+        if !up.is_empty() {
+            match channel.write(&up) {
+                Ok(n) => {
+                    up.drain(..n);
+                    moved = true;
+                }
+                Err(e) if e.kind() == ErrorKind::WouldBlock => {}
+                Err(_) => break,
+            }
+        }
+        if down.is_empty() {
+            match channel.read(&mut buf) {
+                Ok(0) if channel.eof() => break,
+                Ok(n) => down.extend_from_slice(&buf[..n]),
+                Err(e) if e.kind() == ErrorKind::WouldBlock => {}
+                Err(_) => break,
+            }
+        }
+        if !down.is_empty() {
+            match local.write(&down) {
+                Ok(n) => {
+                    down.drain(..n);
+                    moved = true;
+                }
+                Err(e) if e.kind() == ErrorKind::WouldBlock => {}
+                Err(_) => break,
+            }
+        }
+        if moved {
+            continue;
+        }
+        let ssh_events = match session.block_directions() {
+            BlockDirections::Inbound => libc::POLLIN,
+            BlockDirections::Outbound => libc::POLLOUT,
+            BlockDirections::Both => libc::POLLIN | libc::POLLOUT,
+            BlockDirections::None => libc::POLLIN,
+        };
+        let local_events = if down.is_empty() { 0 } else { libc::POLLOUT } | if up.is_empty() { libc::POLLIN } else { 0 };
+        let mut fds = [
+            libc::pollfd { fd: local.as_raw_fd(), events: local_events, revents: 0 },
+            libc::pollfd { fd: session.as_raw_fd(), events: ssh_events, revents: 0 },
+        ];
+        unsafe { libc::poll(fds.as_mut_ptr(), fds.len() as libc::nfds_t, PUMP_POLL_MS) };
+    }
+    // Closing `local` tells the reader task the server is gone
+    eprintln!("Tunnel to the TULFS server closed");
+}
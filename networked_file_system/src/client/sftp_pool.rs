@@ -0,0 +1,231 @@
+use ssh2::{ErrorCode, Session, Sftp};
+
+use std::{
+    cell::Cell,
+    net::TcpStream,
+    ops::Deref,
+    path::{Path, PathBuf},
+    sync::{Condvar, Mutex},
+    time::{Duration, Instant},
+};
+
+// Connections idle for longer than this are checked before being handed out
+const HEALTH_CHECK_IDLE: Duration = Duration::from_secs(30);
+// Wait between attempts when the server refuses new connections
+const RECONNECT_DELAY: Duration = Duration::from_secs(1);
+
+/**
+ * One authenticated SSH connection with its SFTP channel.
+ */
+pub struct SshConn {
+    session: Session,
+    sftp: Sftp,
+    last_used: Instant,
+}
+
+struct PoolState {
+    idle: Vec<SshConn>,
+    open: usize, // Idle plus checked out plus being connected
+}
+
+/**
+ * Pool of SSH connections to the server. Each request checks one out for as
+ * long as it talks to the server, so requests on different workers no longer
+ * queue on a single session. Starts with the connections asked for at mount
+ * and opens more on demand, up to `max`.
+ */
+pub struct SftpPool {
+    user: String,
+    host: String,
+    key: PathBuf,
+    compress: bool,
+    max: usize,
+    st: Mutex<PoolState>,
+    returned: Condvar,
+}
+
+impl SftpPool {
+    pub fn new(
+        user: &str,
+        host: &str,
+        key: &Path,
+        compress: bool,
+        initial: usize,
+        max: usize,
+    ) -> Result<Self, String> {
+        let pool = SftpPool {
+            user: user.to_string(),
+            host: host.to_string(),
+            key: key.to_path_buf(),
+            compress,
+            max: max.max(initial).max(1),
+            st: Mutex::new(PoolState {
+                idle: Vec::new(),
+                open: 0,
+            }),
+            returned: Condvar::new(),
+        };
+        for _ in 0..initial.max(1) {
+            let conn = pool.connect()?;
+            let mut st = pool.st.lock().unwrap();
+            st.idle.push(conn);
+            st.open += 1;
+        }
+        Ok(pool)
+    }
+
+    /**
+     * Opens and authenticates an SSH session of our own, outside the pool.
+     */
+    pub fn session(&self) -> Result<Session, String> {
+        let tcp = TcpStream::connect((self.host.as_str(), 22))
+            .map_err(|e| format!("Could not connect to server: {e}"))?;
+        tcp.set_nodelay(true).ok();
+        let mut session = Session::new().map_err(|e| format!("Could not create SSH session: {e}"))?;
+        session.set_tcp_stream(tcp);
+        session.set_compress(self.compress);
+        session
+            .handshake()
+            .map_err(|e| format!("Could not complete SSH handshake: {e}"))?;
+        session
+            .userauth_pubkey_file(&self.user, None, &self.key, None)
+            .map_err(|e| format!("Could not authenticate: {e}"))?;
+        Ok(session)
+    }
+
+    fn connect(&self) -> Result<SshConn, String> {
+        let session = self.session()?;
+        let sftp = session
+            .sftp()
+            .map_err(|e| format!("Could not create SFTP session: {e}"))?;
+        Ok(SshConn {
+            session,
+            sftp,
+            last_used: Instant::now(),
+        })
+    }
+
+    fn healthy(conn: &SshConn) -> bool {
+        conn.sftp.realpath(Path::new(".")).is_ok()
+    }
+
+    /**
+     * Forgets a connection that was dropped or failed to open, making room
+     * for a new one.
+     */
+    fn lost(&self) {
+        self.st.lock().unwrap().open -= 1;
+        self.returned.notify_one();
+    }
+
+    /**
+     * Checks out a connection, opening a new one if all are busy and the pool
+     * may still grow, otherwise waiting for one to come back.
+     */
+    pub fn get(&self) -> PooledConn<'_> {
+        let mut st = self.st.lock().unwrap();
+        loop {
+            if let Some(conn) = st.idle.pop() {
+                drop(st);
+                if conn.last_used.elapsed() > HEALTH_CHECK_IDLE && !Self::healthy(&conn) {
+                    eprintln!("Dropping dead SSH connection to {}", self.host);
+                    self.lost();
+                    st = self.st.lock().unwrap();
+                    continue;
+                }
+                return PooledConn {
+                    pool: self,
+                    conn: Some(conn),
+                    broken: Cell::new(false),
+                };
+            }
+            if st.open < self.max {
+                st.open += 1;
+                drop(st);
+                match self.connect() {
+                    Ok(conn) => {
+                        return PooledConn {
+                            pool: self,
+                            conn: Some(conn),
+                            broken: Cell::new(false),
+                        }
+                    }
+                    Err(e) => {
+                        eprintln!("{e}");
+                        self.lost();
+                        std::thread::sleep(RECONNECT_DELAY);
+                    }
+                }
+                st = self.st.lock().unwrap();
+                continue;
+            }
+            st = self.returned.wait(st).unwrap();
+        }
+    }
+}
+
+/**
+ * A connection checked out of the pool, returned to it when dropped. Derefs
+ * to its SFTP channel.
+ */
+pub struct PooledConn<'a> {
+    pool: &'a SftpPool,
+    conn: Option<SshConn>,
+    broken: Cell<bool>,
+}
+
+impl PooledConn<'_> {
+    pub fn session(&self) -> &Session {
+        &self.conn.as_ref().unwrap().session
+    }
+
+    /**
+     * Passes `res` through, remembering to drop the connection instead of
+     * reusing it if the error came from the transport rather than the file
+     * system.
+     */
+    pub fn check<T>(&self, res: Result<T, ssh2::Error>) -> Result<T, ssh2::Error> {
+        if let Err(e) = &res {
+            if matches!(e.code(), ErrorCode::Session(_)) {
+                self.broken.set(true);
+            }
+        }
+        res
+    }
+
+    /**
+     * The connection failed in a way `check` can't see (an I/O error on an
+     * open remote file), don't reuse it.
+     */
+    pub fn mark_broken(&self) {
+        self.broken.set(true);
+    }
+
+    pub fn is_broken(&self) -> bool {
+        self.broken.get()
+    }
+}
+
+impl Deref for PooledConn<'_> {
+    type Target = Sftp;
+
+    fn deref(&self) -> &Sftp {
+        &self.conn.as_ref().unwrap().sftp
+    }
+}
+
+impl Drop for PooledConn<'_> {
+    fn drop(&mut self) {
+        let Some(mut conn) = self.conn.take() else {
+            return;
+        };
+        if self.broken.get() {
+            eprintln!("Dropping broken SSH connection to {}", self.pool.host);
+            self.pool.lost();
+            return;
+        }
+        conn.last_used = Instant::now();
+        self.pool.st.lock().unwrap().idle.push(conn);
+        self.pool.returned.notify_one();
+    }
+}
@@ -0,0 +1,159 @@
+use crate::bulk::{encode_entries, parse_find_output, BULK_MAX};
+use crate::{TULFS, CACHE_PATH};
+
+use networked_file_system::protocol::RemoteAttr;
+
+use std::{
+    collections::{BTreeMap, HashSet},
+    fs,
+    io::Write,
+    path::{Path, PathBuf},
+    time::Instant,
+};
+
+const MANIFEST_MAGIC: &str = "TULFS manifest 1";
+
+// Deltas are asked for from a little before the last snapshot, ctimes are
+// only compared to the second
+const DELTA_SLACK: i64 = 2;
+
+type Entries = Vec<(PathBuf, RemoteAttr)>;
+
+/**
+ * Drops entries whose parent directory is not in the map any more, i.e.
+ * whatever was below a directory that has gone. Relies on BTreeMap ordering
+ * paths component by component, which puts parents before their children.
+ */
+fn drop_orphans(map: BTreeMap<PathBuf, RemoteAttr>) -> Entries {
+    let mut dirs: HashSet<PathBuf> = HashSet::new();
+    let mut entries = Vec::with_capacity(map.len());
+    for (rel, attr) in map {
+        let parent_ok = match rel.parent() {
+            None => true, // The root itself
+            Some(p) => dirs.contains(p),
+        };
+        if !parent_ok {
+            continue;
+        }
+        if attr.is_dir {
+            dirs.insert(rel.clone());
+        }
+        entries.push((rel, attr));
+    }
+    entries
+}
+
+impl TULFS {
+    /**
+     * Where the manifest of this mount's backing tree lives, next to its
+     * cache directory.
+     */
+    fn manifest_path(&self) -> PathBuf {
+        let root_hash = md5::compute(self.backing_root.as_os_str().as_encoded_bytes());
+        PathBuf::from(format!("{}/{}-{:x}.manifest", CACHE_PATH, self.server_hash, root_hash))
+    }
+
+    /**
+     * Reads the saved manifest, returning the server time it was taken at
+     * and its entries.
+     */
+    fn read_manifest(&self) -> Option<(i64, Entries)> {
+        let data = fs::read(self.manifest_path()).ok()?;
+        let nl = data.iter().position(|&b| b == b'\n')?;
+        let header = std::str::from_utf8(&data[..nl]).ok()?;
+        let taken = header.strip_prefix(MANIFEST_MAGIC)?.trim().parse().ok()?;
+        Some((taken, parse_find_output(&data[nl + 1..])))
+    }
+
+    fn write_manifest(&self, taken: i64, entries: &[(PathBuf, RemoteAttr)]) {
+        let path = self.manifest_path();
+        let tmp_path = path.with_extension("part");
+        let res = fs::File::create(&tmp_path).and_then(|mut f| {
+            f.write_all(format!("{} {}\n", MANIFEST_MAGIC, taken).as_bytes())?;
+            f.write_all(&encode_entries(entries))?;
+            f.sync_all()
+        });
+        match res.and_then(|_| fs::rename(&tmp_path, &path)) {
+            Ok(()) => {}
+            Err(e) => eprintln!("Could not save metadata manifest: {}", e),
+        }
+    }
+
+    /**
+     * Brings a saved manifest up to date. Anything whose ctime moved since it
+     * was taken comes back in one transfer. Directories among them had
+     * entries added or removed, so they are listed again, and directories we
+     * didn't know about (created or moved in) are walked in full.
+     */
+    fn sync_manifest(&self, taken: i64, base: Entries) -> Result<(i64, Entries), libc::c_int> {
+        let (now, changed) = self.bulk_snapshot(Some(taken - DELTA_SLACK))?;
+        let mut map: BTreeMap<PathBuf, RemoteAttr> = base.into_iter().collect();
+
+        let mut relist = Vec::new();
+        let mut walk = Vec::new();
+        for (rel, attr) in &changed {
+            if !attr.is_dir {
+                continue;
+            }
+            if map.get(rel).is_some_and(|old| old.is_dir) {
+                relist.push(rel.clone());
+            } else {
+                walk.push(rel.clone());
+            }
+        }
+
+        // Forget what the changed directories held, their listings say what's left
+        let relisted: HashSet<&Path> = relist.iter().map(|d| d.as_path()).collect();
+        map.retain(|rel, _| !rel.parent().is_some_and(|p| relisted.contains(p)));
+        let mut fresh = changed;
+        for batch in relist.chunks(BULK_MAX) {
+            fresh.extend(self.bulk_stat_paths(batch, 1)?);
+        }
+        for dir in walk {
+            fresh.extend(self.bulk_stat_tree(&dir, None)?);
+        }
+        map.extend(fresh);
+        Ok((now, drop_orphans(map)))
+    }
+
+    /**
+     * Loads the metadata of the whole backing tree in one go, from the saved
+     * manifest plus a delta if we have one, otherwise from a full walk.
+     * Afterwards lookups and readdir anywhere in the tree are answered from
+     * the directory stamps, which keep the snapshot in sync as they are
+     * revalidated.
+     */
+    pub(crate) fn load_snapshot(&self) {
+        let start = Instant::now();
+        let res = match self.read_manifest() {
+            Some((taken, base)) => {
+                println!("Syncing metadata manifest from server time {}", taken);
+                self.sync_manifest(taken, base)
+            }
+            None => {
+                println!("Fetching metadata snapshot of {:?}", self.backing_root);
+                self.bulk_snapshot(None)
+            }
+        };
+        let (taken, entries) = match res {
+            Ok(snapshot) => snapshot,
+            Err(e) => {
+                eprintln!("Could not snapshot the backing tree ({}), continuing without", e);
+                return;
+            }
+        };
+
+        let checked = Instant::now();
+        self.cache_bulk(&entries);
+        self.st
+            .lock()
+            .unwrap()
+            .record_listings(Path::new(""), None, &entries, checked);
+        self.write_manifest(taken, &entries);
+        println!(
+            "Metadata snapshot of {} entries ready in {:?}",
+            entries.len(),
+            start.elapsed()
+        );
+    }
+}
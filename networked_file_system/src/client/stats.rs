@@ -0,0 +1,462 @@
+use crate::bufpool;
+
+use std::{
+    alloc::{GlobalAlloc, Layout, System},
+    fmt::Write as _,
+    path::Path,
+    sync::atomic::{AtomicU64, Ordering},
+    time::Duration,
+};
+
+// Bucket i counts latencies in [2^i, 2^(i+1)) microseconds, the last one
+// everything above
+const BUCKETS: usize = 32;
+
+static ALLOCS: AtomicU64 = AtomicU64::new(0);
+static ALLOC_BYTES: AtomicU64 = AtomicU64::new(0);
+
+/**
+ * The system allocator, counting allocations so the stats show how much heap
+ * traffic each path causes.
+ */
+pub struct CountingAlloc;
+
+unsafe impl GlobalAlloc for CountingAlloc {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        ALLOCS.fetch_add(1, Ordering::Relaxed);
+        ALLOC_BYTES.fetch_add(layout.size() as u64, Ordering::Relaxed);
+        unsafe { System.alloc(layout) }
+    }
+
+    unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+        ALLOCS.fetch_add(1, Ordering::Relaxed);
+        ALLOC_BYTES.fetch_add(layout.size() as u64, Ordering::Relaxed);
+        unsafe { System.alloc_zeroed(layout) }
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        ALLOCS.fetch_add(1, Ordering::Relaxed);
+        ALLOC_BYTES.fetch_add(new_size as u64, Ordering::Relaxed);
+        unsafe { System.realloc(ptr, layout, new_size) }
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        unsafe { System.dealloc(ptr, layout) }
+    }
+}
+
+/**
+ * Log2 latency histogram that many threads can record into without a lock.
+ */
+pub struct Histogram {
+    counts: [AtomicU64; BUCKETS],
+    total: AtomicU64,
+    sum_us: AtomicU64,
+    max_us: AtomicU64,
+}
+
+impl Default for Histogram {
+    fn default() -> Self {
+        Histogram {
+            counts: std::array::from_fn(|_| AtomicU64::new(0)),
+            total: AtomicU64::new(0),
+            sum_us: AtomicU64::new(0),
+            max_us: AtomicU64::new(0),
+        }
+    }
+}
+
+impl Histogram {
+    pub fn record(&self, d: Duration) {
+        let us = d.as_micros().min(u64::MAX as u128) as u64;
+        let bucket = (u64::BITS - us.leading_zeros()).saturating_sub(1) as usize;
+        self.counts[bucket.min(BUCKETS - 1)].fetch_add(1, Ordering::Relaxed);
+        self.total.fetch_add(1, Ordering::Relaxed);
+        self.sum_us.fetch_add(us, Ordering::Relaxed);
+        self.max_us.fetch_max(us, Ordering::Relaxed);
+    }
+
+    /**
+     * Upper bound of the bucket holding the `p`th percentile, in microseconds.
+     */
+    pub fn percentile_us(&self, p: f64) -> u64 {
+        let total = self.total.load(Ordering::Relaxed);
+        if total == 0 {
+            return 0;
+        }
+        let rank = ((total as f64) * p / 100.0).ceil().max(1.0) as u64;
+        let mut seen = 0;
+        for (i, count) in self.counts.iter().enumerate() {
+            seen += count.load(Ordering::Relaxed);
+            if seen >= rank {
+                return (1u64 << (i + 1)).min(self.max_us.load(Ordering::Relaxed).max(1));
+            }
+        }
+        self.max_us.load(Ordering::Relaxed)
+    }
+
+    fn to_json(&self) -> serde_json::Value {
+        let total = self.total.load(Ordering::Relaxed);
+        let buckets: Vec<u64> = self.counts.iter().map(|c| c.load(Ordering::Relaxed)).collect();
+        serde_json::json!({
+            "count": total,
+            "mean_us": self.sum_us.load(Ordering::Relaxed) / total.max(1),
+            "p50_us": self.percentile_us(50.0),
+            "p99_us": self.percentile_us(99.0),
+            "max_us": self.max_us.load(Ordering::Relaxed),
+            "log2_us_buckets": buckets,
+        })
+    }
+}
+
+/**
+ * What a FUSE request is waiting on, for latency accounting.
+ */
+#[derive(Clone, Copy)]
+pub enum OpClass {
+    Metadata, // lookup, getattr, readdir
+    Data,     // open (which may fetch), read, write, flush, release
+}
+
+/**
+ * Reads and writes served from cache files, with the syscalls they took and
+ * how long the cache I/O itself took.
+ */
+#[derive(Default)]
+pub struct CacheIo {
+    ops: AtomicU64,
+    syscalls: AtomicU64, // Blocking path only, io_uring calls are counted apart
+    bytes: AtomicU64,
+    latency: Histogram,
+}
+
+impl CacheIo {
+    fn to_json(&self) -> serde_json::Value {
+        let ops = self.ops.load(Ordering::Relaxed);
+        let syscalls = self.syscalls.load(Ordering::Relaxed);
+        serde_json::json!({
+            "ops": ops,
+            "syscalls": syscalls,
+            "syscalls_per_op": syscalls as f64 / ops.max(1) as f64,
+            "bytes": self.bytes.load(Ordering::Relaxed),
+            "latency": self.latency.to_json(),
+        })
+    }
+}
+
+/**
+ * Whole-file fetches or uploads, with how long each file took from being
+ * queued to its last byte.
+ */
+#[derive(Default)]
+pub struct TransferIo {
+    files: AtomicU64,
+    failed: AtomicU64,
+    bytes: AtomicU64,
+    completion: Histogram,
+}
+
+impl TransferIo {
+    fn to_json(&self) -> serde_json::Value {
+        serde_json::json!({
+            "files": self.files.load(Ordering::Relaxed),
+            "failed": self.failed.load(Ordering::Relaxed),
+            "bytes": self.bytes.load(Ordering::Relaxed),
+            "completion": self.completion.to_json(),
+        })
+    }
+}
+
+/**
+ * Counters of the running client, dumped on SIGUSR1 and at unmount.
+ */
+#[derive(Default)]
+pub struct Stats {
+    metadata: Histogram,
+    data: Histogram,
+    cache_reads: CacheIo,
+    cache_writes: CacheIo,
+    uring_enters: AtomicU64,
+    fetches: TransferIo,
+    uploads: TransferIo,
+    upload_dirty_bytes: AtomicU64, // Written since the previous upload of each file uploaded
+    chunks: AtomicU64,
+    steals: AtomicU64,           // Chunks run by a lane other than the one they were queued on
+    transfer_busy_us: AtomicU64, // Time with at least one transfer running
+    server_copies: AtomicU64,    // copy_file_range calls run on the server
+    server_copy_bytes: AtomicU64,
+    tier_hits: AtomicU64,        // Reads served whole from the memory tier
+    tier_misses: AtomicU64,
+    tier_evictions: AtomicU64,   // Blocks pushed out of the memory tier
+    disk_hits: AtomicU64,        // Opens that found the cache file current
+    disk_misses: AtomicU64,
+    disk_evictions: AtomicU64,   // Cache files deleted to stay in budget
+    disk_rejections: AtomicU64,  // Of those, files not kept on their close
+    disk_punched: AtomicU64,     // Chunks punched out of big cache files
+    demand_chunks: AtomicU64,    // Punched chunks fetched back while a request waited
+    readahead_chunks: AtomicU64, // Same, fetched ahead of a sequential reader
+}
+
+impl Stats {
+    /**
+     * Records the latency of one request, from when the kernel handed it to
+     * us (including time queued for a worker) to its reply.
+     */
+    pub fn record(&self, class: OpClass, d: Duration) {
+        match class {
+            OpClass::Metadata => self.metadata.record(d),
+            OpClass::Data => self.data.record(d),
+        }
+    }
+
+    /**
+     * Counts one FUSE read (`write` false) or write served from a cache file
+     * with `syscalls` calls moving `bytes` in `d`.
+     */
+    pub fn record_cache_io(&self, write: bool, syscalls: u64, bytes: usize, d: Duration) {
+        let io = if write { &self.cache_writes } else { &self.cache_reads };
+        io.ops.fetch_add(1, Ordering::Relaxed);
+        io.syscalls.fetch_add(syscalls, Ordering::Relaxed);
+        io.bytes.fetch_add(bytes as u64, Ordering::Relaxed);
+        io.latency.record(d);
+    }
+
+    /**
+     * Counts one io_uring_enter, which may submit or reap many requests.
+     */
+    pub fn record_uring_enter(&self) {
+        self.uring_enters.fetch_add(1, Ordering::Relaxed);
+    }
+
+    /**
+     * Counts one file fetched (`upload` false) or uploaded, `d` after it was
+     * queued.
+     */
+    pub fn record_transfer(&self, upload: bool, bytes: u64, d: Duration, ok: bool) {
+        let t = if upload { &self.uploads } else { &self.fetches };
+        if !ok {
+            t.failed.fetch_add(1, Ordering::Relaxed);
+            return;
+        }
+        t.files.fetch_add(1, Ordering::Relaxed);
+        t.bytes.fetch_add(bytes, Ordering::Relaxed);
+        t.completion.record(d);
+    }
+
+    pub fn record_chunk(&self, stolen: bool) {
+        self.chunks.fetch_add(1, Ordering::Relaxed);
+        if stolen {
+            self.steals.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+
+    /**
+     * Counts a stretch of `d` during which transfers were running, which
+     * aggregate throughput is measured against.
+     */
+    pub fn record_transfer_busy(&self, d: Duration) {
+        self.transfer_busy_us.fetch_add(d.as_micros() as u64, Ordering::Relaxed);
+    }
+
+    pub fn record_tier_read(&self, hit: bool) {
+        let counter = if hit { &self.tier_hits } else { &self.tier_misses };
+        counter.fetch_add(1, Ordering::Relaxed);
+    }
+
+    pub fn record_tier_eviction(&self) {
+        self.tier_evictions.fetch_add(1, Ordering::Relaxed);
+    }
+
+    pub fn record_disk_open(&self, hit: bool) {
+        let counter = if hit { &self.disk_hits } else { &self.disk_misses };
+        counter.fetch_add(1, Ordering::Relaxed);
+    }
+
+    pub fn record_disk_eviction(&self, rejected: bool) {
+        self.disk_evictions.fetch_add(1, Ordering::Relaxed);
+        if rejected {
+            self.disk_rejections.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+
+    pub fn record_disk_punch(&self) {
+        self.disk_punched.fetch_add(1, Ordering::Relaxed);
+    }
+
+    pub fn record_demand_fetch(&self, chunks: usize) {
+        self.demand_chunks.fetch_add(chunks as u64, Ordering::Relaxed);
+    }
+
+    pub fn record_readahead(&self, chunks: usize) {
+        self.readahead_chunks.fetch_add(chunks as u64, Ordering::Relaxed);
+    }
+
+    /**
+     * Counts the `bytes` written to a file since its last upload, as it is
+     * uploaded again.
+     */
+    pub fn record_upload_dirty(&self, bytes: u64) {
+        self.upload_dirty_bytes.fetch_add(bytes, Ordering::Relaxed);
+    }
+
+    pub fn record_server_copy(&self, bytes: u64) {
+        self.server_copies.fetch_add(1, Ordering::Relaxed);
+        self.server_copy_bytes.fetch_add(bytes, Ordering::Relaxed);
+    }
+
+    fn transfer_mb_s(&self) -> f64 {
+        let bytes = self.fetches.bytes.load(Ordering::Relaxed) + self.uploads.bytes.load(Ordering::Relaxed);
+        let us = self.transfer_busy_us.load(Ordering::Relaxed);
+        bytes as f64 / us.max(1) as f64
+    }
+
+    pub fn to_json(&self) -> serde_json::Value {
+        let (hits, misses, held, high_water) = bufpool::counters();
+        serde_json::json!({
+            "latency": {
+                "metadata": self.metadata.to_json(),
+                "data": self.data.to_json(),
+            },
+            "cache_io": {
+                "read": self.cache_reads.to_json(),
+                "write": self.cache_writes.to_json(),
+                "uring_enters": self.uring_enters.load(Ordering::Relaxed),
+            },
+            "transfers": {
+                "fetch": self.fetches.to_json(),
+                "upload": self.uploads.to_json(),
+                "upload_dirty_bytes": self.upload_dirty_bytes.load(Ordering::Relaxed),
+                "chunks": self.chunks.load(Ordering::Relaxed),
+                "steals": self.steals.load(Ordering::Relaxed),
+                "busy_us": self.transfer_busy_us.load(Ordering::Relaxed),
+                "mb_per_s": self.transfer_mb_s(),
+                "server_copies": self.server_copies.load(Ordering::Relaxed),
+                "server_copy_bytes": self.server_copy_bytes.load(Ordering::Relaxed),
+            },
+            "disk_cache": {
+                "hits": self.disk_hits.load(Ordering::Relaxed),
+                "misses": self.disk_misses.load(Ordering::Relaxed),
+                "evictions": self.disk_evictions.load(Ordering::Relaxed),
+                "rejected": self.disk_rejections.load(Ordering::Relaxed),
+                "punched_chunks": self.disk_punched.load(Ordering::Relaxed),
+                "demand_chunks": self.demand_chunks.load(Ordering::Relaxed),
+                "readahead_chunks": self.readahead_chunks.load(Ordering::Relaxed),
+            },
+            "memory_tier": {
+                "hits": self.tier_hits.load(Ordering::Relaxed),
+                "misses": self.tier_misses.load(Ordering::Relaxed),
+                "evictions": self.tier_evictions.load(Ordering::Relaxed),
+            },
+            "allocations": {
+                "count": ALLOCS.load(Ordering::Relaxed),
+                "bytes": ALLOC_BYTES.load(Ordering::Relaxed),
+            },
+            "buffer_pool": {
+                "hits": hits,
+                "misses": misses,
+                "held_bytes": held,
+                "high_water_bytes": high_water,
+            },
+        })
+    }
+
+    pub fn summary(&self) -> String {
+        let mut out = String::new();
+        for (name, h) in [("metadata", &self.metadata), ("data", &self.data)] {
+            let _ = writeln!(
+                out,
+                "{:<9} n={} p50={}us p99={}us max={}us",
+                name,
+                h.total.load(Ordering::Relaxed),
+                h.percentile_us(50.0),
+                h.percentile_us(99.0),
+                h.max_us.load(Ordering::Relaxed)
+            );
+        }
+        let mut ops = 0;
+        let mut syscalls = self.uring_enters.load(Ordering::Relaxed);
+        for (name, io) in [("read", &self.cache_reads), ("write", &self.cache_writes)] {
+            let _ = writeln!(
+                out,
+                "{:<9} n={} p50={}us p99={}us",
+                name,
+                io.ops.load(Ordering::Relaxed),
+                io.latency.percentile_us(50.0),
+                io.latency.percentile_us(99.0)
+            );
+            ops += io.ops.load(Ordering::Relaxed);
+            syscalls += io.syscalls.load(Ordering::Relaxed);
+        }
+        let _ = writeln!(out, "cache I/O syscalls/op={:.2}", syscalls as f64 / ops.max(1) as f64);
+        for (name, t) in [("fetch", &self.fetches), ("upload", &self.uploads)] {
+            let _ = writeln!(
+                out,
+                "{:<9} files={} p50={}us p99={}us max={}us",
+                name,
+                t.files.load(Ordering::Relaxed),
+                t.completion.percentile_us(50.0),
+                t.completion.percentile_us(99.0),
+                t.completion.max_us.load(Ordering::Relaxed)
+            );
+        }
+        let _ = writeln!(
+            out,
+            "transfers {:.1} MB/s, {} chunks, {} stolen",
+            self.transfer_mb_s(),
+            self.chunks.load(Ordering::Relaxed),
+            self.steals.load(Ordering::Relaxed)
+        );
+        let _ = writeln!(
+            out,
+            "server copies {} ({} bytes not transferred)",
+            self.server_copies.load(Ordering::Relaxed),
+            self.server_copy_bytes.load(Ordering::Relaxed)
+        );
+        let _ = writeln!(
+            out,
+            "disk cache hits={} misses={} evictions={} rejected={} punched={}",
+            self.disk_hits.load(Ordering::Relaxed),
+            self.disk_misses.load(Ordering::Relaxed),
+            self.disk_evictions.load(Ordering::Relaxed),
+            self.disk_rejections.load(Ordering::Relaxed),
+            self.disk_punched.load(Ordering::Relaxed)
+        );
+        let _ = writeln!(
+            out,
+            "chunk refetches demand={} readahead={}",
+            self.demand_chunks.load(Ordering::Relaxed),
+            self.readahead_chunks.load(Ordering::Relaxed)
+        );
+        let _ = writeln!(
+            out,
+            "memory tier hits={} misses={} evictions={}",
+            self.tier_hits.load(Ordering::Relaxed),
+            self.tier_misses.load(Ordering::Relaxed),
+            self.tier_evictions.load(Ordering::Relaxed)
+        );
+        let _ = writeln!(
+            out,
+            "allocations n={} bytes={}",
+            ALLOCS.load(Ordering::Relaxed),
+            ALLOC_BYTES.load(Ordering::Relaxed)
+        );
+        let (hits, misses, _, high_water) = bufpool::counters();
+        let _ = writeln!(out, "buffer pool hits={} misses={} high water={} bytes", hits, misses, high_water);
+        out
+    }
+
+    /**
+     * Prints a summary and writes the full numbers as JSON to `path`.
+     */
+    pub fn dump(&self, path: &Path) {
+        print!("{}", self.summary());
+        match serde_json::to_vec_pretty(&self.to_json()) {
+            Ok(json) => {
+                if let Err(e) = std::fs::write(path, json) {
+                    eprintln!("Could not write stats to {:?}: {}", path, e);
+                }
+            }
+            Err(e) => eprintln!("Could not encode stats: {}", e),
+        }
+    }
+}
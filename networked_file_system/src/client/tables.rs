@@ -0,0 +1,221 @@
+use crate::{cached::CachedInode, OpenEntry};
+
+use std::{
+    collections::HashMap,
+    hash::{DefaultHasher, Hash, Hasher},
+    path::{Path, PathBuf},
+    sync::{
+        atomic::{AtomicU64, Ordering},
+        Arc, RwLock,
+    },
+};
+
+// Enough that workers touching different files practically never share one
+const SHARDS: usize = 64;
+
+fn shards<T: Default>() -> [RwLock<T>; SHARDS] {
+    std::array::from_fn(|_| RwLock::new(T::default()))
+}
+
+// fhs and inode numbers are a counter and an md5 prefix, both spread evenly
+fn shard_of(key: u64) -> usize {
+    (key % SHARDS as u64) as usize
+}
+
+fn path_shard(path: &Path) -> usize {
+    let mut h = DefaultHasher::new();
+    path.hash(&mut h);
+    shard_of(h.finish())
+}
+
+/**
+ * Open file handles, sharded by fh. Handles don't change once opened, their
+ * mutable state lives in the inode's CachedInode, so reads and writes on
+ * different handles never contend here.
+ */
+pub(crate) struct FhTable {
+    next_fh: AtomicU64,
+    shards: [RwLock<HashMap<u64, Arc<OpenEntry>>>; SHARDS],
+}
+
+impl Default for FhTable {
+    fn default() -> Self {
+        FhTable {
+            next_fh: AtomicU64::new(1), // Start file handles at 1
+            shards: shards(),
+        }
+    }
+}
+
+impl FhTable {
+    pub(crate) fn insert(&self, entry: OpenEntry) -> u64 {
+        let fh = self.next_fh.fetch_add(1, Ordering::Relaxed);
+        self.shards[shard_of(fh)]
+            .write()
+            .unwrap()
+            .insert(fh, Arc::new(entry));
+        fh
+    }
+
+    pub(crate) fn get(&self, fh: u64) -> Option<Arc<OpenEntry>> {
+        self.shards[shard_of(fh)].read().unwrap().get(&fh).cloned()
+    }
+
+    pub(crate) fn remove(&self, fh: u64) -> Option<Arc<OpenEntry>> {
+        self.shards[shard_of(fh)].write().unwrap().remove(&fh)
+    }
+}
+
+#[derive(Default)]
+struct InodeEntry {
+    path: PathBuf,
+    open: u32,                        // Handles in the FhTable
+    cached: Option<Arc<CachedInode>>, // Shared by those handles
+}
+
+/**
+ * Inode number <-> path mappings plus the cache state of open inodes, sharded
+ * by inode and by path. Leaf locks: nothing else is locked while holding one.
+ */
+pub(crate) struct InodeTable {
+    by_ino: [RwLock<HashMap<u64, InodeEntry>>; SHARDS],
+    by_path: [RwLock<HashMap<PathBuf, u64>>; SHARDS],
+}
+
+impl Default for InodeTable {
+    fn default() -> Self {
+        InodeTable {
+            by_ino: shards(),
+            by_path: shards(),
+        }
+    }
+}
+
+impl InodeTable {
+    pub(crate) fn path(&self, ino: u64) -> Option<PathBuf> {
+        self.by_ino[shard_of(ino)]
+            .read()
+            .unwrap()
+            .get(&ino)
+            .map(|e| e.path.clone())
+    }
+
+    pub(crate) fn contains(&self, ino: u64) -> bool {
+        self.by_ino[shard_of(ino)].read().unwrap().contains_key(&ino)
+    }
+
+    pub(crate) fn ino(&self, path: &Path) -> Option<u64> {
+        self.by_path[path_shard(path)].read().unwrap().get(path).copied()
+    }
+
+    pub(crate) fn insert(&self, ino: u64, path: &Path) {
+        self.by_ino[shard_of(ino)]
+            .write()
+            .unwrap()
+            .entry(ino)
+            .or_default()
+            .path = path.to_path_buf();
+        self.by_path[path_shard(path)]
+            .write()
+            .unwrap()
+            .insert(path.to_path_buf(), ino);
+    }
+
+    /**
+     * Forgets `ino` unless a handle still has it open.
+     */
+    pub(crate) fn remove(&self, ino: u64) {
+        let path = {
+            let mut by_ino = self.by_ino[shard_of(ino)].write().unwrap();
+            match by_ino.get(&ino) {
+                Some(e) if e.open == 0 => by_ino.remove(&ino).map(|e| e.path),
+                _ => None,
+            }
+        };
+        if let Some(path) = path {
+            self.by_path[path_shard(&path)].write().unwrap().remove(&path);
+        }
+    }
+
+    /**
+     * The cache state of `ino` if a handle has it open.
+     */
+    pub(crate) fn cached(&self, ino: u64) -> Option<Arc<CachedInode>> {
+        self.by_ino[shard_of(ino)]
+            .read()
+            .unwrap()
+            .get(&ino)
+            .and_then(|e| e.cached.clone())
+    }
+
+    /**
+     * Counts a new handle of `ino`, putting its mapping back if a release on
+     * another worker dropped it meanwhile. Returns the cache state the handle
+     * should use: `cached` if `fresh` (the cache file was just replaced) or no
+     * other handle has one, otherwise the one already shared.
+     */
+    pub(crate) fn opened(
+        &self,
+        ino: u64,
+        path: &Path,
+        cached: Arc<CachedInode>,
+        fresh: bool,
+    ) -> Arc<CachedInode> {
+        let mut by_ino = self.by_ino[shard_of(ino)].write().unwrap();
+        let e = by_ino.entry(ino).or_default();
+        e.open += 1;
+        if fresh || e.cached.is_none() {
+            e.cached = Some(cached);
+        }
+        let cached = e.cached.clone().unwrap();
+        if e.path != path {
+            e.path = path.to_path_buf();
+            drop(by_ino);
+            self.by_path[path_shard(path)]
+                .write()
+                .unwrap()
+                .insert(path.to_path_buf(), ino);
+        }
+        cached
+    }
+
+    /**
+     * Counts one handle of `ino` closed, returning how many remain. The
+     * cache state and its fd go with the last one.
+     */
+    pub(crate) fn closed(&self, ino: u64) -> u32 {
+        match self.by_ino[shard_of(ino)].write().unwrap().get_mut(&ino) {
+            Some(e) => {
+                e.open = e.open.saturating_sub(1);
+                if e.open == 0 {
+                    e.cached = None;
+                }
+                e.open
+            }
+            None => 0,
+        }
+    }
+
+    /**
+     * Open inodes with writes not uploaded yet. Walks the whole table.
+     */
+    pub(crate) fn dirty(&self) -> Vec<u64> {
+        let mut dirty = Vec::new();
+        for shard in &self.by_ino {
+            for (&ino, e) in shard.read().unwrap().iter() {
+                if e.cached.as_ref().is_some_and(|cached| cached.is_dirty()) {
+                    dirty.push(ino);
+                }
+            }
+        }
+        dirty
+    }
+
+    pub(crate) fn is_open(&self, ino: u64) -> bool {
+        self.by_ino[shard_of(ino)]
+            .read()
+            .unwrap()
+            .get(&ino)
+            .is_some_and(|e| e.open > 0)
+    }
+}
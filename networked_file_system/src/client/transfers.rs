@@ -0,0 +1,541 @@
+use crate::bufpool;
+use crate::sftp_pool::{PooledConn, SftpPool};
+use crate::stats::Stats;
+use crate::uring::{self, FixedBuf, PendingWrite, Uring};
+
+use libc::{EIO, ENOENT};
+
+use std::{
+    collections::VecDeque,
+    fs::File,
+    io::{Read, Seek, SeekFrom, Write},
+    os::{fd::AsRawFd, unix::fs::FileExt},
+    path::{Path, PathBuf},
+    sync::{
+        atomic::{AtomicU64, AtomicUsize, Ordering},
+        Arc, Condvar, Mutex,
+    },
+    thread,
+    time::Instant,
+};
+
+// Transfers are split into chunks of this size, so that one big file keeps
+// every lane busy and a small one never waits for it to finish. Also what
+// parts of cache files are evicted and fetched again by
+pub(crate) const CHUNK: u64 = 4 << 20;
+// Buffer for moving a chunk without io_uring, from the buffer pool
+const COPY_BUF: usize = bufpool::MAX_IO;
+
+#[derive(Clone, Copy, PartialEq)]
+enum Direction {
+    Fetch,
+    Upload,
+}
+
+struct JobState {
+    left: usize, // Chunks not finished yet
+    error: Option<libc::c_int>,
+}
+
+type Done = Box<dyn FnOnce(Result<u64, libc::c_int>) + Send>;
+
+/**
+ * One file being fetched or uploaded. Its size is learnt by the first chunk,
+ * which opens the source and then queues the others.
+ */
+struct Job {
+    dir: Direction,
+    id: u64,
+    remote: PathBuf,
+    local: File,
+    size: AtomicU64, // 0 until the first chunk ran
+    moved: AtomicU64,
+    started: Instant,
+    st: Mutex<JobState>,
+    finished: Condvar,
+    done: Mutex<Option<Done>>, // Run by the lane finishing the job, if nobody waits for it
+}
+
+impl Job {
+    /**
+     * Bytes still to move, which is what chunks are scheduled by. A job
+     * whose first chunk hasn't run counts as 0, opening it is cheap and
+     * tells us how big it is.
+     */
+    fn remaining(&self) -> u64 {
+        self.size
+            .load(Ordering::Relaxed)
+            .saturating_sub(self.moved.load(Ordering::Relaxed))
+    }
+
+    fn error(&self) -> Option<libc::c_int> {
+        self.st.lock().unwrap().error
+    }
+
+    fn wait(&self) -> Result<u64, libc::c_int> {
+        let mut st = self.st.lock().unwrap();
+        while st.left > 0 {
+            st = self.finished.wait(st).unwrap();
+        }
+        self.result(&st)
+    }
+
+    fn result(&self, st: &JobState) -> Result<u64, libc::c_int> {
+        match st.error {
+            Some(e) => Err(e),
+            None => Ok(self.moved.load(Ordering::Relaxed)),
+        }
+    }
+}
+
+struct Chunk {
+    job: Arc<Job>,
+    first: bool, // Opens the job, see plan()
+    offset: u64,
+    len: Option<u64>, // None for up to the end of the source
+}
+
+/**
+ * Moves whole files between the cache and the server in chunks. Each lane
+ * works through a deque of its own on one bulk connection; a new file's
+ * chunks are dealt out across the lanes and a lane that runs dry steals from
+ * the one with the most queued. Lanes always take the chunk of the file with
+ * the fewest bytes left (shortest remaining first), so small files finish
+ * ahead of a big one that started before them.
+ */
+pub(crate) struct Transfers {
+    lanes: Vec<Mutex<VecDeque<Chunk>>>,
+    queued: AtomicUsize,
+    sleep: Mutex<()>,
+    work: Condvar,
+    next_lane: AtomicUsize,
+    next_id: AtomicU64,
+    active: Mutex<(usize, Instant)>, // Jobs running, since when some have been
+    pool: Arc<SftpPool>,
+    stats: Arc<Stats>,
+    uring: Option<Arc<Uring>>,
+}
+
+impl Transfers {
+    pub(crate) fn start(
+        lanes: usize,
+        pool: Arc<SftpPool>,
+        stats: Arc<Stats>,
+        uring: Option<Arc<Uring>>,
+    ) -> Arc<Self> {
+        let transfers = Arc::new(Transfers {
+            lanes: (0..lanes.max(1)).map(|_| Mutex::new(VecDeque::new())).collect(),
+            queued: AtomicUsize::new(0),
+            sleep: Mutex::new(()),
+            work: Condvar::new(),
+            next_lane: AtomicUsize::new(0),
+            next_id: AtomicU64::new(0),
+            active: Mutex::new((0, Instant::now())),
+            pool,
+            stats,
+            uring,
+        });
+        for lane in 0..transfers.lanes.len() {
+            let t = transfers.clone();
+            thread::Builder::new()
+                .name(format!("tulfs-lane-{lane}"))
+                .spawn(move || t.run_lane(lane))
+                .expect("Could not start transfer lane");
+        }
+        transfers
+    }
+
+    /**
+     * Copies the remote file at `remote` into `local` at the same offsets.
+     * Returns the bytes copied once all of them are there.
+     */
+    pub(crate) fn fetch(&self, remote: &Path, local: &File) -> Result<u64, libc::c_int> {
+        self.submit(Direction::Fetch, remote, local)
+    }
+
+    /**
+     * Replaces the remote file at `remote` with the contents of `local`.
+     */
+    pub(crate) fn upload(&self, local: &File, remote: &Path) -> Result<u64, libc::c_int> {
+        self.submit(Direction::Upload, remote, local)
+    }
+
+    /**
+     * Copies chunks `indexes` of the remote file at `remote` into `local`,
+     * whose size is already right.
+     */
+    pub(crate) fn fetch_chunks(&self, remote: &Path, local: &File, indexes: &[u64]) -> Result<u64, libc::c_int> {
+        if indexes.is_empty() {
+            return Ok(0);
+        }
+        self.queue_chunks(remote, local, indexes, None)?.wait()
+    }
+
+    /**
+     * Same as fetch_chunks() without waiting, `done` runs once the chunks are
+     * there or failed.
+     */
+    pub(crate) fn fetch_chunks_then(
+        &self,
+        remote: &Path,
+        local: &File,
+        indexes: &[u64],
+        done: impl FnOnce(Result<u64, libc::c_int>) + Send + 'static,
+    ) {
+        if let Err(e) = self.queue_chunks(remote, local, indexes, Some(Box::new(done))) {
+            eprintln!("Could not start readahead of {:?}: {}", remote, e);
+        }
+    }
+
+    fn queue_chunks(
+        &self,
+        remote: &Path,
+        local: &File,
+        indexes: &[u64],
+        done: Option<Done>,
+    ) -> Result<Arc<Job>, libc::c_int> {
+        let job = match self.new_job(Direction::Fetch, remote, local, indexes.len()) {
+            Ok(job) => job,
+            Err(e) => {
+                if let Some(done) = done {
+                    done(Err(e));
+                }
+                return Err(e);
+            }
+        };
+        job.size.store(indexes.len() as u64 * CHUNK, Ordering::Relaxed);
+        *job.done.lock().unwrap() = done;
+        self.push(
+            indexes
+                .iter()
+                .map(|&index| Chunk {
+                    job: job.clone(),
+                    first: false,
+                    offset: index * CHUNK,
+                    len: Some(CHUNK),
+                })
+                .collect(),
+        );
+        Ok(job)
+    }
+
+    fn submit(&self, dir: Direction, remote: &Path, local: &File) -> Result<u64, libc::c_int> {
+        let job = self.new_job(dir, remote, local, 1)?;
+        self.push(vec![Chunk {
+            job: job.clone(),
+            first: true,
+            offset: 0,
+            len: Some(CHUNK),
+        }]);
+        job.wait()
+    }
+
+    fn new_job(&self, dir: Direction, remote: &Path, local: &File, chunks: usize) -> Result<Arc<Job>, libc::c_int> {
+        let job = Arc::new(Job {
+            dir,
+            id: self.next_id.fetch_add(1, Ordering::Relaxed),
+            remote: remote.to_path_buf(),
+            local: local.try_clone().map_err(|_| EIO)?,
+            size: AtomicU64::new(0),
+            moved: AtomicU64::new(0),
+            started: Instant::now(),
+            st: Mutex::new(JobState {
+                left: chunks,
+                error: None,
+            }),
+            finished: Condvar::new(),
+            done: Mutex::new(None),
+        });
+        let mut active = self.active.lock().unwrap();
+        if active.0 == 0 {
+            active.1 = job.started;
+        }
+        active.0 += 1;
+        Ok(job)
+    }
+
+    /**
+     * Deals `chunks` out across the lanes, starting with the next one in
+     * turn, and wakes up idle lanes.
+     */
+    fn push(&self, chunks: Vec<Chunk>) {
+        let n = chunks.len();
+        let first = self.next_lane.fetch_add(n, Ordering::Relaxed);
+        for (i, chunk) in chunks.into_iter().enumerate() {
+            self.lanes[(first + i) % self.lanes.len()]
+                .lock()
+                .unwrap()
+                .push_back(chunk);
+        }
+        self.queued.fetch_add(n, Ordering::Release);
+        let _sleep = self.sleep.lock().unwrap();
+        self.work.notify_all();
+    }
+
+    /**
+     * Takes the chunk with the fewest bytes left in its file out of `deque`.
+     */
+    fn take_best(deque: &mut VecDeque<Chunk>) -> Option<Chunk> {
+        let best = (0..deque.len())
+            .min_by_key(|&i| (deque[i].job.remaining(), deque[i].job.id, deque[i].offset))?;
+        deque.remove(best)
+    }
+
+    /**
+     * Next chunk for `lane`: its own if it has any, otherwise one stolen
+     * from the busiest other lane. The flag tells if it was stolen.
+     */
+    fn take(&self, lane: usize) -> Option<(Chunk, bool)> {
+        if self.queued.load(Ordering::Acquire) == 0 {
+            return None;
+        }
+        let mut found = Self::take_best(&mut self.lanes[lane].lock().unwrap()).map(|c| (c, false));
+        if found.is_none() {
+            let victim = (0..self.lanes.len())
+                .filter(|&i| i != lane)
+                .max_by_key(|&i| self.lanes[i].lock().unwrap().len())?;
+            found = Self::take_best(&mut self.lanes[victim].lock().unwrap()).map(|c| (c, true));
+        }
+        if found.is_some() {
+            self.queued.fetch_sub(1, Ordering::AcqRel);
+        }
+        found
+    }
+
+    fn run_lane(&self, lane: usize) {
+        // Held while there is work, given back to the pool when idle
+        let mut conn: Option<PooledConn<'_>> = None;
+        loop {
+            let Some((chunk, stolen)) = self.take(lane) else {
+                conn = None;
+                let sleep = self.sleep.lock().unwrap();
+                if self.queued.load(Ordering::Acquire) == 0 {
+                    drop(self.work.wait(sleep).unwrap());
+                }
+                continue;
+            };
+            let res = match chunk.job.error() {
+                Some(e) => Err(e), // Another chunk failed already
+                None => {
+                    let c = conn.get_or_insert_with(|| self.pool.get());
+                    let res = self.run_chunk(c, &chunk);
+                    if c.is_broken() {
+                        conn = None;
+                    }
+                    res
+                }
+            };
+            self.stats.record_chunk(stolen);
+            self.chunk_done(&chunk.job, res);
+        }
+    }
+
+    fn chunk_done(&self, job: &Job, res: Result<(), libc::c_int>) {
+        let mut st = job.st.lock().unwrap();
+        if let Err(e) = res {
+            st.error.get_or_insert(e);
+        }
+        st.left -= 1;
+        if st.left > 0 {
+            return;
+        }
+        self.stats.record_transfer(
+            job.dir == Direction::Upload,
+            job.moved.load(Ordering::Relaxed),
+            job.started.elapsed(),
+            st.error.is_none(),
+        );
+        {
+            let mut active = self.active.lock().unwrap();
+            active.0 -= 1;
+            if active.0 == 0 {
+                self.stats.record_transfer_busy(active.1.elapsed());
+            }
+        }
+        job.finished.notify_all();
+        let result = job.result(&st);
+        drop(st);
+        let done = job.done.lock().unwrap().take();
+        if let Some(done) = done {
+            done(result);
+        }
+    }
+
+    /**
+     * Queues the chunks after the first once the file's `size` is known and
+     * returns how much the first one should move.
+     */
+    fn plan(&self, job: &Arc<Job>, size: u64) -> Option<u64> {
+        job.size.store(size, Ordering::Relaxed);
+        if size <= CHUNK {
+            return None;
+        }
+        let mut chunks = Vec::new();
+        let mut offset = CHUNK;
+        while offset < size {
+            let last = offset + CHUNK >= size;
+            chunks.push(Chunk {
+                job: job.clone(),
+                first: false,
+                offset,
+                len: if last { None } else { Some(CHUNK) },
+            });
+            offset += CHUNK;
+        }
+        job.st.lock().unwrap().left += chunks.len();
+        self.push(chunks);
+        Some(CHUNK)
+    }
+
+    fn run_chunk(&self, conn: &PooledConn, chunk: &Chunk) -> Result<(), libc::c_int> {
+        let job = &chunk.job;
+        let first = chunk.first;
+        let mut remote = match job.dir {
+            Direction::Fetch => conn.check(conn.open(&job.remote)).map_err(|_| {
+                eprintln!("Remote missing: {:?}", job.remote);
+                ENOENT
+            })?,
+            Direction::Upload => {
+                // Only the first chunk truncates, the others are queued
+                // after it did
+                let mut flags = ssh2::OpenFlags::WRITE | ssh2::OpenFlags::CREATE;
+                if first {
+                    flags |= ssh2::OpenFlags::TRUNCATE;
+                }
+                conn.check(conn.open_mode(&job.remote, flags, 0o644, ssh2::OpenType::File))
+                    .map_err(|_| {
+                        eprintln!("Failed to open remote file: {:?}", job.remote);
+                        EIO
+                    })?
+            }
+        };
+        let mut len = chunk.len;
+        if first {
+            let size = match job.dir {
+                Direction::Fetch => conn.check(remote.stat()).map_err(|_| EIO)?.size.unwrap_or(0),
+                Direction::Upload => job.local.metadata().map_err(|_| EIO)?.len(),
+            };
+            len = self.plan(job, size);
+        } else {
+            remote.seek(SeekFrom::Start(chunk.offset)).map_err(|_| EIO)?;
+        }
+        let moved = match job.dir {
+            Direction::Fetch => self.copy_down(conn, &mut remote, &job.local, chunk.offset, len),
+            Direction::Upload => copy_up(conn, &job.local, &mut remote, chunk.offset, len),
+        }?;
+        job.moved.fetch_add(moved, Ordering::Relaxed);
+        Ok(())
+    }
+
+    /**
+     * Copies up to `len` bytes from the remote file's current offset into
+     * `local` at `offset`. With io_uring, the next buffer is filled from the
+     * network while the previous one is being written to disk, if a second
+     * buffer is free. Otherwise the copier waits for its own write and reuses
+     * that buffer, so copiers never hold one while waiting for another.
+     */
+    fn copy_down(
+        &self,
+        conn: &PooledConn,
+        remote: &mut ssh2::File,
+        local: &File,
+        offset: u64,
+        len: Option<u64>,
+    ) -> Result<u64, libc::c_int> {
+        let len = len.unwrap_or(u64::MAX);
+        let mut moved = 0u64;
+        let Some(uring) = &self.uring else {
+            let mut buf = bufpool::get(COPY_BUF);
+            while moved < len {
+                let want = (len - moved).min(COPY_BUF as u64) as usize;
+                let n = remote.read(&mut buf[..want]).map_err(|_| {
+                    conn.mark_broken();
+                    EIO
+                })?;
+                if n == 0 {
+                    break;
+                }
+                local.write_all_at(&buf[..n], offset + moved).map_err(|_| EIO)?;
+                moved += n as u64;
+            }
+            return Ok(moved);
+        };
+        let fd = uring::Target::Fd(local.as_raw_fd());
+        let mut pending: Option<(PendingWrite, usize)> = None;
+        loop {
+            let mut buf = match pending.take() {
+                None => uring.buf(),
+                Some((prev, expected)) => match uring.try_buf() {
+                    Some(buf) => {
+                        pending = Some((prev, expected));
+                        buf
+                    }
+                    None => finish_write(prev, expected)?,
+                },
+            };
+            let want = (len - moved).min(uring::BUF_SIZE as u64) as usize;
+            let mut n = 0;
+            while n < want {
+                match remote.read(&mut buf.as_mut_slice()[n..want]) {
+                    Ok(0) => break,
+                    Ok(m) => n += m,
+                    Err(_) => {
+                        conn.mark_broken();
+                        return Err(EIO);
+                    }
+                }
+            }
+            if let Some((prev, expected)) = pending.take() {
+                drop(finish_write(prev, expected)?);
+            }
+            if n == 0 {
+                return Ok(moved);
+            }
+            pending = Some((uring.start_write(fd, buf, n, offset + moved), n));
+            moved += n as u64;
+        }
+    }
+}
+
+/**
+ * Waits for a write of `expected` bytes and takes its buffer back.
+ */
+fn finish_write(prev: PendingWrite<'_>, expected: usize) -> Result<FixedBuf<'_>, libc::c_int> {
+    let (prev_buf, res) = prev.wait();
+    match res.ok() == Some(expected) {
+        true => Ok(prev_buf),
+        false => Err(EIO),
+    }
+}
+
+/**
+ * Copies up to `len` bytes of `local` from `offset` to the remote file's
+ * current offset. Positional reads, the cache fd's offset is shared.
+ */
+fn copy_up(
+    conn: &PooledConn,
+    local: &File,
+    remote: &mut ssh2::File,
+    offset: u64,
+    len: Option<u64>,
+) -> Result<u64, libc::c_int> {
+    let len = len.unwrap_or(u64::MAX);
+    let mut buf = bufpool::get(COPY_BUF);
+    let mut moved = 0u64;
+    while moved < len {
+        let want = (len - moved).min(COPY_BUF as u64) as usize;
+        let n = local.read_at(&mut buf[..want], offset + moved).map_err(|_| {
+            eprintln!("Failed to read local file");
+            EIO
+        })?;
+        if n == 0 {
+            break;
+        }
+        remote.write_all(&buf[..n]).map_err(|_| {
+            conn.mark_broken();
+            EIO
+        })?;
+        moved += n as u64;
+    }
+    Ok(moved)
+}
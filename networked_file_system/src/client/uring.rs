@@ -0,0 +1,601 @@
+use crate::stats::Stats;
+
+use std::{
+    fs::File,
+    io,
+    os::fd::{AsRawFd, RawFd},
+    ptr,
+    sync::{
+        atomic::{AtomicU32, Ordering},
+        mpsc, Arc, Condvar, Mutex,
+    },
+    thread,
+};
+
+// Submission queue size, the completion queue is twice that
+const ENTRIES: u32 = 256;
+// Registered buffers, each big enough for the largest FUSE read or write
+pub(crate) const BUF_SIZE: usize = 128 * 1024;
+const BUFS: usize = 32;
+// Slots for registered cache fds, inodes opened beyond this use plain fds
+const FIXED_FILES: u32 = 1024;
+
+// From linux/io_uring.h
+const IORING_OFF_SQ_RING: i64 = 0;
+const IORING_OFF_CQ_RING: i64 = 0x8000000;
+const IORING_OFF_SQES: i64 = 0x10000000;
+const IORING_ENTER_GETEVENTS: u32 = 1;
+const IORING_OP_READ_FIXED: u8 = 4;
+const IORING_OP_WRITE_FIXED: u8 = 5;
+const IORING_OP_READ: u8 = 22;
+const IORING_OP_WRITE: u8 = 23;
+const IOSQE_FIXED_FILE: u8 = 1;
+const IORING_REGISTER_BUFFERS: u32 = 0;
+const IORING_REGISTER_FILES: u32 = 2;
+const IORING_REGISTER_FILES_UPDATE: u32 = 6;
+
+#[repr(C)]
+#[derive(Default)]
+struct SqringOffsets {
+    head: u32,
+    tail: u32,
+    ring_mask: u32,
+    ring_entries: u32,
+    flags: u32,
+    dropped: u32,
+    array: u32,
+    resv1: u32,
+    user_addr: u64,
+}
+
+#[repr(C)]
+#[derive(Default)]
+struct CqringOffsets {
+    head: u32,
+    tail: u32,
+    ring_mask: u32,
+    ring_entries: u32,
+    overflow: u32,
+    cqes: u32,
+    flags: u32,
+    resv1: u32,
+    user_addr: u64,
+}
+
+#[repr(C)]
+#[derive(Default)]
+struct Params {
+    sq_entries: u32,
+    cq_entries: u32,
+    flags: u32,
+    sq_thread_cpu: u32,
+    sq_thread_idle: u32,
+    features: u32,
+    wq_fd: u32,
+    resv: [u32; 3],
+    sq_off: SqringOffsets,
+    cq_off: CqringOffsets,
+}
+
+#[repr(C)]
+#[derive(Clone, Copy, Default)]
+struct Sqe {
+    opcode: u8,
+    flags: u8,
+    ioprio: u16,
+    fd: i32,
+    off: u64,
+    addr: u64,
+    len: u32,
+    rw_flags: u32,
+    user_data: u64,
+    buf_index: u16,
+    personality: u16,
+    splice_fd_in: i32,
+    addr3: u64,
+    pad: u64,
+}
+
+#[repr(C)]
+struct Cqe {
+    user_data: u64,
+    res: i32,
+    flags: u32,
+}
+
+#[repr(C)]
+struct FilesUpdate {
+    offset: u32,
+    resv: u32,
+    fds: u64,
+}
+
+fn check(ret: libc::c_long) -> io::Result<libc::c_long> {
+    if ret < 0 {
+        Err(io::Error::last_os_error())
+    } else {
+        Ok(ret)
+    }
+}
+
+fn mmap_ring(fd: RawFd, len: usize, offset: i64) -> io::Result<*mut u8> {
+    let p = unsafe {
+        libc::mmap(
+            ptr::null_mut(),
+            len,
+            libc::PROT_READ | libc::PROT_WRITE,
+            libc::MAP_SHARED | libc::MAP_POPULATE,
+            fd,
+            offset,
+        )
+    };
+    if p == libc::MAP_FAILED {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(p as *mut u8)
+}
+
+/**
+ * The mapped rings. The submitter thread is the only producer and the reaper
+ * thread the only consumer, as io_uring wants.
+ */
+struct Ring {
+    fd: RawFd,
+    sq_tail: *const AtomicU32,
+    sq_mask: u32,
+    sq_array: *mut u32,
+    sqes: *mut Sqe,
+    cq_head: *const AtomicU32,
+    cq_tail: *const AtomicU32,
+    cq_mask: u32,
+    cqes: *const Cqe,
+}
+
+// The pointers are into shared mappings that live as long as the process
+unsafe impl Send for Ring {}
+unsafe impl Sync for Ring {}
+
+impl Ring {
+    fn setup() -> io::Result<Ring> {
+        let mut p = Params::default();
+        let fd = check(unsafe {
+            libc::syscall(libc::SYS_io_uring_setup, ENTRIES, &mut p as *mut Params)
+        })? as RawFd;
+        let sq_len = p.sq_off.array as usize + p.sq_entries as usize * 4;
+        let cq_len = p.cq_off.cqes as usize + p.cq_entries as usize * std::mem::size_of::<Cqe>();
+        let sq = mmap_ring(fd, sq_len, IORING_OFF_SQ_RING)?;
+        let cq = mmap_ring(fd, cq_len, IORING_OFF_CQ_RING)?;
+        let sqes = mmap_ring(
+            fd,
+            p.sq_entries as usize * std::mem::size_of::<Sqe>(),
+            IORING_OFF_SQES,
+        )?;
+        unsafe {
+            Ok(Ring {
+                fd,
+                sq_tail: sq.add(p.sq_off.tail as usize) as *const AtomicU32,
+                sq_mask: *(sq.add(p.sq_off.ring_mask as usize) as *const u32),
+                sq_array: sq.add(p.sq_off.array as usize) as *mut u32,
+                sqes: sqes as *mut Sqe,
+                cq_head: cq.add(p.cq_off.head as usize) as *const AtomicU32,
+                cq_tail: cq.add(p.cq_off.tail as usize) as *const AtomicU32,
+                cq_mask: *(cq.add(p.cq_off.ring_mask as usize) as *const u32),
+                cqes: cq.add(p.cq_off.cqes as usize) as *const Cqe,
+            })
+        }
+    }
+
+    fn register(&self, opcode: u32, arg: *const libc::c_void, n: u32) -> io::Result<()> {
+        check(unsafe { libc::syscall(libc::SYS_io_uring_register, self.fd, opcode, arg, n) })
+            .map(|_| ())
+    }
+
+    fn enter(&self, to_submit: u32, min_complete: u32, flags: u32) -> io::Result<u32> {
+        loop {
+            let ret = unsafe {
+                libc::syscall(
+                    libc::SYS_io_uring_enter,
+                    self.fd,
+                    to_submit,
+                    min_complete,
+                    flags,
+                    ptr::null::<libc::c_void>(),
+                    0usize,
+                )
+            };
+            match check(ret) {
+                Ok(n) => return Ok(n as u32),
+                Err(e) if e.kind() == io::ErrorKind::Interrupted => continue,
+                Err(e) => return Err(e),
+            }
+        }
+    }
+}
+
+/**
+ * Where one request parks until the reaper posts its result.
+ */
+#[derive(Default)]
+struct Completion {
+    res: Mutex<Option<i32>>,
+    done: Condvar,
+}
+
+impl Completion {
+    fn post(&self, res: i32) {
+        *self.res.lock().unwrap() = Some(res);
+        self.done.notify_one();
+    }
+
+    fn wait(&self) -> io::Result<usize> {
+        let mut res = self.res.lock().unwrap();
+        while res.is_none() {
+            res = self.done.wait(res).unwrap();
+        }
+        match res.unwrap() {
+            n if n < 0 => Err(io::Error::from_raw_os_error(-n)),
+            n => Ok(n as usize),
+        }
+    }
+}
+
+struct Op {
+    sqe: Sqe,
+    done: Arc<Completion>,
+}
+
+/**
+ * Cache file I/O through io_uring. Requests from all workers go to one
+ * submitter thread, which puts everything queued meanwhile into a single
+ * io_uring_enter, and a reaper thread hands results back. Data moves through
+ * registered buffers, and the fds of open cache files are registered too, so
+ * the kernel doesn't have to map pages or look up the fd on every request.
+ */
+pub(crate) struct Uring {
+    ring: Arc<Ring>,
+    tx: Mutex<mpsc::Sender<Op>>,
+    bufs: *mut u8,
+    fixed_bufs: bool, // Registering may fail under a low RLIMIT_MEMLOCK
+    free_bufs: Mutex<Vec<u16>>,
+    buf_returned: Condvar,
+    free_slots: Mutex<Vec<u32>>, // Empty if files could not be registered
+}
+
+// `bufs` is only touched through FixedBufs, each owning one buffer
+unsafe impl Send for Uring {}
+unsafe impl Sync for Uring {}
+
+impl Uring {
+    pub(crate) fn new(stats: Arc<Stats>) -> io::Result<Arc<Uring>> {
+        let ring = Arc::new(Ring::setup()?);
+
+        let bufs = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                BUFS * BUF_SIZE,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_PRIVATE | libc::MAP_ANONYMOUS,
+                -1,
+                0,
+            )
+        };
+        if bufs == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+        let bufs = bufs as *mut u8;
+        let iovecs: Vec<libc::iovec> = (0..BUFS)
+            .map(|i| libc::iovec {
+                iov_base: unsafe { bufs.add(i * BUF_SIZE) } as *mut libc::c_void,
+                iov_len: BUF_SIZE,
+            })
+            .collect();
+        let fixed_bufs = match ring.register(
+            IORING_REGISTER_BUFFERS,
+            iovecs.as_ptr() as *const libc::c_void,
+            BUFS as u32,
+        ) {
+            Ok(()) => true,
+            Err(e) => {
+                eprintln!("Could not register io_uring buffers ({e}), using plain ones");
+                false
+            }
+        };
+        let empty = vec![-1i32; FIXED_FILES as usize];
+        let free_slots = match ring.register(
+            IORING_REGISTER_FILES,
+            empty.as_ptr() as *const libc::c_void,
+            FIXED_FILES,
+        ) {
+            Ok(()) => (0..FIXED_FILES).rev().collect(),
+            Err(e) => {
+                eprintln!("Could not register io_uring files ({e}), using plain fds");
+                Vec::new()
+            }
+        };
+
+        let (tx, rx) = mpsc::channel::<Op>();
+        let submit_ring = ring.clone();
+        let submit_stats = stats.clone();
+        thread::Builder::new()
+            .name("tulfs-uring-sq".to_string())
+            .spawn(move || submit_loop(&submit_ring, rx, &submit_stats))?;
+        let reap_ring = ring.clone();
+        thread::Builder::new()
+            .name("tulfs-uring-cq".to_string())
+            .spawn(move || reap_loop(&reap_ring, &stats))?;
+
+        Ok(Arc::new(Uring {
+            ring,
+            tx: Mutex::new(tx),
+            bufs,
+            fixed_bufs,
+            free_bufs: Mutex::new((0..BUFS as u16).rev().collect()),
+            buf_returned: Condvar::new(),
+            free_slots: Mutex::new(free_slots),
+        }))
+    }
+
+    /**
+     * Takes a buffer for one request, waiting if all are in use.
+     */
+    pub(crate) fn buf(&self) -> FixedBuf<'_> {
+        let mut free = self.free_bufs.lock().unwrap();
+        loop {
+            if let Some(index) = free.pop() {
+                return FixedBuf { ring: self, index };
+            }
+            free = self.buf_returned.wait(free).unwrap();
+        }
+    }
+
+    /**
+     * Takes a buffer if one is free. For callers already holding one, who
+     * must not wait for another while others may be doing the same.
+     */
+    pub(crate) fn try_buf(&self) -> Option<FixedBuf<'_>> {
+        let index = self.free_bufs.lock().unwrap().pop()?;
+        Some(FixedBuf { ring: self, index })
+    }
+
+    /**
+     * Registers `file` for as long as the returned FixedFile lives, None if
+     * all slots are taken.
+     */
+    pub(crate) fn register_file(self: &Arc<Self>, file: &File) -> Option<FixedFile> {
+        let slot = self.free_slots.lock().unwrap().pop()?;
+        if self.update_slot(slot, file.as_raw_fd()).is_err() {
+            self.free_slots.lock().unwrap().push(slot);
+            return None;
+        }
+        Some(FixedFile {
+            ring: self.clone(),
+            slot,
+        })
+    }
+
+    fn update_slot(&self, slot: u32, fd: RawFd) -> io::Result<()> {
+        let fds = [fd];
+        let up = FilesUpdate {
+            offset: slot,
+            resv: 0,
+            fds: fds.as_ptr() as u64,
+        };
+        self.ring.register(
+            IORING_REGISTER_FILES_UPDATE,
+            &up as *const FilesUpdate as *const libc::c_void,
+            1,
+        )
+    }
+
+    fn start(&self, write: bool, target: Target, buf: &FixedBuf, len: usize, offset: u64) -> Arc<Completion> {
+        let mut sqe = Sqe {
+            opcode: match (write, self.fixed_bufs) {
+                (false, true) => IORING_OP_READ_FIXED,
+                (true, true) => IORING_OP_WRITE_FIXED,
+                (false, false) => IORING_OP_READ,
+                (true, false) => IORING_OP_WRITE,
+            },
+            off: offset,
+            addr: buf.ptr() as u64,
+            len: len.min(BUF_SIZE) as u32,
+            buf_index: buf.index,
+            ..Default::default()
+        };
+        match target {
+            Target::Fd(fd) => sqe.fd = fd,
+            Target::Fixed(slot) => {
+                sqe.fd = slot as i32;
+                sqe.flags = IOSQE_FIXED_FILE;
+            }
+        }
+        let done = Arc::new(Completion::default());
+        let op = Op {
+            sqe,
+            done: done.clone(),
+        };
+        if self.tx.lock().unwrap().send(op).is_err() {
+            done.post(-libc::EIO);
+        }
+        done
+    }
+
+    /**
+     * Reads up to `len` bytes at `offset` into `buf`.
+     */
+    pub(crate) fn read(&self, target: Target, buf: &mut FixedBuf, len: usize, offset: u64) -> io::Result<usize> {
+        self.start(false, target, buf, len, offset).wait()
+    }
+
+    /**
+     * Writes the first `len` bytes of `buf` at `offset`.
+     */
+    pub(crate) fn write(&self, target: Target, buf: &FixedBuf, len: usize, offset: u64) -> io::Result<usize> {
+        self.start(true, target, buf, len, offset).wait()
+    }
+
+    /**
+     * Like write, but returns at once. The buffer is handed back once the
+     * write is waited for.
+     */
+    pub(crate) fn start_write<'a>(
+        &self,
+        target: Target,
+        buf: FixedBuf<'a>,
+        len: usize,
+        offset: u64,
+    ) -> PendingWrite<'a> {
+        let done = self.start(true, target, &buf, len, offset);
+        PendingWrite {
+            buf: Some(buf),
+            done,
+        }
+    }
+}
+
+fn submit_loop(ring: &Ring, rx: mpsc::Receiver<Op>, stats: &Stats) {
+    let entries = ring.sq_mask + 1;
+    while let Ok(first) = rx.recv() {
+        let mut batch = vec![first];
+        while batch.len() < entries as usize {
+            match rx.try_recv() {
+                Ok(op) => batch.push(op),
+                Err(_) => break,
+            }
+        }
+        // We are the only producer, the kernel consumes everything submitted
+        // during io_uring_enter
+        let mut tail = unsafe { (*ring.sq_tail).load(Ordering::Relaxed) };
+        for op in &batch {
+            let idx = tail & ring.sq_mask;
+            let mut sqe = op.sqe;
+            sqe.user_data = Arc::into_raw(op.done.clone()) as u64;
+            unsafe {
+                *ring.sqes.add(idx as usize) = sqe;
+                *ring.sq_array.add(idx as usize) = idx;
+            }
+            tail = tail.wrapping_add(1);
+        }
+        unsafe { (*ring.sq_tail).store(tail, Ordering::Release) };
+        let mut left = batch.len() as u32;
+        while left > 0 {
+            stats.record_uring_enter();
+            match ring.enter(left, 0, 0) {
+                Ok(n) => left -= n.min(left),
+                Err(e) if e.raw_os_error() == Some(libc::EAGAIN) || e.raw_os_error() == Some(libc::EBUSY) => {
+                    thread::yield_now();
+                }
+                Err(e) => {
+                    eprintln!("[ERROR] io_uring submit failed: {e}");
+                    std::process::exit(1);
+                }
+            }
+        }
+    }
+}
+
+fn reap_loop(ring: &Ring, stats: &Stats) {
+    loop {
+        let head = unsafe { (*ring.cq_head).load(Ordering::Relaxed) };
+        let tail = unsafe { (*ring.cq_tail).load(Ordering::Acquire) };
+        if head == tail {
+            stats.record_uring_enter();
+            if let Err(e) = ring.enter(0, 1, IORING_ENTER_GETEVENTS) {
+                eprintln!("[ERROR] io_uring wait failed: {e}");
+                std::process::exit(1);
+            }
+            continue;
+        }
+        let mut i = head;
+        while i != tail {
+            let cqe = unsafe { &*ring.cqes.add((i & ring.cq_mask) as usize) };
+            let done = unsafe { Arc::from_raw(cqe.user_data as *const Completion) };
+            done.post(cqe.res);
+            i = i.wrapping_add(1);
+        }
+        unsafe { (*ring.cq_head).store(tail, Ordering::Release) };
+    }
+}
+
+/**
+ * What a request reads or writes: a plain fd or a registered slot.
+ */
+#[derive(Clone, Copy)]
+pub(crate) enum Target {
+    Fd(RawFd),
+    Fixed(u32),
+}
+
+/**
+ * One registered buffer, given back to the pool when dropped.
+ */
+pub(crate) struct FixedBuf<'a> {
+    ring: &'a Uring,
+    index: u16,
+}
+
+impl FixedBuf<'_> {
+    fn ptr(&self) -> *mut u8 {
+        unsafe { self.ring.bufs.add(self.index as usize * BUF_SIZE) }
+    }
+
+    pub(crate) fn as_slice(&self) -> &[u8] {
+        unsafe { std::slice::from_raw_parts(self.ptr(), BUF_SIZE) }
+    }
+
+    pub(crate) fn as_mut_slice(&mut self) -> &mut [u8] {
+        unsafe { std::slice::from_raw_parts_mut(self.ptr(), BUF_SIZE) }
+    }
+}
+
+impl Drop for FixedBuf<'_> {
+    fn drop(&mut self) {
+        self.ring.free_bufs.lock().unwrap().push(self.index);
+        self.ring.buf_returned.notify_one();
+    }
+}
+
+/**
+ * A cache fd registered with the ring, unregistered when dropped.
+ */
+pub(crate) struct FixedFile {
+    ring: Arc<Uring>,
+    slot: u32,
+}
+
+impl FixedFile {
+    pub(crate) fn target(&self) -> Target {
+        Target::Fixed(self.slot)
+    }
+}
+
+impl Drop for FixedFile {
+    fn drop(&mut self) {
+        if self.ring.update_slot(self.slot, -1).is_ok() {
+            self.ring.free_slots.lock().unwrap().push(self.slot);
+        }
+    }
+}
+
+/**
+ * A write still in flight, owning its buffer. Dropping it waits for the
+ * write, the kernel may be reading the buffer until then.
+ */
+pub(crate) struct PendingWrite<'a> {
+    buf: Option<FixedBuf<'a>>,
+    done: Arc<Completion>,
+}
+
+impl<'a> PendingWrite<'a> {
+    pub(crate) fn wait(mut self) -> (FixedBuf<'a>, io::Result<usize>) {
+        let res = self.done.wait();
+        (self.buf.take().unwrap(), res)
+    }
+}
+
+impl Drop for PendingWrite<'_> {
+    fn drop(&mut self) {
+        if self.buf.is_some() {
+            let _ = self.done.wait();
+        }
+    }
+}
@@ -0,0 +1,74 @@
+use crate::TULFS;
+
+use tokio::runtime::{Builder, Handle, Runtime};
+
+/**
+ * Runs FUSE handlers as tasks on the client's tokio runtime, off the session
+ * loop, so that a request stuck on the network (a fetch in open, an upload in
+ * flush) doesn't hold up everything queued behind it. libssh2 and the cache
+ * file I/O block, so handlers go to the runtime's blocking pool, which grows
+ * up to `threads` and shrinks again when idle; the runtime's one async worker
+ * drives the TULFS server connection. Each job owns its Reply and answers the
+ * kernel from whichever thread runs it.
+ */
+pub struct WorkerPool {
+    rt: Option<Runtime>,
+}
+
+impl WorkerPool {
+    pub fn new(threads: usize) -> Self {
+        let rt = Builder::new_multi_thread()
+            .worker_threads(1)
+            .max_blocking_threads(threads.max(1))
+            .thread_name("tulfs-worker")
+            .enable_all()
+            .build()
+            .expect("Could not start worker runtime");
+        WorkerPool { rt: Some(rt) }
+    }
+
+    pub fn spawn(&self, job: impl FnOnce() + Send + 'static) {
+        self.rt.as_ref().unwrap().spawn_blocking(job);
+    }
+
+    pub fn handle(&self) -> &Handle {
+        self.rt.as_ref().unwrap().handle()
+    }
+}
+
+impl Drop for WorkerPool {
+    fn drop(&mut self) {
+        // The last reference may go away inside a job, where waiting for the
+        // pool to finish would wait for ourselves
+        if let Some(rt) = self.rt.take() {
+            rt.shutdown_background();
+        }
+    }
+}
+
+/**
+ * Held while fetching or uploading an inode, so two workers never move the
+ * same file at once. Dropping it lets the next one in.
+ */
+pub(crate) struct TransferGuard<'a> {
+    fs: &'a TULFS,
+    ino: u64,
+}
+
+impl TULFS {
+    pub(crate) fn begin_transfer(&self, ino: u64) -> TransferGuard<'_> {
+        let mut st = self.st.lock().unwrap();
+        while st.busy.contains(&ino) {
+            st = self.idle.wait(st).unwrap();
+        }
+        st.busy.insert(ino);
+        TransferGuard { fs: self, ino }
+    }
+}
+
+impl Drop for TransferGuard<'_> {
+    fn drop(&mut self) {
+        self.fs.st.lock().unwrap().busy.remove(&self.ino);
+        self.fs.idle.notify_all();
+    }
+}
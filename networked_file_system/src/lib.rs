@@ -0,0 +1,2 @@
+// Code shared between the TULFS client and the TULFS server.
+pub mod protocol;
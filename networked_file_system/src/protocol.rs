@@ -0,0 +1,127 @@
+use serde::{Deserialize, Serialize};
+use std::{
+    io,
+    path::PathBuf,
+    time::Duration,
+};
+use tokio::io::{AsyncBufRead, AsyncBufReadExt, AsyncWrite, AsyncWriteExt};
+
+// Where the server listens, on its own host only. Clients reach it by
+// forwarding an SSH channel to it
+pub const SERVER_SOCKET: &str = "/tmp/tulfs.sock";
+
+// How long a lease is good for, counted by the client from when it sent the
+// request and by the server from when it granted it
+pub const LEASE_TERM: Duration = Duration::from_secs(10);
+
+/**
+ * Attributes of a remote file as seen by the TULFS server.
+ *
+ * `size`, `mtime` and `mtime_nsec` together identify a version of the file:
+ * a client whose cached attributes match an invalidation's attributes may
+ * keep its cache (typically the change was its own upload).
+ */
+#[derive(Serialize, Deserialize, Debug, Clone, Copy, PartialEq, Eq)]
+pub struct RemoteAttr {
+    pub is_dir: bool,
+    pub size: u64,
+    pub perm: u32,
+    pub uid: u32,
+    pub gid: u32,
+    pub atime: i64,
+    pub mtime: i64,
+    pub mtime_nsec: u32,
+    #[serde(default)]
+    pub ctime: i64, // Not available over SFTP, 0 there
+    #[serde(default)]
+    pub ctime_nsec: u32,
+}
+
+impl RemoteAttr {
+    pub fn same_version(&self, other: &RemoteAttr) -> bool {
+        self.is_dir == other.is_dir
+            && self.size == other.size
+            && self.mtime == other.mtime
+            && self.mtime_nsec == other.mtime_nsec
+    }
+}
+
+#[derive(Serialize, Deserialize, Debug, Clone, Copy, PartialEq, Eq)]
+pub enum LeaseKind {
+    Read,  // Cache attributes and data, no one else may write
+    Write, // Exclusive, the holder may keep dirty data locally
+}
+
+/**
+ * Answer to one entry of a Lease request. `kind` is None if the lease was
+ * denied because another client holds a conflicting one (the server has
+ * recalled it, so retrying shortly should succeed). `attr` is None if the
+ * path does not exist.
+ */
+#[derive(Serialize, Deserialize, Debug, Clone)]
+pub struct LeaseGrant {
+    pub path: PathBuf,
+    pub kind: Option<LeaseKind>,
+    pub attr: Option<RemoteAttr>,
+}
+
+/**
+ * Messages exchanged with the TULFS server. All paths are absolute paths on
+ * the server, i.e. they include the client's backing root.
+ */
+#[derive(Serialize, Deserialize, Debug, Clone)]
+pub enum Message {
+    // client -> server
+    Register { path: PathBuf }, // Stat `path` and keep a callback on it until Unregister or it is gone
+    Unregister { path: PathBuf },
+    Changed { path: PathBuf }, // The sender modified `path`; break everyone else's callbacks
+    Lease { requests: Vec<(PathBuf, LeaseKind)> }, // Acquire or renew, answered with Leases
+    Unlease { paths: Vec<PathBuf> },
+    // Copy `len` bytes between two files on the server, answered with Copied
+    CopyRange { src: PathBuf, src_offset: u64, dst: PathBuf, dst_offset: u64, len: u64 },
+    // fallocate(2) with `mode` on `path`, answered with the Attr it leaves
+    Allocate { path: PathBuf, offset: u64, len: u64, mode: i32 },
+
+    // server -> client
+    Attr(RemoteAttr),
+    Error { errno: i32 },
+    Invalidate { path: PathBuf, attr: Option<RemoteAttr> }, // attr is None if path is gone
+    Leases(Vec<LeaseGrant>),
+    Recall { path: PathBuf }, // Give up the lease on `path`, uploading dirty data first
+    Copied { bytes: u64 },    // Less than asked for if the source ended first
+}
+
+/**
+ * A message on the wire. Replies carry the id of the request they answer;
+ * messages pushed by the server (callbacks) use id 0.
+ */
+#[derive(Serialize, Deserialize, Debug, Clone)]
+pub struct Frame {
+    pub id: u64,
+    pub msg: Message,
+}
+
+pub const PUSH_ID: u64 = 0;
+
+// Frames are newline delimited JSON. Each frame goes out in a single write so
+// that writers sharing a socket never interleave.
+pub async fn write_frame(w: &mut (impl AsyncWrite + Unpin), frame: &Frame) -> io::Result<()> {
+    let mut buf = serde_json::to_vec(frame).map_err(io::Error::other)?;
+    buf.push(b'\n');
+    w.write_all(&buf).await?;
+    w.flush().await
+}
+
+/**
+ * Reads the next frame. Returns Ok(None) once the peer has closed the
+ * connection.
+ */
+pub async fn read_frame(r: &mut (impl AsyncBufRead + Unpin)) -> io::Result<Option<Frame>> {
+    let mut line = String::new();
+    if r.read_line(&mut line).await? == 0 {
+        return Ok(None);
+    }
+    serde_json::from_str(&line)
+        .map(Some)
+        .map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e))
+}
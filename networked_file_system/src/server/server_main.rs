@@ -1 +1,829 @@
-fn main() {}
\ No newline at end of file
+use networked_file_system::protocol::{
+    self, Frame, LeaseGrant, LeaseKind, Message, RemoteAttr, LEASE_TERM, PUSH_ID, SERVER_SOCKET,
+};
+
+use libc::{
+    gid_t, uid_t, EACCES, EINVAL, EIO, IN_ATTRIB, IN_CLOSE_WRITE, IN_CREATE, IN_DELETE, IN_DELETE_SELF,
+    IN_IGNORED, IN_MODIFY, IN_MOVE_SELF, IN_MOVED_FROM, IN_MOVED_TO, IN_Q_OVERFLOW,
+};
+
+use tokio::{
+    io::BufReader,
+    net::{UnixListener, UnixStream},
+    sync::mpsc,
+};
+
+use std::{
+    collections::{HashMap, HashSet},
+    ffi::{CString, OsStr},
+    fs::{File, OpenOptions},
+    os::{
+        fd::{AsRawFd, FromRawFd},
+        unix::{
+            ffi::OsStrExt,
+            fs::{FileTypeExt, MetadataExt, OpenOptionsExt, PermissionsExt},
+        },
+    },
+    path::{Component, Path, PathBuf},
+    sync::{Arc, Mutex},
+    thread,
+    time::{Duration, Instant},
+};
+
+const WATCH_MASK: u32 = IN_MODIFY
+    | IN_CLOSE_WRITE
+    | IN_ATTRIB
+    | IN_CREATE
+    | IN_DELETE
+    | IN_MOVED_FROM
+    | IN_MOVED_TO
+    | IN_DELETE_SELF
+    | IN_MOVE_SELF;
+
+// Events that add or remove names in the watched directory itself
+const DIR_CHANGE_MASK: u32 = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+
+// Leases outlive the client's view of them by this much, covering the time
+// between the client sending a request and us granting it
+const LEASE_GRACE: Duration = Duration::from_secs(2);
+
+// Paths one client may hold callbacks on. Past this registering fails with
+// EIO, and the client falls back to leases or plain stats
+const MAX_CALLBACKS: usize = 1 << 16;
+
+struct LeaseEntry {
+    client: u64,
+    kind: LeaseKind,
+    expires: Instant,
+}
+
+/**
+ * Who is on the other end of a connection, from SO_PEERCRED. Requests are
+ * served with these file system credentials, so a client can reach no more
+ * than its user could over SFTP.
+ */
+struct Peer {
+    uid: uid_t,
+    gid: gid_t,
+    groups: Vec<gid_t>,
+}
+
+struct Callbacks {
+    holders: HashSet<u64>,
+    dir: PathBuf, // The watched directory that reports changes to the path
+}
+
+#[derive(Default)]
+struct State {
+    next_client: u64,
+    clients: HashMap<u64, mpsc::UnboundedSender<Frame>>, // Outgoing queue of every connected client
+    callbacks: HashMap<PathBuf, Callbacks>, // Path to the clients caching it
+    held: HashMap<u64, usize>,              // Number of paths each client holds callbacks on
+    leases: HashMap<PathBuf, Vec<LeaseEntry>>,
+
+    wd_to_dir: HashMap<i32, PathBuf>,
+    dir_to_wd: HashMap<PathBuf, i32>,
+    watch_refs: HashMap<PathBuf, usize>, // Callback paths reported by each watched directory
+}
+
+struct TULFSServer {
+    export_root: PathBuf, // Only paths below this directory are served
+    root: File,           // O_PATH fd of export_root, files are opened beneath it
+    inotify_fd: i32,
+    st: Mutex<State>,
+    own_groups: Vec<gid_t>, // Put back after serving a request as a client's user
+}
+
+fn errno_of(e: &std::io::Error) -> i32 {
+    e.raw_os_error().unwrap_or(EIO)
+}
+
+fn attr_of(path: &Path) -> Result<RemoteAttr, i32> {
+    let md = std::fs::metadata(path).map_err(|e| errno_of(&e))?;
+    Ok(attr_from(&md))
+}
+
+fn attr_from(md: &std::fs::Metadata) -> RemoteAttr {
+    RemoteAttr {
+        is_dir: md.is_dir(),
+        size: md.size(),
+        perm: md.mode() & 0o7777,
+        uid: md.uid(),
+        gid: md.gid(),
+        atime: md.atime(),
+        mtime: md.mtime(),
+        mtime_nsec: md.mtime_nsec() as u32,
+        ctime: md.ctime(),
+        ctime_nsec: md.ctime_nsec() as u32,
+    }
+}
+
+impl TULFSServer {
+    fn new(export_root: PathBuf) -> Self {
+        let root = OpenOptions::new()
+            .read(true)
+            .custom_flags(libc::O_PATH | libc::O_DIRECTORY)
+            .open(&export_root)
+            .unwrap_or_else(|e| {
+                eprintln!("[ERROR] Could not open export root: {e}");
+                std::process::exit(1);
+            });
+        let inotify_fd = unsafe { libc::inotify_init1(libc::IN_CLOEXEC) };
+        if inotify_fd < 0 {
+            eprintln!(
+                "[ERROR] inotify_init1 failed: {}",
+                std::io::Error::last_os_error()
+            );
+            std::process::exit(1);
+        }
+        TULFSServer {
+            export_root,
+            root,
+            inotify_fd,
+            st: Mutex::new(State::default()),
+            own_groups: groups_of_process(),
+        }
+    }
+
+    /**
+     * Rejects relative paths, paths containing `..` and paths outside the
+     * export root, also once symlinks are resolved. A missing last component
+     * is taken as is, its parent must still resolve inside. Paths stay
+     * unresolved as keys, that's how clients name them.
+     */
+    fn check_path(&self, path: &Path) -> Result<(), i32> {
+        if !path.is_absolute() {
+            return Err(EINVAL);
+        }
+        if path.components().any(|c| c == Component::ParentDir) {
+            return Err(EACCES);
+        }
+        if !path.starts_with(&self.export_root) {
+            return Err(EACCES);
+        }
+        let resolved = match std::fs::canonicalize(path) {
+            Ok(p) => p,
+            Err(e) if e.kind() == std::io::ErrorKind::NotFound => match path.parent() {
+                Some(parent) => std::fs::canonicalize(parent).map_err(|e| errno_of(&e))?,
+                None => return Err(EACCES),
+            },
+            Err(e) => return Err(errno_of(&e)),
+        };
+        if !resolved.starts_with(&self.export_root) {
+            return Err(EACCES);
+        }
+        Ok(())
+    }
+
+    /**
+     * Opens `path`, which check_path() accepted, with open(2) `flags` and
+     * without leaving the export root on the way: openat2 resolves it
+     * beneath the root, so a symlink swapped in after the check can't lead
+     * out. Kernels before 5.6 get a resolved path opened with O_NOFOLLOW.
+     */
+    fn open_beneath(&self, path: &Path, flags: i32) -> std::io::Result<File> {
+        let rel = path.strip_prefix(&self.export_root).map_err(|_| std::io::Error::from_raw_os_error(EACCES))?;
+        let rel = if rel.as_os_str().is_empty() { Path::new(".") } else { rel };
+        let c_rel = CString::new(rel.as_os_str().as_bytes())?;
+        let mut how: libc::open_how = unsafe { std::mem::zeroed() };
+        how.flags = (flags | libc::O_CLOEXEC | libc::O_NOCTTY) as u64;
+        how.resolve = libc::RESOLVE_BENEATH | libc::RESOLVE_NO_MAGICLINKS;
+        let fd = unsafe {
+            libc::syscall(
+                libc::SYS_openat2,
+                self.root.as_raw_fd(),
+                c_rel.as_ptr(),
+                &how as *const libc::open_how,
+                std::mem::size_of::<libc::open_how>(),
+            )
+        };
+        if fd >= 0 {
+            return Ok(unsafe { File::from_raw_fd(fd as i32) });
+        }
+        let e = std::io::Error::last_os_error();
+        if e.raw_os_error() != Some(libc::ENOSYS) {
+            return Err(e);
+        }
+        let resolved = std::fs::canonicalize(path)?;
+        if !resolved.starts_with(&self.export_root) {
+            return Err(std::io::Error::from_raw_os_error(EACCES));
+        }
+        OpenOptions::new()
+            .read(flags & libc::O_ACCMODE != libc::O_WRONLY)
+            .write(flags & libc::O_ACCMODE != libc::O_RDONLY)
+            .custom_flags(flags & !libc::O_ACCMODE | libc::O_NOFOLLOW)
+            .open(resolved)
+    }
+
+    /**
+     * Runs `f` with the file system credentials of `peer`, on this thread
+     * only. setgroups goes through the raw syscall because the libc wrapper
+     * changes every thread of the process.
+     */
+    fn as_peer<T>(&self, peer: &Peer, f: impl FnOnce() -> T) -> T {
+        if unsafe { libc::geteuid() } != 0 {
+            // Only our own user gets in, nothing to switch
+            return f();
+        }
+        unsafe {
+            libc::syscall(libc::SYS_setgroups, peer.groups.len(), peer.groups.as_ptr());
+            libc::setfsgid(peer.gid);
+            libc::setfsuid(peer.uid);
+        }
+        let res = f();
+        unsafe {
+            libc::setfsuid(0);
+            libc::setfsgid(0);
+            libc::syscall(libc::SYS_setgroups, self.own_groups.len(), self.own_groups.as_ptr());
+        }
+        res
+    }
+
+    /**
+     * Adds an inotify watch on `dir` unless there already is one.
+     * Must be called with the state lock held.
+     */
+    fn watch_dir(&self, st: &mut State, dir: &Path) {
+        if st.dir_to_wd.contains_key(dir) {
+            return;
+        }
+        let Ok(c_dir) = CString::new(dir.as_os_str().as_bytes()) else {
+            return;
+        };
+        let wd = unsafe { libc::inotify_add_watch(self.inotify_fd, c_dir.as_ptr(), WATCH_MASK) };
+        if wd < 0 {
+            eprintln!(
+                "Failed to watch {:?}: {}",
+                dir,
+                std::io::Error::last_os_error()
+            );
+            return;
+        }
+        st.wd_to_dir.insert(wd, dir.to_path_buf());
+        st.dir_to_wd.insert(dir.to_path_buf(), wd);
+    }
+
+    /**
+     * Records a callback of `client` on `path`, reported by the watch on
+     * `dir`. Must be called with the state lock held.
+     */
+    fn add_callback(&self, st: &mut State, client: u64, path: &Path, dir: &Path) -> Result<(), i32> {
+        if st.callbacks.get(path).is_some_and(|cb| cb.holders.contains(&client)) {
+            return Ok(());
+        }
+        let held = st.held.entry(client).or_default();
+        if *held >= MAX_CALLBACKS {
+            return Err(EIO);
+        }
+        *held += 1;
+        let callbacks = st.callbacks.entry(path.to_path_buf()).or_insert_with(|| Callbacks {
+            holders: HashSet::new(),
+            dir: dir.to_path_buf(),
+        });
+        callbacks.holders.insert(client);
+        if callbacks.holders.len() == 1 {
+            *st.watch_refs.entry(dir.to_path_buf()).or_default() += 1;
+        }
+        Ok(())
+    }
+
+    /**
+     * Drops the callback of `client` on `path`, and the watch that reported
+     * it once no other callback needs it. Must be called with the state lock
+     * held.
+     */
+    fn remove_callback(&self, st: &mut State, client: u64, path: &Path) {
+        let Some(callbacks) = st.callbacks.get_mut(path) else {
+            return;
+        };
+        if !callbacks.holders.remove(&client) {
+            return;
+        }
+        if let Some(held) = st.held.get_mut(&client) {
+            *held -= 1;
+        }
+        if !callbacks.holders.is_empty() {
+            return;
+        }
+        let dir = st.callbacks.remove(path).unwrap().dir;
+        let refs = st.watch_refs.entry(dir.clone()).or_default();
+        *refs = refs.saturating_sub(1);
+        if *refs > 0 {
+            return;
+        }
+        st.watch_refs.remove(&dir);
+        if let Some(wd) = st.dir_to_wd.remove(&dir) {
+            st.wd_to_dir.remove(&wd);
+            unsafe { libc::inotify_rm_watch(self.inotify_fd, wd) };
+        }
+    }
+
+    /**
+     * Sends an invalidation for `path` to every client holding a callback on
+     * it, except `except`. Must be called with the state lock held so that
+     * pushes stay ordered with replies. Callbacks on a path that is gone
+     * are dropped with it, a client looking again registers anew.
+     */
+    fn break_callbacks(&self, st: &mut State, path: &Path, except: Option<u64>) {
+        let Some(callbacks) = st.callbacks.get(path) else {
+            return;
+        };
+        let attr = attr_of(path).ok();
+        let holders: Vec<u64> = callbacks.holders.iter().copied().collect();
+        for &client in &holders {
+            if Some(client) == except {
+                continue;
+            }
+            if let Some(tx) = st.clients.get(&client) {
+                let msg = Message::Invalidate {
+                    path: path.to_path_buf(),
+                    attr,
+                };
+                let _ = tx.send(Frame { id: PUSH_ID, msg });
+            }
+        }
+        if attr.is_none() {
+            for client in holders {
+                self.remove_callback(st, client, path);
+            }
+        }
+    }
+
+    /**
+     * Forgets the watch `wd` on `dir`, which the kernel dropped because the
+     * directory is gone. Nothing reports changes to the paths it covered any
+     * more, so their callbacks are broken and dropped, whether or not the
+     * paths still exist; clients looking again register under a new watch.
+     * Must be called with the state lock held.
+     */
+    fn watch_gone(&self, st: &mut State, wd: i32, dir: &Path) {
+        st.wd_to_dir.remove(&wd);
+        st.dir_to_wd.remove(dir);
+        let paths: Vec<PathBuf> = st
+            .callbacks
+            .iter()
+            .filter(|(_, cb)| cb.dir == dir)
+            .map(|(path, _)| path.clone())
+            .collect();
+        for path in paths {
+            self.break_callbacks(st, &path, None);
+            let holders: Vec<u64> = st
+                .callbacks
+                .get(&path)
+                .map(|cb| cb.holders.iter().copied().collect())
+                .unwrap_or_default();
+            for client in holders {
+                self.remove_callback(st, client, &path);
+            }
+        }
+        st.watch_refs.remove(dir);
+    }
+
+    fn register(&self, client: u64, path: &Path) -> Message {
+        if let Err(errno) = self.check_path(path) {
+            return Message::Error { errno };
+        }
+        let mut st = self.st.lock().unwrap();
+        // Stat under the lock: any change after this point produces an
+        // invalidation that is queued behind this reply.
+        let attr = match attr_of(path) {
+            Ok(a) => a,
+            Err(errno) => return Message::Error { errno },
+        };
+        let dir = if attr.is_dir {
+            path
+        } else {
+            path.parent().unwrap_or(path)
+        };
+        if let Err(errno) = self.add_callback(&mut st, client, path, dir) {
+            return Message::Error { errno };
+        }
+        self.watch_dir(&mut st, dir);
+        Message::Attr(attr)
+    }
+
+    fn unregister(&self, client: u64, path: &Path) {
+        let mut st = self.st.lock().unwrap();
+        self.remove_callback(&mut st, client, path);
+    }
+
+    fn changed(&self, client: u64, path: &Path) -> Message {
+        if let Err(errno) = self.check_path(path) {
+            return Message::Error { errno };
+        }
+        let mut st = self.st.lock().unwrap();
+        self.break_callbacks(&mut st, path, Some(client));
+        // Also break callbacks on the parent, the change may have added the name
+        if let Some(parent) = path.parent() {
+            self.break_callbacks(&mut st, parent, Some(client));
+        }
+        drop(st);
+        // Hand the writer the new version so it can keep its own cache
+        self.register(client, path)
+    }
+
+    /**
+     * Grants or renews a batch of leases. A read lease conflicts with another
+     * client's write lease, a write lease with any other client's lease.
+     * Conflicting holders are sent a Recall and the request is denied; the
+     * requester is expected to retry once the holder has let go.
+     */
+    fn lease(&self, client: u64, requests: Vec<(PathBuf, LeaseKind)>) -> Message {
+        let mut st = self.st.lock().unwrap();
+        let now = Instant::now();
+        let mut grants = Vec::with_capacity(requests.len());
+        for (path, kind) in requests {
+            if self.check_path(&path).is_err() {
+                grants.push(LeaseGrant { path, kind: None, attr: None });
+                continue;
+            }
+            let Ok(attr) = attr_of(&path) else {
+                grants.push(LeaseGrant { path, kind: None, attr: None });
+                continue;
+            };
+            let attr = Some(attr);
+            let holders = st.leases.entry(path.clone()).or_default();
+            holders.retain(|l| l.expires > now);
+
+            let conflicts: Vec<u64> = holders
+                .iter()
+                .filter(|l| {
+                    l.client != client && (kind == LeaseKind::Write || l.kind == LeaseKind::Write)
+                })
+                .map(|l| l.client)
+                .collect();
+            if !conflicts.is_empty() {
+                for holder in conflicts {
+                    if let Some(tx) = st.clients.get(&holder) {
+                        let msg = Message::Recall { path: path.clone() };
+                        let _ = tx.send(Frame { id: PUSH_ID, msg });
+                    }
+                }
+                grants.push(LeaseGrant { path, kind: None, attr });
+                continue;
+            }
+
+            let expires = now + LEASE_TERM + LEASE_GRACE;
+            // Renewing a read lease while holding the write lease keeps it a write lease
+            let granted = match holders.iter_mut().find(|l| l.client == client) {
+                Some(own) => {
+                    if kind == LeaseKind::Write {
+                        own.kind = LeaseKind::Write;
+                    }
+                    own.expires = expires;
+                    own.kind
+                }
+                None => {
+                    holders.push(LeaseEntry { client, kind, expires });
+                    kind
+                }
+            };
+            grants.push(LeaseGrant { path, kind: Some(granted), attr });
+        }
+        Message::Leases(grants)
+    }
+
+    fn unlease(&self, client: u64, paths: &[PathBuf]) {
+        let mut st = self.st.lock().unwrap();
+        for path in paths {
+            if let Some(holders) = st.leases.get_mut(path) {
+                holders.retain(|l| l.client != client);
+                if holders.is_empty() {
+                    st.leases.remove(path);
+                }
+            }
+        }
+    }
+
+    fn drop_client(&self, client: u64) {
+        let mut st = self.st.lock().unwrap();
+        st.clients.remove(&client);
+        let held: Vec<PathBuf> = st
+            .callbacks
+            .iter()
+            .filter(|(_, cb)| cb.holders.contains(&client))
+            .map(|(path, _)| path.clone())
+            .collect();
+        for path in held {
+            self.remove_callback(&mut st, client, &path);
+        }
+        st.held.remove(&client);
+        st.leases.retain(|_, holders| {
+            holders.retain(|l| l.client != client);
+            !holders.is_empty()
+        });
+    }
+
+    /**
+     * Copies `len` bytes of `src` at `src_offset` into `dst` at `dst_offset`
+     * without the data leaving the server. copy_file_range shares the
+     * extents instead where the file system can (XFS, Btrfs) and copies in
+     * the kernel otherwise. The inotify watches tell other clients. Both
+     * files are opened beneath the export root, as the client's user.
+     */
+    fn copy_range(&self, src: &Path, src_offset: u64, dst: &Path, dst_offset: u64, len: u64) -> Message {
+        if let Err(errno) = self.check_path(src).and(self.check_path(dst)) {
+            return Message::Error { errno };
+        }
+        let files = self
+            .open_beneath(src, libc::O_RDONLY)
+            .and_then(|from| Ok((from, self.open_beneath(dst, libc::O_WRONLY)?)));
+        let (from, to) = match files {
+            Ok(files) => files,
+            Err(e) => return Message::Error { errno: errno_of(&e) },
+        };
+        let mut copied = 0u64;
+        while copied < len {
+            let mut off_in = (src_offset + copied) as i64;
+            let mut off_out = (dst_offset + copied) as i64;
+            let n = unsafe {
+                libc::copy_file_range(
+                    from.as_raw_fd(),
+                    &mut off_in,
+                    to.as_raw_fd(),
+                    &mut off_out,
+                    (len - copied) as usize,
+                    0,
+                )
+            };
+            if n < 0 {
+                let e = std::io::Error::last_os_error();
+                if copied == 0 {
+                    return Message::Error { errno: errno_of(&e) };
+                }
+                break;
+            }
+            if n == 0 {
+                break;
+            }
+            copied += n as u64;
+        }
+        Message::Copied { bytes: copied }
+    }
+
+    /**
+     * Allocates, punches or zeroes a range of `path` as fallocate(2) does,
+     * which SFTP has no request for. Like copy_range(), the file is opened
+     * beneath the export root as the client's user.
+     */
+    fn allocate(&self, path: &Path, offset: u64, len: u64, mode: i32) -> Message {
+        if let Err(errno) = self.check_path(path) {
+            return Message::Error { errno };
+        }
+        let file = match self.open_beneath(path, libc::O_WRONLY) {
+            Ok(file) => file,
+            Err(e) => return Message::Error { errno: errno_of(&e) },
+        };
+        if unsafe { libc::fallocate(file.as_raw_fd(), mode, offset as i64, len as i64) } < 0 {
+            return Message::Error { errno: errno_of(&std::io::Error::last_os_error()) };
+        }
+        match file.metadata() {
+            Ok(md) => Message::Attr(attr_from(&md)),
+            Err(e) => Message::Error { errno: errno_of(&e) },
+        }
+    }
+
+    /**
+     * Answers one request, None for the ones that get no reply.
+     */
+    fn handle(&self, client: u64, msg: Message) -> Option<Message> {
+        let reply = match msg {
+            Message::Register { path } => self.register(client, &path),
+            Message::Unregister { path } => {
+                self.unregister(client, &path);
+                return None;
+            }
+            Message::Changed { path } => self.changed(client, &path),
+            Message::Lease { requests } => self.lease(client, requests),
+            Message::Unlease { paths } => {
+                self.unlease(client, &paths);
+                return None;
+            }
+            Message::CopyRange { src, src_offset, dst, dst_offset, len } => {
+                self.copy_range(&src, src_offset, &dst, dst_offset, len)
+            }
+            Message::Allocate { path, offset, len, mode } => self.allocate(&path, offset, len, mode),
+            _ => Message::Error { errno: EINVAL },
+        };
+        Some(reply)
+    }
+
+    /**
+     * Serves one client connection. Each client is a pair of tasks rather
+     * than threads, so the number of clients isn't bounded by threads.
+     * Clients come in through sshd, so the peer is the user the client
+     * authenticated as.
+     */
+    async fn handle_client(self: Arc<Self>, stream: UnixStream) {
+        let peer = match stream.peer_cred().map(|cred| peer_of(cred.uid(), cred.gid())) {
+            Ok(Some(peer)) => Arc::new(peer),
+            _ => {
+                eprintln!("Refusing a client whose user can't be told");
+                return;
+            }
+        };
+        let euid = unsafe { libc::geteuid() };
+        if euid != 0 && peer.uid != euid {
+            eprintln!("Refusing a client of uid {}, not running as root", peer.uid);
+            return;
+        }
+        let (tx, mut rx) = mpsc::unbounded_channel::<Frame>();
+        let client = {
+            let mut st = self.st.lock().unwrap();
+            st.next_client += 1;
+            let client = st.next_client;
+            st.clients.insert(client, tx.clone());
+            client
+        };
+        println!("Client {} connected as uid {}", client, peer.uid);
+
+        // Writer task: everything sent to this client goes through `tx`
+        let (reader, mut out) = stream.into_split();
+        tokio::spawn(async move {
+            while let Some(frame) = rx.recv().await {
+                if protocol::write_frame(&mut out, &frame).await.is_err() {
+                    break;
+                }
+            }
+        });
+
+        let mut reader = BufReader::new(reader);
+        loop {
+            let frame = match protocol::read_frame(&mut reader).await {
+                Ok(Some(f)) => f,
+                Ok(None) => break,
+                Err(e) => {
+                    eprintln!("Client {}: bad frame: {e}", client);
+                    break;
+                }
+            };
+            // A copy may move a lot of data, it mustn't hold up the lease
+            // renewals and registrations behind it. Replies are matched by id
+            if matches!(frame.msg, Message::CopyRange { .. }) {
+                let (server, peer, tx) = (self.clone(), peer.clone(), tx.clone());
+                tokio::task::spawn_blocking(move || {
+                    if let Some(reply) = server.as_peer(&peer, || server.handle(client, frame.msg)) {
+                        let _ = tx.send(Frame { id: frame.id, msg: reply });
+                    }
+                });
+                continue;
+            }
+            // Requests stat files and take the state lock, which may block
+            let Some(reply) =
+                tokio::task::block_in_place(|| self.as_peer(&peer, || self.handle(client, frame.msg)))
+            else {
+                continue;
+            };
+            if tx.send(Frame { id: frame.id, msg: reply }).is_err() {
+                break;
+            }
+        }
+
+        self.drop_client(client);
+        println!("Client {} disconnected", client);
+    }
+
+    /**
+     * Turns inotify events into callback breaks. This covers changes made
+     * directly on the server as well as writes arriving over SFTP.
+     */
+    fn inotify_loop(self: Arc<Self>) {
+        // u64 backing storage keeps the buffer aligned for inotify_event
+        let mut buf = vec![0u64; 8192];
+        let ev_size = std::mem::size_of::<libc::inotify_event>();
+        loop {
+            let n = unsafe {
+                libc::read(
+                    self.inotify_fd,
+                    buf.as_mut_ptr() as *mut libc::c_void,
+                    buf.len() * 8,
+                )
+            };
+            if n < 0 {
+                let err = std::io::Error::last_os_error();
+                if err.kind() == std::io::ErrorKind::Interrupted {
+                    continue;
+                }
+                eprintln!("[ERROR] inotify read failed: {err}");
+                return;
+            }
+            let bytes =
+                unsafe { std::slice::from_raw_parts(buf.as_ptr() as *const u8, n as usize) };
+
+            let mut st = self.st.lock().unwrap();
+            let mut off = 0;
+            while off + ev_size <= bytes.len() {
+                let ev: libc::inotify_event =
+                    unsafe { std::ptr::read_unaligned(bytes[off..].as_ptr() as *const _) };
+                let name_bytes = &bytes[off + ev_size..off + ev_size + ev.len as usize];
+                off += ev_size + ev.len as usize;
+
+                if ev.mask & IN_Q_OVERFLOW != 0 {
+                    // Events were lost, nothing cached anywhere can be trusted
+                    let paths: Vec<PathBuf> = st.callbacks.keys().cloned().collect();
+                    for p in paths {
+                        self.break_callbacks(&mut st, &p, None);
+                    }
+                    continue;
+                }
+                let Some(dir) = st.wd_to_dir.get(&ev.wd).cloned() else {
+                    continue;
+                };
+                if ev.mask & IN_IGNORED != 0 {
+                    self.watch_gone(&mut st, ev.wd, &dir);
+                    continue;
+                }
+
+                let name_len = name_bytes
+                    .iter()
+                    .position(|&b| b == 0)
+                    .unwrap_or(name_bytes.len());
+                if name_len == 0 {
+                    // The event is about the watched directory itself
+                    self.break_callbacks(&mut st, &dir, None);
+                    continue;
+                }
+                let child = dir.join(OsStr::from_bytes(&name_bytes[..name_len]));
+                self.break_callbacks(&mut st, &child, None);
+                if ev.mask & DIR_CHANGE_MASK != 0 {
+                    self.break_callbacks(&mut st, &dir, None);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * The user `uid` with primary group `gid` and its supplementary groups, None
+ * if it has no passwd entry.
+ */
+fn peer_of(uid: uid_t, gid: gid_t) -> Option<Peer> {
+    let mut pwd: libc::passwd = unsafe { std::mem::zeroed() };
+    let mut result = std::ptr::null_mut();
+    let mut buf = vec![0 as libc::c_char; 16 << 10];
+    let rc = unsafe { libc::getpwuid_r(uid, &mut pwd, buf.as_mut_ptr(), buf.len(), &mut result) };
+    if rc != 0 || result.is_null() {
+        return None;
+    }
+    let mut groups = vec![0 as gid_t; 64];
+    loop {
+        let mut n = groups.len() as libc::c_int;
+        if unsafe { libc::getgrouplist(pwd.pw_name, gid, groups.as_mut_ptr(), &mut n) } >= 0 {
+            groups.truncate(n as usize);
+            break;
+        }
+        groups.resize(n as usize, 0);
+    }
+    Some(Peer { uid, gid, groups })
+}
+
+fn groups_of_process() -> Vec<gid_t> {
+    let n = unsafe { libc::getgroups(0, std::ptr::null_mut()) };
+    let mut groups = vec![0 as gid_t; n.max(0) as usize];
+    let n = unsafe { libc::getgroups(groups.len() as libc::c_int, groups.as_mut_ptr()) };
+    groups.truncate(n.max(0) as usize);
+    groups
+}
+
+#[tokio::main]
+async fn main() {
+    let args: Vec<_> = std::env::args().skip(1).collect();
+    if args.is_empty() || args.len() > 2 {
+        eprintln!("Usage: server <export_root> [socket]");
+        std::process::exit(1);
+    }
+    let export_root = match std::fs::canonicalize(&args[0]) {
+        Ok(p) if p.is_dir() => p,
+        _ => {
+            eprintln!("[ERROR] Export root must be an existing directory");
+            std::process::exit(1);
+        }
+    };
+    let socket = PathBuf::from(args.get(1).map_or(SERVER_SOCKET, |s| s.as_str()));
+
+    let server = Arc::new(TULFSServer::new(export_root.clone()));
+    let inotify_server = server.clone();
+    thread::spawn(move || inotify_server.inotify_loop());
+
+    // Only on this host: clients forward an SSH channel to the socket, and
+    // who they are comes with the connection
+    if std::fs::symlink_metadata(&socket).is_ok_and(|md| md.file_type().is_socket()) {
+        let _ = std::fs::remove_file(&socket);
+    }
+    let listener = UnixListener::bind(&socket).expect("Could not bind server socket");
+    // Any user may connect, and is served as that user
+    std::fs::set_permissions(&socket, std::fs::Permissions::from_mode(0o666))
+        .expect("Could not open up server socket");
+    println!(
+        "TULFS server exporting {:?} on {:?}",
+        export_root, socket
+    );
+    loop {
+        match listener.accept().await {
+            Ok((s, _)) => {
+                tokio::spawn(server.clone().handle_client(s));
+            }
+            Err(e) => eprintln!("Accept failed: {e}"),
+        }
+    }
+}